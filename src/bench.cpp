@@ -0,0 +1,890 @@
+#include "pch.h"
+
+#include "bench.h"
+#include "rid.h"
+#include "utils.h"
+#include "download_pool.h"
+#include "http_engine.h"
+#include "http_share.h"
+#include "mock_server.h"
+#include "listing_parser.h"
+#include "perceptual_hash.h"
+#include "download_sink.h"
+#include "file_writer.h"
+#include "url.h"
+#include "resolver.h"
+#include "pack_storage.h"
+#include "memory_budget.h"
+
+namespace Bench
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+double ms_since(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// latency in ms for each fake post: most images are served fast
+// by the CDN, every now and then a big video takes forever
+vector<unsigned> skewed_latencies(size_t count)
+{
+    std::mt19937 rng(42);
+    std::lognormal_distribution<double> fast(std::log(30.0), 0.5);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+
+    vector<unsigned> res;
+    res.reserve(count);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        double ms = coin(rng) < 0.08 ? 1500.0 : fast(rng);
+        res.push_back(static_cast<unsigned>(ms));
+    }
+
+    return res;
+}
+
+Mock_Response delay_handler(const Mock_Request& req)
+{
+    // path: /delay/<ms>
+    auto parts = Utils::split_string(req.path, "/");
+
+    if (parts.size() == 3 and parts[1] == "delay")
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::stoul(parts[2])));
+        return { .content_type = "image/jpeg", .body = string(16 * 1024, 'x') };
+    }
+
+    return { .code = 404 };
+}
+
+struct Busy_Time
+{
+    std::atomic<long long> us = 0;
+};
+
+Thread_Result fake_download(const Mock_Server& server,
+                            long file_id,
+                            unsigned latency_ms,
+                            Busy_Time& busy)
+{
+    auto start = Clock::now();
+
+    auto resp = perform_http_request(server.url(std::format("/delay/{}", latency_ms)));
+
+    busy.us += std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - start).count();
+
+    bool ok = resp.has_value() and resp->code == 200;
+
+    return {
+        .file_id = file_id,
+        .title = "bench",
+        .url = "bench",
+        .download_res = { ok ? Download_Result::DOWNLOADED : Download_Result::FAILED }
+    };
+}
+
+void print_run(const char* name, double wall_ms, const Busy_Time& busy, unsigned workers)
+{
+    double busy_ms = static_cast<double>(busy.us.load()) / 1000.0;
+    double utilisation = busy_ms / (wall_ms * workers);
+
+    cout << std::format("[BENCH] {:<28} wall: {:>8.1f} ms  utilisation: {:>5.1f}%",
+                        name, wall_ms, utilisation * 100.0) << endl;
+}
+
+void bench_download_pool()
+{
+    cout << "[BENCH] download pool vs batch barrier, skewed latency" << endl;
+
+    Mock_Server server(delay_handler);
+    if (not server.is_running())
+        return;
+
+    auto latencies = skewed_latencies(300);
+    const unsigned workers = g_num_threads;
+
+    // the old loop inside rid(): start a batch, wait for all of it
+    {
+        Busy_Time busy;
+        auto start = Clock::now();
+
+        size_t next = 0;
+        while (next < latencies.size())
+        {
+            vector<std::future<Thread_Result>> batch;
+
+            for (unsigned i = 0; i < workers and next < latencies.size(); ++i, ++next)
+            {
+                batch.push_back(std::async(std::launch::async, fake_download,
+                                           std::cref(server), static_cast<long>(next),
+                                           latencies[next], std::ref(busy)));
+            }
+
+            for (auto& f : batch)
+                f.get();
+        }
+
+        print_run("batch of futures", ms_since(start), busy, workers);
+    }
+
+    // persistent pool
+    {
+        Busy_Time busy;
+        auto start = Clock::now();
+
+        Download_Pool pool(workers);
+
+        for (size_t i = 0; i < latencies.size(); ++i)
+        {
+            pool.submit([&server, &busy, i, ms = latencies[i]]
+            {
+                return fake_download(server, static_cast<long>(i), ms, busy);
+            });
+        }
+
+        while (pool.wait_result())
+        {
+        }
+
+        print_run("persistent pool", ms_since(start), busy, workers);
+    }
+}
+
+void bench_http_engine()
+{
+    cout << "[BENCH] HTTP_Engine, many transfers in flight from one thread" << endl;
+
+    Mock_Server server(delay_handler);
+    if (not server.is_running())
+        return;
+
+    const size_t transfers = 300;
+    const unsigned latency_ms = 250;
+
+    HTTP_Engine engine(g_max_transfers);
+
+    auto start = Clock::now();
+
+    vector<std::future<optional<HTTP_Response>>> futures;
+    futures.reserve(transfers);
+
+    for (size_t i = 0; i < transfers; ++i)
+        futures.push_back(engine.submit(HTTP_Request{ .url = server.url(std::format("/delay/{}", latency_ms)) }));
+
+    size_t ok = 0;
+    for (auto& f : futures)
+    {
+        auto resp = f.get();
+        if (resp.has_value() and resp->code == 200)
+            ++ok;
+    }
+
+    double wall_ms = ms_since(start);
+
+    // fully serial would take transfers * latency_ms
+    cout << std::format("[BENCH] {} transfers of {} ms each, ok: {}, wall: {:.1f} ms, "
+                        "avg concurrency: {:.1f}",
+                        transfers, latency_ms, ok, wall_ms,
+                        static_cast<double>(transfers * latency_ms) / wall_ms) << endl;
+}
+
+void bench_connection_reuse()
+{
+    cout << "[BENCH] connection reuse, HEAD + GET per image" << endl;
+
+    Mock_Server server([](const Mock_Request&)
+    {
+        return Mock_Response{ .content_type = "image/jpeg", .body = string(32 * 1024, 'x') };
+    });
+    if (not server.is_running())
+        return;
+
+    const size_t images = 200;
+
+    auto before = http_stats();
+    auto start = Clock::now();
+
+    for (size_t i = 0; i < images; ++i)
+    {
+        auto url = server.url(std::format("/{}.jpg", i));
+        request_headers_only(url);
+        perform_http_request(url);
+    }
+
+    double wall_ms = ms_since(start);
+    auto after = http_stats();
+
+    HTTP_Stats run{
+        .requests = after.requests - before.requests,
+        .new_connections = after.new_connections - before.new_connections
+    };
+
+    cout << std::format("[BENCH] {} requests, {} connections, reuse: {:.1f}%, {:.3f} ms per image",
+                        run.requests, server.connections_accepted(),
+                        run.reuse_ratio() * 100.0, wall_ms / images) << endl;
+}
+
+void bench_requests_per_post()
+{
+    cout << "[BENCH] requests per post, HEAD preflight vs single GET" << endl;
+
+    Mock_Server server([](const Mock_Request& req)
+    {
+        if (req.path.ends_with(".html"))
+            return Mock_Response{ .content_type = "text/html", .body = string(8 * 1024, 'h') };
+
+        return Mock_Response{ .content_type = "image/jpeg", .body = string(64 * 1024, 'x') };
+    });
+    if (not server.is_running())
+        return;
+
+    const size_t posts = 100;
+    const fs::path folder = fs::temp_directory_path() / "rid_bench_requests";
+
+    auto post_url = [&server](size_t i)
+    {
+        // every tenth post links to a web page, not to an image
+        return server.url(std::format("/{}.{}", i, i % 10 == 0 ? "html" : "jpg"));
+    };
+
+    HTTP_Engine engine;
+
+    // before: HEAD to learn the content type, then GET
+    {
+        fs::remove_all(folder);
+        fs::create_directories(folder);
+
+        auto served = server.requests_served();
+        auto start = Clock::now();
+
+        for (size_t i = 0; i < posts; ++i)
+        {
+            auto head = engine.submit(HTTP_Request{ .url = post_url(i), .headers_only = true }).get();
+
+            auto media = head.has_value() ?
+                Utils::media_type_from_content_type(head->content_type) :
+                std::nullopt;
+
+            if (not media.has_value())
+                continue;
+
+            auto destination = (folder / std::format("{}.{}", i, media->extension)).string();
+            download_file_to_disk(engine, post_url(i), destination).get();
+        }
+
+        cout << std::format("[BENCH] {:<18} {:.2f} requests per post, {:.1f} ms",
+                            "HEAD + GET",
+                            static_cast<double>(server.requests_served() - served) / posts,
+                            ms_since(start)) << endl;
+    }
+
+    // after: one GET, type sniffed from the first chunk
+    {
+        fs::remove_all(folder);
+        fs::create_directories(folder);
+
+        auto served = server.requests_served();
+        auto start = Clock::now();
+
+        for (size_t i = 0; i < posts; ++i)
+            download_media_to_disk(engine, post_url(i), (folder / std::to_string(i)).string()).get();
+
+        cout << std::format("[BENCH] {:<18} {:.2f} requests per post, {:.1f} ms",
+                            "single GET",
+                            static_cast<double>(server.requests_served() - served) / posts,
+                            ms_since(start)) << endl;
+    }
+
+    fs::remove_all(folder);
+}
+
+// a page shaped like reddit's: ~100 fields per post, most of them
+// nested objects and arrays download_media() never looks at
+string synthetic_listing(size_t posts)
+{
+    std::mt19937 rng(42);
+
+    njson children = njson::array();
+
+    for (size_t i = 0; i < posts; ++i)
+    {
+        njson data = {
+            { "id", std::format("p{}", i) },
+            { "name", std::format("t3_p{}", i) },
+            { "title", std::format("Post number {} with a title about as long as the usual ones", i) },
+            { "subreddit", "VaporwaveAesthetics" },
+            { "domain", i % 5 == 0 ? "reddit.com" : "i.redd.it" },
+            { "url", std::format("https://i.redd.it/{:016x}.jpg", rng()) },
+            { "ups", static_cast<unsigned>(rng() % 50000) },
+            { "selftext", string(rng() % 400, 'x') },
+            { "is_gallery", i % 5 == 0 },
+        };
+
+        for (int field = 0; field < 80; ++field)
+            data[std::format("field_{:02}", field)] = field % 3 == 0 ? njson(nullptr) :
+                                                      field % 3 == 1 ? njson(rng() % 1000) :
+                                                      njson("some value");
+
+        njson images = njson::array();
+        for (int r = 0; r < 6; ++r)
+            images.push_back({ { "url", std::format("https://preview.redd.it/{}.jpg?width={}", i, 108 << r) },
+                               { "width", 108 << r }, { "height", 108 << r } });
+        data["preview"] = { { "images", { { { "source", images[0] }, { "resolutions", images } } } }, { "enabled", true } };
+
+        data["all_awardings"] = njson::array();
+        for (int a = 0; a < 4; ++a)
+            data["all_awardings"].push_back({ { "id", std::format("award_{}", a) }, { "coin_price", 100 * a },
+                                              { "description", "A glowing commendation for all to see" } });
+
+        if (i % 5 == 0)
+        {
+            for (int part = 0; part < 5; ++part)
+                data["media_metadata"][std::format("m{:013x}", rng())] = {
+                    { "status", "valid" }, { "e", "Image" }, { "m", "image/jpg" },
+                    { "p", images }, { "s", { { "y", 1080 }, { "x", 1920 }, { "u", std::format("https://preview.redd.it/g{}_{}.jpg", i, part) } } }
+                };
+        }
+
+        children.push_back({ { "kind", "t3" }, { "data", std::move(data) } });
+    }
+
+    njson listing = {
+        { "kind", "Listing" },
+        { "data", { { "after", "t3_last" }, { "dist", posts }, { "children", std::move(children) } } }
+    };
+
+    return listing.dump();
+}
+
+void bench_listing_parser(const string& dumps_folder)
+{
+    cout << "[BENCH] listing parser, full DOM vs streaming extraction" << endl;
+
+    vector<string> pages;
+
+    // the debug dumps rid() leaves in the destination folder: !#_<subreddit>_<when>_<after>.json
+    if (dumps_folder != "" and fs::is_directory(dumps_folder))
+    {
+        for (const auto& entry : fs::directory_iterator(dumps_folder))
+        {
+            auto name = entry.path().filename().string();
+
+            if (not (name.starts_with("!#_") and name.ends_with(".json")))
+                continue;
+
+            std::ifstream in(entry.path(), std::ifstream::binary);
+            std::stringstream ss;
+            ss << in.rdbuf();
+            pages.push_back(ss.str());
+        }
+    }
+
+    if (pages.empty())
+    {
+        cout << "[BENCH] no listing dumps, using a synthetic page (rid --bench <dest-folder> to use real ones)" << endl;
+        pages.push_back(synthetic_listing(100));
+    }
+
+    size_t bytes = 0;
+    for (const auto& page : pages)
+    {
+        bytes += page.size();
+
+        auto fast = parse_listing(page);
+        auto dom = parse_listing_dom(page);
+
+        if (fast.has_value() != dom.has_value() or
+            (fast.has_value() and (fast->after != dom->after or fast->posts != dom->posts)))
+        {
+            cout << "[BENCH] [WARN] streaming and DOM parsers disagree on a listing page" << endl;
+        }
+    }
+
+    const unsigned rounds = std::max<unsigned>(3, static_cast<unsigned>(200'000'000 / std::max<size_t>(bytes, 1)));
+
+    auto run = [&](const char* name, auto parse)
+    {
+        size_t posts = 0;
+        auto start = Clock::now();
+
+        for (unsigned round = 0; round < rounds; ++round)
+        {
+            for (const auto& page : pages)
+            {
+                auto listing = parse(page);
+                posts += listing.has_value() ? listing->posts.size() : 0;
+            }
+        }
+
+        double ms = ms_since(start);
+
+        cout << std::format("[BENCH] {:<18} {:.3f} ms per page, {:.0f} MB/s, {} posts",
+                            name,
+                            ms / (rounds * pages.size()),
+                            (bytes * rounds) / (ms * 1000.0),
+                            posts / rounds) << endl;
+    };
+
+    run("DOM", [](std::string_view page) { return parse_listing_dom(page); });
+    run("streaming", [](std::string_view page) { return parse_listing(page); });
+}
+
+void bench_file_writer()
+{
+    cout << "[BENCH] writing bodies, on the engine thread vs writer threads" << endl;
+
+    // same bytes for every request, the server must not be the bottleneck
+    static const string image(200 * 1024, 'i');
+    static const string video(64 * 1024 * 1024, 'v');
+
+    Mock_Server server([](const Mock_Request& req)
+    {
+        if (req.path.starts_with("/video/"))
+            return Mock_Response{ .content_type = "video/mp4", .body = video };
+
+        return Mock_Response{ .content_type = "image/jpeg", .body = image };
+    });
+    if (not server.is_running())
+        return;
+
+    const fs::path folder = fs::temp_directory_path() / "rid_bench_writer";
+
+    HTTP_Engine engine;
+
+    auto run = [&](const char* name, unsigned threads, string_cref kind, size_t count)
+    {
+        fs::remove_all(folder);
+        fs::create_directories(folder);
+
+        File_Writer writer(threads);
+        vector<std::future<Download_Result>> results;
+        results.reserve(count);
+
+        auto start = Clock::now();
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto destination = (folder / std::format("{}.bin", i)).string();
+            results.push_back(submit_to_sink(engine,
+                                             server.url(std::format("/{}/{}", kind, i)),
+                                             Download_Sink::to_file(destination, nullptr, &writer)));
+        }
+
+        size_t ok = 0;
+        for (auto& result : results)
+            ok += result.get() == Download_Result::DOWNLOADED ? 1 : 0;
+
+        double ms = ms_since(start);
+        uint64_t bytes = count * (kind == "video" ? video.size() : image.size());
+
+        cout << std::format("[BENCH] {:<28} {:>8.1f} ms  {:>7.1f} MB/s  {}/{} ok",
+                            name, ms, bytes / (ms * 1000.0), ok, count) << endl;
+    };
+
+    run("2000 images, engine thread", 0, "image", 2000);
+    run("2000 images, 4 writers", 4, "image", 2000);
+    run("4 videos, engine thread", 0, "video", 4);
+    run("4 videos, 4 writers", 4, "video", 4);
+
+    fs::remove_all(folder);
+}
+
+void bench_hamming_index()
+{
+    cout << "[BENCH] near duplicate lookup, 1M dHashes, scalar vs AVX2" << endl;
+
+    std::mt19937_64 rng(42);
+    vector<uint64_t> hashes(1'000'000);
+    for (auto& hash : hashes)
+        hash = rng();
+
+    // mostly misses, the common case: a new image matches nothing
+    vector<uint64_t> queries(200);
+    for (auto& query : queries)
+        query = rng();
+
+    auto run = [&](const char* name, auto nearest)
+    {
+        size_t found = 0;
+        auto start = Clock::now();
+
+        for (auto query : queries)
+            found += nearest(hashes, query, 6).has_value() ? 1 : 0;
+
+        double ms = ms_since(start);
+
+        cout << std::format("[BENCH] {:<18} {:.3f} ms per lookup, {} found",
+                            name,
+                            ms / queries.size(),
+                            found) << endl;
+    };
+
+    run("scalar", nearest_within_scalar);
+
+    if (cpu_has_avx2())
+        run("AVX2", nearest_within_avx2);
+    else
+        cout << "[BENCH] no AVX2 on this cpu" << endl;
+}
+
+// the scanners parse_url() replaced, walking the url backwards into a
+// stringstream, kept as the baseline
+string extension_by_stringstream(const string& from)
+{
+    std::stringstream buff;
+    bool found = false;
+
+    for (auto it = from.rbegin(); it != from.rend(); ++it)
+    {
+        char c = *it;
+
+        if (c == '.')
+        {
+            found = true;
+            break;
+        }
+
+        if (c == '/' or not std::isalnum(static_cast<unsigned char>(c)))
+            break;
+
+        buff << c;
+    }
+
+    if (not found)
+        return "";
+
+    string ext = buff.str();
+    std::reverse(ext.begin(), ext.end());
+    return ext;
+}
+
+string image_id_by_stringstream(const string& url)
+{
+    std::stringstream buff;
+    bool found = false;
+
+    auto it = url.rbegin();
+    if (url.back() == '/')
+        ++it;
+
+    for (; it != url.rend(); ++it)
+    {
+        if (*it == '/')
+        {
+            found = true;
+            break;
+        }
+
+        buff << *it;
+    }
+
+    if (not found)
+        return {};
+
+    string image_id = buff.str();
+    std::reverse(image_id.begin(), image_id.end());
+    return image_id.substr(0, image_id.find('.'));
+}
+
+void bench_url_parser()
+{
+    cout << "[BENCH] url pieces, stringstream scanners + split_string vs parse_url()" << endl;
+
+    const vector<string> samples = {
+        "https://i.redd.it/nqa4sfb8ns191.png",
+        "https://i.imgur.com/gBj52nI.jpg",
+        "https://imgur.com/a/gBj52nI",
+        "https://gfycat.com/MeekWeightyFrogmouth",
+        "https://www.reddit.com/gallery/x8f2kq",
+        "https://v.redd.it/r7gh3btvonx31/DASH_720?source=fallback",
+        "https://preview.redd.it/abcdefg1234.jpg?width=640&format=pjpg&auto=webp&s=0123456789abcdef",
+        "https://66.media.tumblr.com/8ead6e96ca8e3e8fe16434181e8a1493/tumblr_oruoo12vtR1s5qhggo3_1280.png",
+    };
+
+    vector<string> urls;
+    urls.reserve(200'000);
+    for (size_t i = 0; i < 200'000; ++i)
+        urls.push_back(samples[i % samples.size()]);
+
+    auto run = [&](const char* name, auto pieces)
+    {
+        size_t bytes = 0;
+        auto start = Clock::now();
+
+        for (const auto& url : urls)
+            bytes += pieces(url);
+
+        double ms = ms_since(start);
+
+        cout << std::format("[BENCH] {:<18} {:.1f} ns per url ({} bytes)",
+                            name,
+                            ms * 1'000'000.0 / urls.size(),
+                            bytes) << endl;
+    };
+
+    run("stringstream", [](const string& url)
+    {
+        size_t bytes = extension_by_stringstream(url).size() + image_id_by_stringstream(url).size();
+        for (const auto& segment : Utils::split_string(url, "/"))
+            bytes += segment.size();
+        return bytes;
+    });
+
+    run("parse_url", [](const string& url)
+    {
+        auto parsed = parse_url(url);
+        if (not parsed.has_value())
+            return size_t{ 0 };
+
+        auto image_id = parsed->last_segment();
+        size_t bytes = parsed->extension().size() + image_id.substr(0, image_id.find('.')).size();
+        for (auto segment : Utils::Split_View(url, "/"))
+            bytes += segment.size();
+        return bytes;
+    });
+}
+
+void bench_resolver_lookup()
+{
+    cout << "[BENCH] resolver of a domain, if/else chain vs perfect hash table" << endl;
+
+    // mostly i.redd.it, which the chain only reaches after every compare
+    const vector<string> samples = {
+        "i.redd.it", "i.redd.it", "i.redd.it", "v.redd.it", "reddit.com",
+        "i.imgur.com", "imgur.com", "gfycat.com", "i.redd.it", "redgifs.com",
+    };
+
+    vector<string> domains;
+    domains.reserve(1'000'000);
+    for (size_t i = 0; i < 1'000'000; ++i)
+        domains.push_back(samples[i % samples.size()]);
+
+    auto run = [&](const char* name, auto lookup)
+    {
+        size_t network = 0;
+        auto start = Clock::now();
+
+        for (const auto& domain : domains)
+            network += lookup(domain) ? 1 : 0;
+
+        double ms = ms_since(start);
+
+        cout << std::format("[BENCH] {:<18} {:.1f} ns per post ({} need the network)",
+                            name,
+                            ms * 1'000'000.0 / domains.size(),
+                            network) << endl;
+    };
+
+    // the chain download_media() had
+    run("if/else chain", [](const string& domain)
+    {
+        if (domain == "v.redd.it") return false;
+        else if (domain == "imgur.com" or domain == "i.imgur.com") return true;
+        else if (domain == "gfycat.com") return true;
+        else if (domain == "reddit.com") return false;
+        return false;
+    });
+
+    run("resolver_for", [](const string& domain)
+    {
+        return resolver_for(domain).from_api != nullptr;
+    });
+}
+
+void bench_offline_resolution()
+{
+    cout << "[BENCH] requests per post, api for every imgur/gfycat post vs listing first" << endl;
+
+    // a front page worth of posts, the way reddit lists them
+    const vector<Post> samples = {
+        { .domain = "i.redd.it", .url = "https://i.redd.it/a.jpg", .post_hint = "image" },
+        { .domain = "i.redd.it", .url = "https://i.redd.it/b.png", .post_hint = "image" },
+        { .domain = "v.redd.it", .url = "https://v.redd.it/c", .video_url = "https://v.redd.it/c/DASH_720" },
+        { .domain = "reddit.com", .url = "https://www.reddit.com/gallery/d", .is_gallery = true,
+          .gallery_urls = { "https://i.redd.it/d1.jpg", "https://i.redd.it/d2.jpg", "https://i.redd.it/d3.jpg" } },
+        { .domain = "i.imgur.com", .url = "https://i.imgur.com/e.jpg", .post_hint = "image" },
+        { .domain = "i.imgur.com", .url = "https://i.imgur.com/f.gifv", .post_hint = "link",
+          .preview_video_url = "https://v.redd.it/f/DASH_480" },
+        { .domain = "imgur.com", .url = "https://imgur.com/g", .post_hint = "image" },
+        { .domain = "imgur.com", .url = "https://imgur.com/a/h", .post_hint = "link" },
+        { .domain = "gfycat.com", .url = "https://gfycat.com/i", .post_hint = "rich:video",
+          .preview_video_url = "https://v.redd.it/i/DASH_480" },
+        { .domain = "example.com", .url = "https://example.com/j", .post_hint = "image",
+          .preview_url = "https://preview.redd.it/j.jpg" },
+    };
+
+    auto run = [&](const char* name, auto asks_api)
+    {
+        size_t requests = 0;
+        size_t offline = 0;
+
+        for (const auto& post : samples)
+        {
+            auto url = parse_url(post.url).value_or(Url_View{});
+            const auto& resolver = resolver_for(domain_of(post, url));
+
+            // the api answers with one link per image, same count as the listing
+            size_t media = post.is_gallery ? post.gallery_urls.size() : 1;
+
+            if (asks_api(resolver, post, url))
+                ++requests;
+            else
+                ++offline;
+
+            requests += media;
+        }
+
+        cout << std::format("[BENCH] {:<18} {:.2f} requests per post, {} of {} posts offline",
+                            name,
+                            static_cast<double>(requests) / static_cast<double>(samples.size()),
+                            offline,
+                            samples.size()) << endl;
+    };
+
+    run("api per host", [](const Resolver& resolver, const Post&, const Url_View&)
+    {
+        return resolver.from_api != nullptr;
+    });
+
+    run("listing first", [](const Resolver& resolver, const Post& post, const Url_View& url)
+    {
+        return needs_network(resolver, post, url);
+    });
+}
+
+void bench_memory_budget()
+{
+    cout << "[BENCH] peak memory of 10 large bodies packed at once, no budget vs 32 MB" << endl;
+
+    const string body = string("\x89PNG\r\n\x1A\n", 8) + string(8 * 1024 * 1024, 'v');
+
+    Mock_Server server([&body](const Mock_Request&)
+    {
+        return Mock_Response{ .content_type = "image/png", .body = body };
+    });
+    if (not server.is_running())
+        return;
+
+    HTTP_Engine engine;
+    const fs::path folder = fs::temp_directory_path() / "rid_bench_budget";
+
+    auto run = [&](const char* name, uint64_t limit)
+    {
+        fs::remove_all(folder);
+
+        Memory_Budget budget(limit);
+        auto start = Clock::now();
+
+        {
+            Pack_Storage pack(folder, Hash_Mode::FAST, g_PACK_SEGMENT_SIZE, false, &budget);
+            vector<std::future<Download_Result>> downloads;
+
+            for (int i = 0; i < 10; ++i)
+            {
+                downloads.push_back(pack.download(engine,
+                                                  server.url(std::format("/{}.png", i)),
+                                                  { .post_id = std::to_string(i) }));
+            }
+
+            for (auto& download : downloads)
+                download.get();
+        }
+
+        auto stats = budget.stats();
+
+        cout << std::format("[BENCH] {:<18} peak {:.1f} MB, {} spooled to disk, {:.1f} ms",
+                            name,
+                            stats.peak / (1024.0 * 1024.0),
+                            stats.spills,
+                            ms_since(start)) << endl;
+    };
+
+    run("no budget", 0);
+    run("32 MB budget", 32 * 1024 * 1024);
+
+    fs::remove_all(folder);
+}
+
+void bench_file_name()
+{
+    cout << "[BENCH] file names from titles, old pipeline vs make_file_name()" << endl;
+
+    // what titles look like on a listing: mostly short english, some
+    // other scripts, emoji, characters windows does not allow
+    const vector<string> samples = {
+        "My cat when I open the fridge",
+        "What do you think? \"Best\" sunset I ever took: 35mm, no filter",
+        "Finally finished the model I started in 2019 after three moves, two kids and a whole lot of glue, here it is",
+        "東京の夜景、屋上から撮りました",
+        "Закат над Волгой, вид с моста",
+        "غروب الشمس في الصحراء",
+        "He did it again 😂😂😂 / part 2",
+        "OC | 10/10 would climb again <3",
+    };
+
+    vector<string> titles;
+    titles.reserve(200'000);
+    for (size_t i = 0; i < 200'000; ++i)
+        titles.push_back(samples[i % samples.size()]);
+
+    auto run = [&](const char* name, auto make)
+    {
+        size_t bytes = 0;
+        auto start = Clock::now();
+
+        for (const auto& title : titles)
+            bytes += make(title);
+
+        double ms = ms_since(start);
+
+        cout << std::format("[BENCH] {:<18} {:.1f} ns per title ({} bytes)",
+                            name,
+                            ms * 1'000'000.0 / titles.size(),
+                            bytes) << endl;
+    };
+
+    run("old pipeline", [](const string& title)
+    {
+        string name = Utils::remove_invalid_charaters(title);
+        if (Utils::UTF8_len(name) > g_TITLE_MAX_LEN)
+            Utils::resize_string(name, g_TITLE_MAX_LEN);
+        return name.size();
+    });
+
+    run("make_file_name", [](const string& title)
+    {
+        char buffer[g_TITLE_MAX_LEN * 4];
+        return Utils::make_file_name(title, g_TITLE_MAX_LEN, buffer).size;
+    });
+}
+
+}
+
+int run_bench(const string& dumps_folder)
+{
+    curlpp::Cleanup cleanup;
+
+    bench_download_pool();
+    bench_http_engine();
+    bench_connection_reuse();
+    bench_requests_per_post();
+    bench_listing_parser(dumps_folder);
+    bench_hamming_index();
+    bench_file_writer();
+    bench_file_name();
+    bench_url_parser();
+    bench_resolver_lookup();
+    bench_offline_resolution();
+    bench_memory_budget();
+
+    return 0;
+}
+
+}
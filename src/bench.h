@@ -0,0 +1,11 @@
+#pragma once
+
+namespace Bench
+{
+
+// runs every benchmark against a local Mock_Server, launched with:
+// rid --bench [dest-folder]
+// the listing parser runs over the json dumps found in dest-folder
+int run_bench(const string& dumps_folder = "");
+
+}
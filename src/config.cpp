@@ -0,0 +1,214 @@
+#include "pch.h"
+
+#include "config.h"
+#include "utils.h"
+#include "download_pool.h"
+
+namespace
+{
+
+constexpr const char* g_KEYS[] = {
+    "IMGUR_CLIENT_ID",
+    "WORKERS",
+    "MAX_TRANSFERS",
+    "WRITER_THREADS",
+    "MEMORY_BUDGET",
+    "HOST_LIMITS",
+    "CONNECT_TIMEOUT",
+    "STALL_TIMEOUT",
+    "OUTPUT",
+    "TITLE_MAX_LEN",
+    "CONTENT_STORE",
+    "CONTENT_HASH",
+    "RESOLVER_CACHE",
+    "RESOLVER_CACHE_TTL",
+    "RESOLVER_NEGATIVE_TTL",
+    "MIN_UPVOTES",
+    "NEAR_DUPLICATES",
+    "NEAR_DUPLICATE_DISTANCE",
+};
+
+bool is_known_key(std::string_view key)
+{
+    return std::any_of(std::begin(g_KEYS), std::end(g_KEYS), [key](const char* known)
+    {
+        return key == known;
+    });
+}
+
+void warn_ignored(std::string_view key, std::string_view value, std::string_view expected)
+{
+    cout << std::format("[WARN] setting {}={} ignored, expected {}", key, value, expected) << endl;
+}
+
+// the whole value, in [min, max]
+template<typename T>
+optional<T> parse_number(std::string_view key, std::string_view value, T min, T max)
+{
+    T number{};
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+
+    if (error != std::errc{} or end != value.data() + value.size() or
+        number < min or number > max)
+    {
+        warn_ignored(key, value, std::format("a number from {} to {}", min, max));
+        return {};
+    }
+
+    return number;
+}
+
+optional<std::chrono::seconds> parse_hours(std::string_view key, std::string_view value)
+{
+    auto hours = parse_number<long>(key, value, 0, 24 * 365 * 10);
+
+    if (not hours.has_value())
+        return {};
+
+    return std::chrono::hours(*hours);
+}
+
+// "imgur.com=2,i.redd.it=64"
+optional<std::map<string, unsigned>> parse_host_limits(std::string_view key, std::string_view value)
+{
+    std::map<string, unsigned> res;
+
+    for (std::string_view entry : Utils::Split_View(value, ","))
+    {
+        auto equal = entry.find('=');
+
+        if (equal == std::string_view::npos or equal == 0)
+        {
+            warn_ignored(key, value, "host=limit,host=limit...");
+            return {};
+        }
+
+        auto limit = parse_number<unsigned>(key, entry.substr(equal + 1), 1, 1024);
+
+        if (not limit.has_value())
+            return {};
+
+        res[string(entry.substr(0, equal))] = *limit;
+    }
+
+    return res;
+}
+
+void apply(Config& config, std::string_view key, std::string_view value)
+{
+    auto assign = [](auto& field, auto parsed)
+    {
+        if (parsed.has_value())
+            field = static_cast<std::remove_reference_t<decltype(field)>>(*parsed);
+    };
+
+    if (key == "IMGUR_CLIENT_ID")
+        config.imgur_client_id = value;
+    else if (key == "CONTENT_STORE")
+        config.content_store = value;
+    else if (key == "RESOLVER_CACHE")
+        config.resolver_cache = value;
+    else if (value.empty())
+        return; // "KEY=" in .env, the default stays
+    else if (key == "WORKERS")
+        assign(config.workers, parse_number<unsigned>(key, value, 1, 256));
+    else if (key == "MAX_TRANSFERS")
+        assign(config.max_transfers, parse_number<unsigned>(key, value, 1, 4096));
+    else if (key == "WRITER_THREADS")
+        assign(config.writer_threads, parse_number<unsigned>(key, value, 0, 64));
+    else if (key == "MEMORY_BUDGET")
+    {
+        if (auto mb = parse_number<uint64_t>(key, value, 0, 1024 * 1024); mb.has_value())
+            config.memory_budget = *mb * 1024 * 1024;
+    }
+    else if (key == "HOST_LIMITS")
+        assign(config.host_limits, parse_host_limits(key, value));
+    else if (key == "CONNECT_TIMEOUT")
+        assign(config.connect_timeout, parse_number<long>(key, value, 0, 3600));
+    else if (key == "STALL_TIMEOUT")
+        assign(config.stall_timeout, parse_number<long>(key, value, 0, 3600));
+    else if (key == "TITLE_MAX_LEN")
+        assign(config.title_max_len, parse_number<size_t>(key, value, 1, g_TITLE_MAX_LEN_LIMIT));
+    else if (key == "RESOLVER_CACHE_TTL")
+        assign(config.resolver_cache_ttl, parse_hours(key, value));
+    else if (key == "RESOLVER_NEGATIVE_TTL")
+        assign(config.resolver_negative_ttl, parse_hours(key, value));
+    else if (key == "MIN_UPVOTES")
+        assign(config.min_upvotes, parse_number<long>(key, value, 0, std::numeric_limits<long>::max()));
+    else if (key == "NEAR_DUPLICATE_DISTANCE")
+        assign(config.near_duplicate_distance, parse_number<int>(key, value, 0, 64));
+    else if (key == "OUTPUT")
+    {
+        if (value == "files") config.output = Output_Mode::FILES;
+        else if (value == "pack") config.output = Output_Mode::PACK;
+        else warn_ignored(key, value, "files or pack");
+    }
+    else if (key == "CONTENT_HASH")
+    {
+        if (value == "fast") config.content_hash = Hash_Mode::FAST;
+        else if (value == "sha256") config.content_hash = Hash_Mode::SHA256;
+        else warn_ignored(key, value, "fast or sha256");
+    }
+    else if (key == "NEAR_DUPLICATES")
+    {
+        if (value == "off") config.near_duplicates = Near_Duplicate_Action::OFF;
+        else if (value == "flag") config.near_duplicates = Near_Duplicate_Action::FLAG;
+        else if (value == "skip") config.near_duplicates = Near_Duplicate_Action::SKIP;
+        else warn_ignored(key, value, "off, flag or skip");
+    }
+}
+
+Config& current_config()
+{
+    static Config config = load_config();
+    return config;
+}
+
+}
+
+unsigned Config::host_limit(string_cref host) const
+{
+    if (auto it = host_limits.find(host); it != host_limits.end())
+        return it->second;
+
+    return default_host_limit(host);
+}
+
+Config load_config(const fs::path& env_file,
+                   const std::map<string, string>& overrides)
+{
+    Config config;
+
+    // .env has the keys of the tests as well, only ours are looked at
+    for (const auto& [key, value] : Utils::read_env_file(env_file))
+    {
+        if (is_known_key(key))
+            apply(config, key, value);
+    }
+
+    for (const char* key : g_KEYS)
+    {
+        if (auto value = Utils::environment_variable(std::format("RID_{}", key)); value != "")
+            apply(config, key, value);
+    }
+
+    for (const auto& [key, value] : overrides)
+    {
+        if (is_known_key(key))
+            apply(config, key, value);
+        else
+            cout << std::format("[WARN] unknown setting {}", key) << endl;
+    }
+
+    return config;
+}
+
+const Config& config()
+{
+    return current_config();
+}
+
+void set_config(Config config)
+{
+    current_config() = std::move(config);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "rid.h"
+#include "content_hash.h"
+#include "perceptual_hash.h"
+
+// longest title load_config() accepts, file names stay well under the 255
+// characters NTFS allows once "_p0001", the post id and the extension are added
+auto constexpr g_TITLE_MAX_LEN_LIMIT = 200;
+
+// Every setting of a run, read once at startup. Each key can come from,
+// the last one wins:
+//  - the default below
+//  - ".env", "KEY=value"
+//  - the environment, "RID_KEY=value"
+//  - the command line, "--set KEY=value"
+// A value that does not parse keeps the one before it, with a warning.
+struct Config
+{
+    // IMGUR_CLIENT_ID
+    string imgur_client_id;
+
+    // WORKERS, threads resolving and finishing posts, they never wait on a
+    // transfer: how many are in flight is up to HOST_LIMITS and MAX_TRANSFERS
+    unsigned workers = g_num_threads;
+    // MAX_TRANSFERS, requests in flight inside HTTP_Engine
+    unsigned max_transfers = g_max_transfers;
+    // WRITER_THREADS, 0 writes on the network thread
+    unsigned writer_threads = 4;
+    // MEMORY_BUDGET, megabytes of bodies held in memory at once, 0 no limit
+    uint64_t memory_budget = 256ull * 1024 * 1024;
+    // HOST_LIMITS, "imgur.com=2,i.redd.it=64", on top of default_host_limit()
+    std::map<string, unsigned> host_limits;
+
+    // CONNECT_TIMEOUT, seconds, 0 is curl's own (300)
+    std::chrono::seconds connect_timeout{ 0 };
+    // STALL_TIMEOUT, seconds without a single byte before a transfer is
+    // dropped, 0 never. A video can take long, a dead one should not
+    std::chrono::seconds stall_timeout{ 0 };
+
+    // OUTPUT, "files" or "pack"
+    Output_Mode output = Output_Mode::FILES;
+    // TITLE_MAX_LEN, code points of the title kept in a file name
+    size_t title_max_len = g_TITLE_MAX_LEN;
+    // CONTENT_STORE, "" for the default folder, "off", or a folder
+    string content_store;
+    // CONTENT_HASH, "fast" or "sha256"
+    Hash_Mode content_hash = Hash_Mode::FAST;
+
+    // RESOLVER_CACHE, "" for the default file, "off", or a file
+    string resolver_cache;
+    // RESOLVER_CACHE_TTL, hours an api answer is reused
+    std::chrono::seconds resolver_cache_ttl = std::chrono::hours(24 * 30);
+    // RESOLVER_NEGATIVE_TTL, hours a deleted or missing post is not asked again
+    std::chrono::seconds resolver_negative_ttl = std::chrono::hours(6);
+
+    // MIN_UPVOTES, posts with fewer are SKIPPED
+    long min_upvotes = 0;
+    // NEAR_DUPLICATES, "off", "flag" or "skip"
+    Near_Duplicate_Action near_duplicates = Near_Duplicate_Action::OFF;
+    // NEAR_DUPLICATE_DISTANCE, bits
+    int near_duplicate_distance = 6;
+
+    // HOST_LIMITS, or default_host_limit()
+    unsigned host_limit(string_cref host) const;
+};
+
+// `overrides` are the "--set" of the command line, KEY -> value
+Config load_config(const fs::path& env_file = ".env",
+                   const std::map<string, string>& overrides = {});
+
+// the settings of this process: load_config() with no command line until
+// set_config() is called. Read by every thread without a lock, never
+// changed once the workers are running
+const Config& config();
+
+// once at startup, before any other thread is started
+void set_config(Config config);
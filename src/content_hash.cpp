@@ -0,0 +1,274 @@
+#include "pch.h"
+
+#include "content_hash.h"
+
+namespace
+{
+
+constexpr uint64_t P1 = 11400714785074694791ull;
+constexpr uint64_t P2 = 14029467366897019727ull;
+constexpr uint64_t P3 = 1609587929392839161ull;
+constexpr uint64_t P4 = 9650029242287828579ull;
+constexpr uint64_t P5 = 2870177450012600261ull;
+
+constexpr uint32_t g_SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+uint64_t read_u64(const unsigned char* p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v)); // little endian, like every machine we run on
+    return v;
+}
+
+uint32_t read_u32(const unsigned char* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl64(acc, 31);
+    return acc * P1;
+}
+
+uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * P1 + P4;
+}
+
+}
+
+Content_Hasher::Content_Hasher(Hash_Mode mode) :
+    m_mode(mode)
+{
+    if (mode == Hash_Mode::FAST)
+    {
+        // seed 0
+        m_acc[0] = P1 + P2;
+        m_acc[1] = P2;
+        m_acc[2] = 0;
+        m_acc[3] = 0 - P1;
+    }
+    else
+    {
+        const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        std::memcpy(m_state, init, sizeof(init));
+    }
+}
+
+void Content_Hasher::update(std::string_view data)
+{
+    const size_t block = m_mode == Hash_Mode::FAST ? 32 : 64;
+
+    auto p = reinterpret_cast<const unsigned char*>(data.data());
+    size_t len = data.size();
+
+    m_total += len;
+
+    auto consume = [this](const unsigned char* block_ptr)
+    {
+        if (m_mode == Hash_Mode::FAST)
+            xxh64_stripe(block_ptr);
+        else
+            sha256_block(block_ptr);
+    };
+
+    if (m_buffered > 0)
+    {
+        size_t take = std::min(block - m_buffered, len);
+        std::memcpy(m_buffer + m_buffered, p, take);
+        m_buffered += take;
+        p += take;
+        len -= take;
+
+        if (m_buffered < block)
+            return;
+
+        consume(m_buffer);
+        m_buffered = 0;
+    }
+
+    for (; len >= block; p += block, len -= block)
+        consume(p);
+
+    std::memcpy(m_buffer, p, len);
+    m_buffered = len;
+}
+
+string Content_Hasher::digest()
+{
+    if (m_mode == Hash_Mode::FAST)
+    {
+        uint64_t h;
+
+        if (m_total >= 32)
+        {
+            h = rotl64(m_acc[0], 1) + rotl64(m_acc[1], 7) +
+                rotl64(m_acc[2], 12) + rotl64(m_acc[3], 18);
+
+            for (auto acc : m_acc)
+                h = xxh64_merge(h, acc);
+        }
+        else
+        {
+            h = P5; // seed 0
+        }
+
+        h += m_total;
+
+        const unsigned char* p = m_buffer;
+        size_t len = m_buffered;
+
+        for (; len >= 8; p += 8, len -= 8)
+        {
+            h ^= xxh64_round(0, read_u64(p));
+            h = rotl64(h, 27) * P1 + P4;
+        }
+
+        if (len >= 4)
+        {
+            h ^= static_cast<uint64_t>(read_u32(p)) * P1;
+            h = rotl64(h, 23) * P2 + P3;
+            p += 4;
+            len -= 4;
+        }
+
+        for (; len > 0; ++p, --len)
+        {
+            h ^= *p * P5;
+            h = rotl64(h, 11) * P1;
+        }
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+
+        return std::format("xxh64-{:016x}", h);
+    }
+
+    // padding: 0x80, zeros, length in bits big endian
+    uint64_t bits = m_total * 8;
+
+    m_buffer[m_buffered++] = 0x80;
+
+    if (m_buffered > 56)
+    {
+        std::memset(m_buffer + m_buffered, 0, 64 - m_buffered);
+        sha256_block(m_buffer);
+        m_buffered = 0;
+    }
+
+    std::memset(m_buffer + m_buffered, 0, 56 - m_buffered);
+    for (int i = 0; i < 8; ++i)
+        m_buffer[56 + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+
+    sha256_block(m_buffer);
+    m_buffered = 0;
+
+    string res = "sha256-";
+    for (auto word : m_state)
+        res += std::format("{:08x}", word);
+
+    return res;
+}
+
+void Content_Hasher::xxh64_stripe(const unsigned char* p)
+{
+    for (int i = 0; i < 4; ++i)
+        m_acc[i] = xxh64_round(m_acc[i], read_u64(p + 8 * i));
+}
+
+void Content_Hasher::sha256_block(const unsigned char* p)
+{
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; ++i)
+    {
+        w[i] = (static_cast<uint32_t>(p[4 * i]) << 24) |
+            (static_cast<uint32_t>(p[4 * i + 1]) << 16) |
+            (static_cast<uint32_t>(p[4 * i + 2]) << 8) |
+            static_cast<uint32_t>(p[4 * i + 3]);
+    }
+
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + g_SHA256_K[i] + w[i];
+        uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+optional<string> hash_file(const fs::path& file, Hash_Mode mode)
+{
+    std::ifstream ifs(file, std::ifstream::binary);
+
+    if (not ifs.is_open())
+        return {};
+
+    Content_Hasher hasher(mode);
+    vector<char> buffer(256 * 1024);
+
+    while (ifs)
+    {
+        ifs.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        hasher.update({ buffer.data(), static_cast<size_t>(ifs.gcount()) });
+    }
+
+    if (ifs.bad())
+        return {};
+
+    return hasher.digest();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "rid.h"
+
+enum class Hash_Mode : uint8_t
+{
+    FAST, // XXH64, a few GB/s, plenty to tell images apart
+    SHA256 // when a collision must be out of the question
+};
+
+// Incremental hash of a body, fed chunk by chunk while it streams to disk.
+class Content_Hasher
+{
+public:
+    explicit Content_Hasher(Hash_Mode mode = Hash_Mode::FAST);
+
+    void update(std::string_view data);
+
+    // "xxh64-<16 hex>" or "sha256-<64 hex>", the hasher is done after this
+    string digest();
+
+    uint64_t bytes_hashed() const { return m_total; }
+
+private:
+    void xxh64_stripe(const unsigned char* p);
+    void sha256_block(const unsigned char* p);
+
+    Hash_Mode m_mode;
+    uint64_t m_total = 0;
+
+    unsigned char m_buffer[64] = {}; // partial stripe (32 bytes) or block (64 bytes)
+    size_t m_buffered = 0;
+
+    uint64_t m_acc[4] = {}; // XXH64 accumulators
+    uint32_t m_state[8] = {}; // SHA-256 state
+};
+
+// hash of a whole file, nothing when it cannot be read
+optional<string> hash_file(const fs::path& file, Hash_Mode mode);
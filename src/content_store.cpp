@@ -0,0 +1,146 @@
+#include "pch.h"
+
+#include "content_store.h"
+#include "config.h"
+#include "utils.h"
+
+Content_Store::Content_Store(const fs::path& root, Hash_Mode mode) :
+    m_root(root),
+    m_mode(mode)
+{
+    if (m_root.empty())
+        return;
+
+    std::error_code ec;
+    fs::create_directories(m_root, ec);
+
+    if (ec)
+    {
+        cout << std::format("[WARN] Cannot create content store <{}>: {}",
+                            m_root.string(), ec.message()) << endl;
+        m_root.clear();
+    }
+}
+
+bool Content_Store::is_open() const
+{
+    return not m_root.empty();
+}
+
+Hash_Mode Content_Store::mode() const
+{
+    return m_mode;
+}
+
+bool Content_Store::deduplicate(const fs::path& file, string_cref digest)
+{
+    auto dash = digest.find('-');
+
+    if (not is_open() or
+        dash == string::npos or
+        digest.size() < dash + 3)
+        return false;
+
+    // <root>/<first two hex digits>/<digest>, no folder with millions of entries
+    fs::path object = m_root / digest.substr(dash + 1, 2) / digest;
+
+    std::error_code ec;
+    auto size = fs::file_size(file, ec);
+
+    if (ec)
+        return false;
+
+    // twice: another process may store the same content right between
+    // our check and our link
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        if (fs::exists(object, ec))
+        {
+            if (fs::equivalent(object, file, ec))
+                return false; // already one of the links
+
+            if (fs::file_size(object, ec) != size or ec)
+                return false; // same hash, different size: not the same content
+
+            // link next to the file, then rename over it, the file with the
+            // final name is complete at every moment
+            fs::path link = file;
+            link += ".link";
+            fs::remove(link, ec);
+
+            fs::create_hard_link(object, link, ec);
+
+            if (not ec)
+                fs::rename(link, file, ec);
+
+            if (ec)
+            {
+                fs::remove(link, ec);
+
+                if (not m_warned.exchange(true))
+                {
+                    cout << std::format("[WARN] Cannot hardlink <{}> into the content store <{}>, duplicates are kept as copies",
+                                        file.string(), m_root.string()) << endl;
+                }
+
+                return false;
+            }
+
+            ++m_files_deduplicated;
+            m_bytes_saved += size;
+            return true;
+        }
+
+        // first copy: it becomes the one everybody links to
+        fs::create_directories(object.parent_path(), ec);
+        fs::create_hard_link(file, object, ec);
+
+        if (not ec)
+            return false;
+    }
+
+    if (not m_warned.exchange(true))
+    {
+        cout << std::format("[WARN] Cannot hardlink <{}> into the content store <{}>: {}",
+                            file.string(), m_root.string(), ec.message()) << endl;
+    }
+
+    return false;
+}
+
+size_t Content_Store::files_deduplicated() const
+{
+    return m_files_deduplicated;
+}
+
+uint64_t Content_Store::bytes_saved() const
+{
+    return m_bytes_saved;
+}
+
+Content_Store& content_store()
+{
+    static Content_Store store = []
+    {
+        auto mode = config().content_hash;
+
+        fs::path root = config().content_store;
+
+        if (root == "off")
+            return Content_Store({}, mode);
+
+        if (root.empty())
+        {
+            auto app_data = Utils::app_data_folder();
+
+            if (not app_data.has_value())
+                return Content_Store({}, mode);
+
+            root = *app_data / "content_store";
+        }
+
+        return Content_Store(root, mode);
+    }();
+
+    return store;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "rid.h"
+#include "content_hash.h"
+
+// Folder of hardlinks named after the hash of their content, shared by every
+// dest-folder and every run. The first copy of a body is linked into the
+// store, later copies of the same body are replaced by a hardlink to it:
+// one copy on disk however many subreddits it was cross-posted to.
+// Hardlinks do not cross volumes, files on another volume than the store
+// are simply kept as they are.
+class Content_Store
+{
+public:
+    // an empty root disables the store
+    Content_Store(const fs::path& root, Hash_Mode mode = Hash_Mode::FAST);
+
+    Content_Store(const Content_Store&) = delete;
+    Content_Store& operator=(const Content_Store&) = delete;
+
+    bool is_open() const;
+    Hash_Mode mode() const;
+
+    // `file` is complete and its content hashes to `digest`: true when it was
+    // replaced by a link to an earlier copy, false when it is the first copy
+    // (or deduplication is not possible)
+    bool deduplicate(const fs::path& file, string_cref digest);
+
+    size_t files_deduplicated() const;
+    uint64_t bytes_saved() const;
+
+private:
+    fs::path m_root;
+    Hash_Mode m_mode;
+
+    std::atomic<size_t> m_files_deduplicated = 0;
+    std::atomic<uint64_t> m_bytes_saved = 0;
+    std::atomic<bool> m_warned = false;
+};
+
+// CONTENT_STORE and CONTENT_HASH (fast | sha256) from the .env file,
+// by default "<local app data>/rid/content_store" with the fast hash.
+// CONTENT_STORE=off disables deduplication
+Content_Store& content_store();
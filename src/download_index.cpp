@@ -0,0 +1,375 @@
+#include "pch.h"
+
+#include "download_index.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+constexpr uint32_t g_INDEX_MAGIC = 0x58444952; // "RIDX"
+constexpr uint32_t g_INDEX_VERSION = 1;
+constexpr uint64_t g_INDEX_INITIAL_CAPACITY = 4096;
+
+enum Key_Kind : char
+{
+    POST_ID = 'p',
+    SOURCE_URL = 'u',
+    FILE_NAME = 'n',
+    OWNER = 'o',
+};
+
+// FNV-1a, then the splitmix64 finalizer: FNV alone clusters in the low bits
+// and those are the ones picking the slot
+uint64_t key_hash(Key_Kind kind, std::string_view text)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    h = (h ^ static_cast<unsigned char>(kind)) * 1099511628211ull;
+    for (unsigned char c : text)
+        h = (h ^ c) * 1099511628211ull;
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+
+    return h == 0 ? 1 : h; // 0 marks an empty slot
+}
+
+// windows file names are case insensitive, "Cat" and "cat" are the same file
+string lowercase_ascii(string_cref name)
+{
+    string res = name;
+    for (auto& c : res)
+    {
+        if (c >= 'A' and c <= 'Z')
+            c = static_cast<char>(c - 'A' + 'a');
+    }
+    return res;
+}
+
+}
+
+Download_Index::Download_Index(const fs::path& file) :
+    m_file(file)
+{
+    if (fs::exists(file))
+    {
+        if (auto map = map_file(file); map.has_value())
+        {
+            if (is_valid(*map))
+            {
+                m_map = *map;
+                return;
+            }
+
+            unmap_file(*map);
+        }
+
+        cout << std::format("[WARN] download index <{}> is unreadable, starting a new one",
+                            file.string()) << endl;
+    }
+
+    if (auto map = create_file(file, g_INDEX_INITIAL_CAPACITY); map.has_value())
+        m_map = *map;
+    else
+        cout << std::format("[WARN] cannot create download index <{}>", file.string()) << endl;
+}
+
+Download_Index::~Download_Index()
+{
+    unmap_file(m_map);
+}
+
+bool Download_Index::is_open() const
+{
+    return m_map.data != nullptr;
+}
+
+bool Download_Index::contains(const Post& post)
+{
+    std::lock_guard lock(m_mutex);
+
+    if (not is_open())
+        return false;
+
+    if (post.id != "" and
+        find_slot(m_map, key_hash(POST_ID, post.id))->key != 0)
+        return true;
+
+    if (post.url != "" and
+        find_slot(m_map, key_hash(SOURCE_URL, post.url))->key != 0)
+        return true;
+
+    return false;
+}
+
+void Download_Index::add(const Post& post)
+{
+    std::lock_guard lock(m_mutex);
+
+    if (not is_open())
+        return;
+
+    if (post.id != "")
+        insert(key_hash(POST_ID, post.id), 1);
+
+    if (post.url != "")
+        insert(key_hash(SOURCE_URL, post.url), 1);
+}
+
+bool Download_Index::claim_name(string_cref name, string_cref post_id)
+{
+    std::lock_guard lock(m_mutex);
+
+    if (not is_open())
+        return true; // like before the index: the title is the file name
+
+    uint64_t key = key_hash(FILE_NAME, lowercase_ascii(name));
+    uint64_t owner = key_hash(OWNER, post_id);
+
+    const Slot* slot = find_slot(m_map, key);
+
+    if (slot->key != 0)
+        return slot->value == owner;
+
+    insert(key, owner);
+    return true;
+}
+
+size_t Download_Index::size()
+{
+    std::lock_guard lock(m_mutex);
+
+    return is_open() ? static_cast<size_t>(m_map.header()->count) : 0;
+}
+
+Download_Index::Slot* Download_Index::find_slot(const Mapping& map, uint64_t key)
+{
+    const uint64_t mask = map.header()->capacity - 1;
+    Slot* slots = map.slots();
+
+    // linear probing, the load factor keeps the runs short
+    for (uint64_t i = key & mask; ; i = (i + 1) & mask)
+    {
+        if (slots[i].key == key or slots[i].key == 0)
+            return &slots[i];
+    }
+}
+
+void Download_Index::insert(uint64_t key, uint64_t value)
+{
+    Header* header = m_map.header();
+
+    // keep it under 70% full
+    if ((header->count + 1) * 10 > header->capacity * 7)
+    {
+        grow();
+
+        if (not is_open())
+            return;
+
+        header = m_map.header();
+
+        if (header->count + 1 >= header->capacity)
+            return; // full and cannot grow, forget about it
+    }
+
+    Slot* slot = find_slot(m_map, key);
+
+    if (slot->key == 0)
+    {
+        slot->key = key;
+        ++header->count;
+    }
+
+    slot->value = value;
+}
+
+bool Download_Index::grow()
+{
+    // the bigger table is built on the side and renamed over the old one,
+    // a crash in the middle leaves the old one untouched
+    fs::path tmp = m_file;
+    tmp += ".tmp";
+
+    auto bigger = create_file(tmp, m_map.header()->capacity * 2);
+
+    if (not bigger.has_value())
+        return false;
+
+    const Slot* slots = m_map.slots();
+
+    for (uint64_t i = 0; i < m_map.header()->capacity; ++i)
+    {
+        if (slots[i].key == 0)
+            continue;
+
+        *find_slot(*bigger, slots[i].key) = slots[i];
+        ++bigger->header()->count;
+    }
+
+    unmap_file(m_map);
+    unmap_file(*bigger);
+
+    std::error_code ec;
+    fs::rename(tmp, m_file, ec);
+
+    // on failure the old table is still there, keep using it
+    auto map = map_file(m_file);
+
+    if (not map.has_value())
+    {
+        cout << std::format("[WARN] download index <{}> lost while growing", m_file.string()) << endl;
+        return false;
+    }
+
+    m_map = *map;
+    return not ec;
+}
+
+optional<Download_Index::Mapping> Download_Index::create_file(const fs::path& file, uint64_t capacity)
+{
+    {
+        std::ofstream out(file, std::ofstream::trunc | std::ofstream::binary);
+
+        if (not out.is_open())
+            return {};
+
+        Header header{
+            .magic = g_INDEX_MAGIC,
+            .version = g_INDEX_VERSION,
+            .capacity = capacity,
+            .count = 0
+        };
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        if (not out)
+            return {};
+    }
+
+    std::error_code ec;
+    fs::resize_file(file, sizeof(Header) + capacity * sizeof(Slot), ec); // zero filled
+
+    if (ec)
+        return {};
+
+    return map_file(file);
+}
+
+bool Download_Index::is_valid(const Mapping& map)
+{
+    if (map.size < sizeof(Header))
+        return false;
+
+    const Header* header = map.header();
+
+    return header->magic == g_INDEX_MAGIC and
+        header->version == g_INDEX_VERSION and
+        header->capacity >= 16 and
+        (header->capacity & (header->capacity - 1)) == 0 and
+        header->count < header->capacity and
+        map.size == sizeof(Header) + header->capacity * sizeof(Slot);
+}
+
+optional<Download_Index::Mapping> Download_Index::map_file(const fs::path& file)
+{
+    Mapping map;
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileW(file.c_str(),
+                                GENERIC_READ | GENERIC_WRITE,
+                                FILE_SHARE_READ,
+                                nullptr,
+                                OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL,
+                                nullptr);
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return {};
+
+    LARGE_INTEGER size{};
+    if (not GetFileSizeEx(handle, &size) or size.QuadPart == 0)
+    {
+        CloseHandle(handle);
+        return {};
+    }
+
+    HANDLE mapping = CreateFileMappingW(handle, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+
+    if (mapping == nullptr)
+    {
+        CloseHandle(handle);
+        return {};
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+    if (data == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(handle);
+        return {};
+    }
+
+    map.data = data;
+    map.size = static_cast<size_t>(size.QuadPart);
+    map.file = reinterpret_cast<std::intptr_t>(handle);
+    map.mapping = reinterpret_cast<std::intptr_t>(mapping);
+#else
+    int fd = open(file.c_str(), O_RDWR);
+
+    if (fd < 0)
+        return {};
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 or st.st_size == 0)
+    {
+        close(fd);
+        return {};
+    }
+
+    void* data = mmap(nullptr, static_cast<size_t>(st.st_size),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return {};
+    }
+
+    map.data = data;
+    map.size = static_cast<size_t>(st.st_size);
+    map.file = fd;
+#endif
+
+    return map;
+}
+
+void Download_Index::unmap_file(Mapping& map)
+{
+    if (map.data == nullptr)
+        return;
+
+#ifdef _WIN32
+    FlushViewOfFile(map.data, 0);
+    UnmapViewOfFile(map.data);
+    CloseHandle(reinterpret_cast<HANDLE>(map.mapping));
+    CloseHandle(reinterpret_cast<HANDLE>(map.file));
+#else
+    munmap(map.data, map.size);
+    close(static_cast<int>(map.file));
+#endif
+
+    map = {};
+}
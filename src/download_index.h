@@ -0,0 +1,77 @@
+#pragma once
+
+#include "rid.h"
+
+// Persistent record of what was downloaded into a folder, kept next to the
+// files in an open addressing hash table mapped in memory. Checking a post
+// costs a couple of memory reads, no stat on a folder that can hold
+// hundreds of thousands of files.
+// Only 64 bit hashes of the keys are stored: post ids, source urls and the
+// file names handed out to posts.
+class Download_Index
+{
+public:
+    explicit Download_Index(const fs::path& file);
+    ~Download_Index();
+
+    Download_Index(const Download_Index&) = delete;
+    Download_Index& operator=(const Download_Index&) = delete;
+
+    // false when the file cannot be created or mapped, the index then
+    // knows nothing and remembers nothing
+    bool is_open() const;
+
+    // the post, or another post with the same source url, is on disk already
+    bool contains(const Post& post);
+
+    // call once every file of the post is on disk
+    void add(const Post& post);
+
+    // true when `name` (file name without extension) belongs to the post,
+    // it is claimed for the post when no other post took it yet
+    bool claim_name(string_cref name, string_cref post_id);
+
+    // number of keys stored
+    size_t size();
+
+private:
+    struct Slot
+    {
+        uint64_t key = 0; // 0 means empty
+        uint64_t value = 0;
+    };
+
+    struct Header
+    {
+        uint32_t magic = 0;
+        uint32_t version = 0;
+        uint64_t capacity = 0; // slots, power of 2
+        uint64_t count = 0; // slots in use
+    };
+
+    struct Mapping
+    {
+        void* data = nullptr;
+        size_t size = 0;
+        std::intptr_t file = -1;
+        std::intptr_t mapping = -1;
+
+        Header* header() const { return static_cast<Header*>(data); }
+        Slot* slots() const { return reinterpret_cast<Slot*>(header() + 1); }
+    };
+
+    static optional<Mapping> map_file(const fs::path& file);
+    static void unmap_file(Mapping& map);
+
+    // a zeroed table with room for `capacity` slots
+    static optional<Mapping> create_file(const fs::path& file, uint64_t capacity);
+    static bool is_valid(const Mapping& map);
+
+    static Slot* find_slot(const Mapping& map, uint64_t key);
+    void insert(uint64_t key, uint64_t value);
+    bool grow();
+
+    std::mutex m_mutex;
+    fs::path m_file;
+    Mapping m_map; // data is nullptr when the index is not open
+};
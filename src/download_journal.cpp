@@ -0,0 +1,348 @@
+#include "pch.h"
+
+#include "download_journal.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+const char* result_name(Download_Result result)
+{
+    switch (result)
+    {
+        case Download_Result::DOWNLOADED: return "DOWNLOADED";
+        case Download_Result::FAILED: return "FAILED";
+        case Download_Result::SKIPPED: return "SKIPPED";
+        case Download_Result::UNABLE: return "UNABLE";
+        default: return "INVALID";
+    }
+}
+
+optional<Download_Result> result_from_name(std::string_view name)
+{
+    if (name == "DOWNLOADED") return Download_Result::DOWNLOADED;
+    if (name == "FAILED") return Download_Result::FAILED;
+    if (name == "SKIPPED") return Download_Result::SKIPPED;
+    if (name == "UNABLE") return Download_Result::UNABLE;
+
+    return {};
+}
+
+bool is_done(Download_Result result)
+{
+    return result == Download_Result::DOWNLOADED or
+        result == Download_Result::SKIPPED;
+}
+
+}
+
+Download_Journal::Download_Journal(const fs::path& file,
+                                   std::chrono::milliseconds sync_interval,
+                                   size_t batch_size) :
+    m_file(file),
+    m_sync_interval(sync_interval),
+    m_batch_size(batch_size)
+{
+    replay();
+
+#ifdef _WIN32
+    if (_wsopen_s(&m_fd, m_file.c_str(),
+                  _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY,
+                  _SH_DENYWR, _S_IREAD | _S_IWRITE) != 0)
+        m_fd = -1;
+#else
+    m_fd = open(m_file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+#endif
+
+    if (m_fd < 0)
+    {
+        cout << std::format("[WARN] Cannot open journal <{}>, an interrupted page will be processed again",
+                            m_file.string()) << endl;
+        return;
+    }
+
+    m_thread = std::thread(&Download_Journal::sync_loop, this);
+}
+
+Download_Journal::~Download_Journal()
+{
+    close_file();
+}
+
+bool Download_Journal::is_open() const
+{
+    return m_fd >= 0;
+}
+
+void Download_Journal::replay()
+{
+    std::ifstream ifs(m_file, std::ifstream::binary);
+
+    if (not ifs.is_open())
+        return;
+
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    string data = ss.str();
+    ifs.close();
+
+    // a line without its newline was cut by a crash, it is dropped and the
+    // file truncated so the next line does not get glued to it
+    size_t end = data.rfind('\n');
+    end = end == string::npos ? 0 : end + 1;
+
+    if (end != data.size())
+    {
+        std::error_code ec;
+        fs::resize_file(m_file, end, ec);
+    }
+
+    std::string_view rest(data.data(), end);
+
+    while (not rest.empty())
+    {
+        auto line = rest.substr(0, rest.find('\n'));
+        rest.remove_prefix(line.size() + 1);
+
+        std::string_view fields[4];
+        size_t count = 0;
+
+        while (count < 4)
+        {
+            auto tab = line.find('\t');
+            fields[count++] = line.substr(0, tab);
+
+            if (tab == std::string_view::npos)
+                break;
+
+            line.remove_prefix(tab + 1);
+        }
+
+        auto result = result_from_name(count >= 3 ? fields[2] : "");
+
+        if (not result.has_value() or fields[0].empty())
+            continue;
+
+        auto& entry = m_entries[string(fields[0])];
+
+        size_t part = 0;
+        if (fields[1] == "*")
+            entry.result = result;
+        else if (std::from_chars(fields[1].data(), fields[1].data() + fields[1].size(), part).ec == std::errc{})
+            entry.parts[part] = *result;
+    }
+
+    m_replayed = m_entries.size();
+}
+
+optional<Download_Result> Download_Journal::finished(string_cref post_id)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto it = m_entries.find(post_id);
+
+    if (it == m_entries.end() or
+        not it->second.result.has_value() or
+        *it->second.result == Download_Result::FAILED)
+        return {};
+
+    return it->second.result;
+}
+
+bool Download_Journal::part_done(string_cref post_id, size_t part)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto it = m_entries.find(post_id);
+
+    if (it == m_entries.end())
+        return false;
+
+    auto part_it = it->second.parts.find(part);
+
+    return part_it != it->second.parts.end() and is_done(part_it->second);
+}
+
+void Download_Journal::record_part(string_cref post_id,
+                                   size_t part,
+                                   Download_Result result,
+                                   string_cref reason)
+{
+    if (post_id.empty())
+        return;
+
+    std::lock_guard lock(m_mutex);
+
+    m_entries[post_id].parts[part] = result;
+    append(post_id, std::to_string(part), result, reason);
+}
+
+void Download_Journal::record_post(string_cref post_id,
+                                   Download_Result result,
+                                   string_cref reason)
+{
+    if (post_id.empty())
+        return;
+
+    std::lock_guard lock(m_mutex);
+
+    m_entries[post_id].result = result;
+    append(post_id, "*", result, reason);
+}
+
+void Download_Journal::append(string_cref post_id,
+                              string_cref part,
+                              Download_Result result,
+                              string_cref reason)
+{
+    if (m_fd < 0 or m_stopping)
+        return;
+
+    // one result per line, whatever the reason says
+    string clean_reason = reason;
+    std::replace_if(clean_reason.begin(), clean_reason.end(),
+                    [](char c) { return c == '\t' or c == '\r' or c == '\n'; }, ' ');
+
+    m_pending += std::format("{}\t{}\t{}\t{}\n", post_id, part, result_name(result), clean_reason);
+    ++m_pending_lines;
+    ++m_recorded;
+
+    if (m_pending_lines >= m_batch_size)
+        m_cv.notify_one();
+}
+
+void Download_Journal::sync()
+{
+    std::unique_lock lock(m_mutex);
+
+    if (m_fd < 0)
+        return;
+
+    auto target = m_recorded;
+
+    m_sync_requested = true;
+    m_cv.notify_one();
+
+    m_synced_cv.wait(lock, [&] { return m_synced >= target or m_fd < 0; });
+}
+
+void Download_Journal::sync_loop()
+{
+    std::unique_lock lock(m_mutex);
+
+    while (true)
+    {
+        m_cv.wait_for(lock, m_sync_interval, [&]
+        {
+            return m_stopping or
+                m_sync_requested or
+                m_pending_lines >= m_batch_size;
+        });
+
+        m_sync_requested = false;
+
+        if (m_pending.empty())
+        {
+            if (m_stopping)
+                break;
+
+            continue;
+        }
+
+        string lines = std::move(m_pending);
+        m_pending.clear();
+        m_pending_lines = 0;
+        auto recorded = m_recorded;
+
+        // one write and one sync for the whole batch, the workers keep recording meanwhile
+        lock.unlock();
+        bool ok = write_and_sync(lines);
+        lock.lock();
+
+        if (not ok and not m_warned)
+        {
+            m_warned = true;
+            cout << std::format("[WARN] Cannot write journal <{}>", m_file.string()) << endl;
+        }
+
+        m_synced = recorded;
+        m_synced_cv.notify_all();
+    }
+}
+
+bool Download_Journal::write_and_sync(string_cref lines)
+{
+    const char* data = lines.data();
+    size_t left = lines.size();
+
+    while (left > 0)
+    {
+#ifdef _WIN32
+        int written = _write(m_fd, data, static_cast<unsigned>(std::min<size_t>(left, 1u << 30)));
+#else
+        auto written = write(m_fd, data, left);
+#endif
+
+        if (written <= 0)
+            return false;
+
+        data += written;
+        left -= static_cast<size_t>(written);
+    }
+
+#ifdef _WIN32
+    return _commit(m_fd) == 0;
+#else
+    return fsync(m_fd) == 0;
+#endif
+}
+
+void Download_Journal::close_file()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+
+    // the loop writes what is pending before leaving
+    if (m_thread.joinable())
+        m_thread.join();
+
+    std::lock_guard lock(m_mutex);
+
+    if (m_fd >= 0)
+    {
+#ifdef _WIN32
+        _close(m_fd);
+#else
+        close(m_fd);
+#endif
+        m_fd = -1;
+    }
+
+    m_synced_cv.notify_all();
+}
+
+void Download_Journal::discard()
+{
+    close_file();
+
+    std::error_code ec;
+    fs::remove(m_file, ec);
+}
+
+size_t Download_Journal::replayed()
+{
+    std::lock_guard lock(m_mutex);
+    return m_replayed;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "rid.h"
+
+// Append-only log of what happened to every post of the listing and to
+// every part of it, one line per result:
+//     <post id> \t <part, 1 based, * for the whole post> \t <result> \t <reason>
+// after.txt only moves once a whole page is done, after a crash the journal
+// of the previous run tells which posts of that page are finished: they
+// are skipped without resolving their urls again, only FAILED ones are
+// retried, and of those only the parts that failed.
+// Lines are written and synced to disk in batches by a background thread,
+// a crash loses at most the last `sync_interval` worth of results.
+class Download_Journal
+{
+public:
+    explicit Download_Journal(const fs::path& file,
+                              std::chrono::milliseconds sync_interval = std::chrono::milliseconds(250),
+                              size_t batch_size = 64);
+    ~Download_Journal();
+
+    Download_Journal(const Download_Journal&) = delete;
+    Download_Journal& operator=(const Download_Journal&) = delete;
+
+    // false when the file cannot be opened, nothing is recorded then
+    bool is_open() const;
+
+    // DOWNLOADED, SKIPPED or UNABLE when the post was finished by a
+    // previous run, nothing when it never finished or FAILED
+    optional<Download_Result> finished(string_cref post_id);
+
+    // the part was downloaded (or found on disk) by a previous run
+    bool part_done(string_cref post_id, size_t part);
+
+    void record_part(string_cref post_id,
+                     size_t part,
+                     Download_Result result,
+                     string_cref reason = "");
+
+    void record_post(string_cref post_id,
+                     Download_Result result,
+                     string_cref reason = "");
+
+    // blocks until everything recorded so far is on disk
+    void sync();
+
+    // the listing is over: the file is deleted, nothing is recorded anymore
+    void discard();
+
+    // posts known from previous runs
+    size_t replayed();
+
+private:
+    struct Entry
+    {
+        optional<Download_Result> result; // nothing until the whole post is recorded
+        std::map<size_t, Download_Result> parts;
+    };
+
+    void replay();
+    void append(string_cref post_id, string_cref part, Download_Result result, string_cref reason);
+    void sync_loop();
+    bool write_and_sync(string_cref lines);
+    void close_file(); // after writing whatever is pending
+
+    fs::path m_file;
+    std::chrono::milliseconds m_sync_interval;
+    size_t m_batch_size;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_synced_cv;
+    std::map<string, Entry> m_entries;
+    size_t m_replayed = 0;
+
+    string m_pending; // lines not written yet
+    size_t m_pending_lines = 0;
+    uint64_t m_recorded = 0; // lines recorded since the start
+    uint64_t m_synced = 0; // of those, lines on disk
+    bool m_sync_requested = false;
+    bool m_stopping = false;
+    bool m_warned = false;
+
+    int m_fd = -1;
+    std::thread m_thread;
+};
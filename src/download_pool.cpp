@@ -0,0 +1,279 @@
+#include "pch.h"
+
+#include "download_pool.h"
+
+namespace
+{
+
+// the task running on this worker: the host whose slot it took, nothing
+// for a resumed task, and whether it kept that slot with hold()
+thread_local const string* t_host = nullptr;
+thread_local bool t_held = false;
+
+}
+
+Download_Pool::Download_Pool(unsigned num_workers,
+                             Host_Limit host_limit) :
+    m_host_limit(std::move(host_limit))
+{
+    if (num_workers == 0)
+        num_workers = 1;
+
+    m_workers.reserve(num_workers);
+    for (unsigned i = 0; i < num_workers; ++i)
+        m_workers.emplace_back(&Download_Pool::worker_loop, this);
+}
+
+Download_Pool::~Download_Pool()
+{
+    size_t dropped = 0;
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        for (auto& [host, queue] : m_hosts)
+        {
+            dropped += queue.tasks.size();
+            queue.tasks.clear();
+        }
+    }
+
+    {
+        std::lock_guard lock(m_results_mutex);
+        m_pending -= dropped;
+    }
+
+    // what is running or held calls back into the storage and the pool,
+    // whatever owns them has to wait for the last of it
+    while (wait_result().has_value())
+    {
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_work_cv.notify_all();
+
+    for (auto& worker : m_workers)
+    {
+        if (worker.joinable())
+            worker.join();
+    }
+}
+
+void Download_Pool::submit(Task task, string_cref host)
+{
+    {
+        std::lock_guard lock(m_results_mutex);
+        ++m_pending;
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        auto [it, inserted] = m_hosts.try_emplace(host);
+        if (inserted)
+        {
+            it->second.limit = m_host_limit ? m_host_limit(host) : 0;
+            m_ring.push_back(host);
+        }
+
+        it->second.tasks.push_back(std::move(task));
+    }
+    m_work_cv.notify_one();
+}
+
+Download_Pool::Hold Download_Pool::hold()
+{
+    assert(t_host != nullptr and not t_held);
+    t_held = true;
+
+    {
+        std::lock_guard lock(m_results_mutex);
+        ++m_pending;
+    }
+
+    return { *t_host };
+}
+
+void Download_Pool::resume(Hold hold, Task task)
+{
+    std::lock_guard lock(m_mutex);
+
+    release_host(hold.host);
+    m_resumed.push_back(std::move(task));
+
+    // the freed slot and the resumed task, maybe for two workers. Under the
+    // lock: the pool can go as soon as the resumed task is over, while this
+    // runs on the engine thread
+    m_work_cv.notify_all();
+}
+
+optional<Thread_Result> Download_Pool::wait_result()
+{
+    std::unique_lock lock(m_results_mutex);
+
+    if (m_pending == 0)
+        return {};
+
+    // the last tasks can all hand their result over and return nothing
+    m_results_cv.wait(lock, [this] { return not m_results.empty() or m_pending == 0; });
+
+    if (m_results.empty())
+        return {};
+
+    Thread_Result res = std::move(m_results.front());
+    m_results.pop_front();
+    --m_pending;
+
+    return res;
+}
+
+size_t Download_Pool::pending() const
+{
+    std::lock_guard lock(m_results_mutex);
+    return m_pending;
+}
+
+unsigned Download_Pool::num_workers() const
+{
+    return static_cast<unsigned>(m_workers.size());
+}
+
+optional<Download_Pool::Picked> Download_Pool::pick_task()
+{
+    // what finishes a post goes before what starts a new one
+    if (not m_resumed.empty())
+    {
+        Task task = std::move(m_resumed.front());
+        m_resumed.pop_front();
+
+        return Picked{ .task = std::move(task) };
+    }
+
+    for (size_t i = 0; i < m_ring.size(); ++i)
+    {
+        size_t idx = (m_cursor + i) % m_ring.size();
+        auto& queue = m_hosts[m_ring[idx]];
+
+        if (queue.tasks.empty() or
+            (queue.limit != 0 and queue.in_flight >= queue.limit))
+            continue;
+
+        // next pick starts from the following host
+        m_cursor = idx + 1;
+
+        Task task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        ++queue.in_flight;
+
+        return Picked{ .host = m_ring[idx], .task = std::move(task) };
+    }
+
+    return {};
+}
+
+void Download_Pool::release_host(string_cref host)
+{
+    auto it = m_hosts.find(host);
+    --it->second.in_flight;
+
+    // forget idle hosts, a long crawl meets thousands of domains
+    if (it->second.in_flight == 0 and
+        it->second.tasks.empty())
+    {
+        auto pos = std::find(m_ring.begin(), m_ring.end(), host);
+        auto idx = static_cast<size_t>(pos - m_ring.begin());
+
+        m_ring.erase(pos);
+        m_hosts.erase(it);
+
+        if (m_cursor > idx)
+            --m_cursor;
+    }
+}
+
+void Download_Pool::worker_loop()
+{
+    while (true)
+    {
+        optional<Picked> picked;
+
+        {
+            std::unique_lock lock(m_mutex);
+            m_work_cv.wait(lock, [this, &picked]
+            {
+                return m_stopping or (picked = pick_task()).has_value();
+            });
+
+            if (not picked.has_value())
+                return; // stopping
+        }
+
+        auto& [host, task] = *picked;
+
+        t_host = host.has_value() ? &*host : nullptr;
+        t_held = false;
+
+        optional<Thread_Result> res;
+        try
+        {
+            res = task();
+        }
+        catch (const std::exception& e)
+        {
+            cout << std::format("[EXCEP][Download_Pool] {}", e.what()) << endl;
+            res = Thread_Result{ .download_res = { Download_Result::FAILED } };
+        }
+
+        const bool held = t_held;
+        t_host = nullptr;
+        t_held = false;
+
+        // a held slot is given back by resume()
+        if (host.has_value() and not held)
+        {
+            {
+                std::lock_guard lock(m_mutex);
+                release_host(*host);
+            }
+            // a freed slot can make a task of that host eligible for anybody
+            m_work_cv.notify_all();
+        }
+
+        {
+            std::lock_guard lock(m_results_mutex);
+
+            // tasks it submitted are counted already, m_pending cannot drop to 0 early
+            if (res.has_value())
+                m_results.push_back(std::move(*res));
+            else
+                --m_pending;
+        }
+        m_results_cv.notify_one();
+    }
+}
+
+string host_key_for_domain(string_cref domain)
+{
+    // pages of imgur, resolved through its API. i.imgur.com serves the
+    // media themselves and is a host of its own
+    if (domain == "m.imgur.com" or
+        domain == "www.imgur.com")
+        return "imgur.com";
+
+    return domain;
+}
+
+unsigned default_host_limit(string_cref host)
+{
+    if (host == "imgur.com") return 4; // API calls count against the client id
+    if (host == "i.imgur.com") return 16; // album parts, no API call
+    if (host == "i.redd.it") return 32;
+    if (host == "v.redd.it") return 8;
+    if (host == "reddit.com") return 16; // galleries, served by i.redd.it
+    if (host == "gfycat.com") return 4;
+
+    return 2; // unknown domain, direct download
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "rid.h"
+
+// Long-lived pool of download workers.
+// Tasks are queued per host and workers take them round robin across the
+// hosts, skipping a host while it already has its limit of tasks in flight:
+// a slow host cannot take every worker while fast CDN fetches wait.
+// Any idle worker can take any eligible task, so nobody sits idle while
+// there is work it is allowed to do.
+// Finished tasks are pushed on a completion channel drained by wait_result().
+// A task can submit more tasks and return nothing, handing its result over
+// to one of them: the parts of a gallery report the post once all are done.
+// A task can also start work that goes on outside the pool, a transfer of
+// HTTP_Engine, and return at once: the worker is free while the engine
+// transfers and the host slot stays taken until the work resumes.
+class Download_Pool
+{
+public:
+    // nothing when the result comes from a task this one submitted
+    using Task = std::function<optional<Thread_Result>()>;
+
+    // max tasks in flight for a host, 0 means no limit
+    using Host_Limit = std::function<unsigned(string_cref host)>;
+
+    // the host slot of a task that returned with its work still running
+    struct Hold
+    {
+        string host;
+    };
+
+    explicit Download_Pool(unsigned num_workers,
+                           Host_Limit host_limit = {});
+
+    // queued tasks are dropped, the running and held ones are waited for:
+    // no transfer they started calls back once the pool is gone
+    ~Download_Pool();
+
+    Download_Pool(const Download_Pool&) = delete;
+    Download_Pool& operator=(const Download_Pool&) = delete;
+
+    void submit(Task task, string_cref host = "");
+
+    // from inside a task, at most once: the task returns nothing, its host
+    // slot stays taken and wait_result() keeps waiting until resume()
+    Hold hold();
+
+    // from any thread, exactly once per hold(), exceptions included: gives
+    // the host slot back and runs `task` ahead of the host queues, it
+    // returns the result of the held task
+    void resume(Hold hold, Task task);
+
+    // blocks until a task returns a result, returns nothing
+    // if there are no submitted tasks left to wait for
+    optional<Thread_Result> wait_result();
+
+    // tasks submitted but not yet returned by wait_result()
+    size_t pending() const;
+
+    unsigned num_workers() const;
+
+private:
+    struct Host_Queue
+    {
+        std::deque<Task> tasks;
+        unsigned in_flight = 0;
+        unsigned limit = 0;
+    };
+
+    struct Picked
+    {
+        optional<string> host; // nothing for a resumed task, it has no slot
+        Task task;
+    };
+
+    void worker_loop();
+
+    // resumed tasks first, then the next eligible task round robin across
+    // hosts, m_mutex must be held
+    optional<Picked> pick_task();
+
+    // one task of `host` less in flight, m_mutex must be held
+    void release_host(string_cref host);
+
+    Host_Limit m_host_limit;
+    vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::map<string, Host_Queue> m_hosts;
+    std::deque<Task> m_resumed;
+    vector<string> m_ring; // hosts with queued or running tasks, in arrival order
+    size_t m_cursor = 0;
+    bool m_stopping = false;
+
+    mutable std::mutex m_results_mutex;
+    std::condition_variable m_results_cv;
+    std::deque<Thread_Result> m_results;
+    size_t m_pending = 0;
+};
+
+// host key and default limit for a post domain: the imgur pages share the
+// imgur API budget, i.imgur.com media do not take from it, every unknown
+// domain gets its own small queue
+string host_key_for_domain(string_cref domain);
+
+unsigned default_host_limit(string_cref host);
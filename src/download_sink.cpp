@@ -0,0 +1,459 @@
+#include "pch.h"
+
+#include "download_sink.h"
+#include "content_store.h"
+#include "http_engine.h"
+#include "utils.h"
+
+namespace
+{
+
+// the longest magic we look for is 12 bytes (RIFF....WEBP)
+constexpr size_t g_SNIFF_LEN = 16;
+
+// curl hands over 16 KB at a time, the writer gets fewer and bigger buffers
+constexpr size_t g_WRITE_BATCH = 256 * 1024;
+
+optional<uint64_t> parse_u64(string_cref str)
+{
+    try
+    {
+        return std::stoull(str);
+    }
+    catch (const std::exception&)
+    {
+        return {};
+    }
+}
+
+}
+
+std::shared_ptr<Download_Sink> Download_Sink::to_file(string_cref destination,
+                                                      Content_Store* store,
+                                                      File_Writer* writer)
+{
+    return std::shared_ptr<Download_Sink>(
+        new Download_Sink(destination + ".part", destination, false, store, writer));
+}
+
+std::shared_ptr<Download_Sink> Download_Sink::to_media_file(string_cref destination_stem,
+                                                            Content_Store* store,
+                                                            File_Writer* writer)
+{
+    return std::shared_ptr<Download_Sink>(
+        new Download_Sink(destination_stem + ".part", destination_stem, true, store, writer));
+}
+
+Download_Sink::Download_Sink(string part_path, string destination, bool sniff,
+                             Content_Store* store, File_Writer* writer) :
+    m_part_path(std::move(part_path)),
+    m_meta_path(m_part_path + ".meta"),
+    m_sniff(sniff),
+    m_writer(writer != nullptr ? *writer : file_writer()),
+    m_store(store != nullptr and store->is_open() ? store : nullptr)
+{
+    if (sniff)
+        m_destination_stem = std::move(destination);
+    else
+        m_destination = std::move(destination);
+
+    std::error_code ec;
+    auto part_size = fs::file_size(m_part_path, ec);
+
+    if (ec or part_size == 0)
+        return;
+
+    std::ifstream ifs(m_meta_path);
+
+    for (string line; std::getline(ifs, line); )
+    {
+        auto pos = line.find('=');
+        if (pos == string::npos)
+            continue;
+
+        auto key = line.substr(0, pos);
+        auto value = line.substr(pos + 1);
+
+        if (key == "length")
+            m_expected_length = parse_u64(value);
+        else if (key == "validator")
+            m_validator = value;
+        else if (key == "extension")
+            m_extension = value;
+    }
+
+    // without a validator we cannot tell if the file changed in the meantime
+    if (m_validator == "" or
+        (m_sniff and m_extension == ""))
+        return;
+
+    m_resume_from = part_size;
+}
+
+std::list<string> Download_Sink::request_headers() const
+{
+    if (m_resume_from == 0)
+        return {};
+
+    return {
+        std::format("Range: bytes={}-", m_resume_from),
+        "If-Range: " + m_validator
+    };
+}
+
+void Download_Sink::on_headers(long code,
+                               string_cref content_type,
+                               string_cref raw_headers)
+{
+    m_headers_seen = true;
+    m_code = code;
+    m_content_type = content_type;
+
+    auto headers = Utils::parse_http_headers(raw_headers);
+
+    auto header = [&headers](const char* name) -> string
+    {
+        auto it = headers.find(name);
+        return it != headers.end() ? it->second : "";
+    };
+
+    if (code == 206 and m_resume_from > 0)
+    {
+        // Content-Range: bytes <start>-<end>/<total>
+        auto content_range = header("content-range");
+        auto slash = content_range.find('/');
+        auto dash = content_range.find('-');
+        auto start = content_range.size() > 6 ?
+            parse_u64(content_range.substr(6, dash - 6)) : std::nullopt;
+
+        if (start != m_resume_from)
+        {
+            // start over next time
+            m_writer.post([self = shared_from_this()] { self->discard_part(); });
+            m_verdict = Download_Result::FAILED;
+            return;
+        }
+
+        if (slash != string::npos)
+            m_expected_length = parse_u64(content_range.substr(slash + 1));
+
+        return;
+    }
+
+    if (code == 416 and m_resume_from > 0 and
+        m_expected_length == m_resume_from)
+    {
+        // the previous run died right before the rename
+        m_already_complete = true;
+        return;
+    }
+
+    if (code != 200)
+        return;
+
+    // fresh download, the server may have ignored the Range
+    m_resume_from = 0;
+    m_extension = "";
+    m_expected_length = parse_u64(header("content-length"));
+
+    m_validator = header("etag");
+    if (m_validator == "")
+        m_validator = header("last-modified");
+}
+
+bool Download_Sink::start(bool append)
+{
+    if (m_sniff)
+    {
+        optional<Media_Type> media;
+
+        if (append)
+        {
+            media = Media_Type{ .extension = m_extension };
+        }
+        else
+        {
+            media = Utils::media_type_from_content_type(m_content_type);
+
+            // CDNs love to send "application/octet-stream"
+            if (not media.has_value())
+                media = Utils::sniff_media_type(m_head);
+        }
+
+        if (not media.has_value())
+        {
+            m_verdict = Download_Result::UNABLE;
+            return false;
+        }
+
+        // whether it is on disk already is for complete(), on the writer:
+        // this runs on the engine thread, which never touches the disk
+        m_extension = media->extension;
+        m_destination = std::format("{}.{}", m_destination_stem, m_extension);
+    }
+
+    if (m_store != nullptr)
+        m_hasher.emplace(m_store->mode());
+
+    // the blocks for the whole body reserved at once, no fragmentation
+    // when many files grow side by side
+    optional<uint64_t> preallocate;
+    if (m_expected_length.has_value() and *m_expected_length > m_resume_from)
+        preallocate = *m_expected_length - m_resume_from;
+
+    auto self = shared_from_this();
+
+    m_file = m_writer.open(m_part_path,
+                           append,
+                           preallocate,
+                           [self](std::string_view data)
+    {
+        if (self->m_hasher.has_value())
+            self->m_hasher->update(data);
+    });
+
+    // a resumed body starts with what the previous run wrote
+    if (append and m_hasher.has_value())
+    {
+        m_writer.call(m_file, [self]
+        {
+            std::ifstream ifs(self->m_part_path, std::ifstream::binary);
+            vector<char> buffer(256 * 1024);
+
+            while (ifs)
+            {
+                ifs.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                self->m_hasher->update({ buffer.data(), static_cast<size_t>(ifs.gcount()) });
+            }
+
+            if (ifs.bad())
+                self->m_hasher.reset(); // complete() hashes the whole file instead
+        });
+    }
+
+    if (not append)
+        m_writer.call(m_file, [self] { self->save_meta(); });
+
+    write(m_head);
+    m_head.clear();
+
+    return true;
+}
+
+bool Download_Sink::on_body(std::string_view chunk)
+{
+    if (m_verdict.has_value())
+        return false;
+
+    if (m_code == 206 and not m_file)
+    {
+        if (not start(true))
+            return false;
+    }
+    else if (m_code != 200 and m_code != 206)
+    {
+        // error page (or a 416), don't care about the body
+        return m_code == 416;
+    }
+
+    if (m_file)
+    {
+        write(chunk);
+        return true;
+    }
+
+    if (not m_sniff)
+        return start(false) and on_body(chunk);
+
+    m_head.append(chunk);
+    if (m_head.size() < g_SNIFF_LEN)
+        return true;
+
+    return start(false);
+}
+
+void Download_Sink::finish(const optional<HTTP_Response>& resp,
+                           std::function<void(Download_Result)> done)
+{
+    if (not m_verdict.has_value() and resp.has_value())
+    {
+        if (not m_headers_seen)
+            on_headers(resp->code, resp->content_type, resp->resp_headers);
+
+        // empty or tiny body, never reached the point where start() is called
+        if (not m_verdict.has_value() and
+            not m_already_complete and
+            not m_file and
+            (resp->code == 200 or resp->code == 206))
+            start(resp->code == 206);
+    }
+
+    auto rest = [self = shared_from_this(), resp, done = std::move(done)](bool written)
+    {
+        done(self->complete(resp, written));
+    };
+
+    if (m_file)
+    {
+        flush();
+        m_writer.close(m_file, std::move(rest));
+    }
+    else
+        m_writer.post([rest = std::move(rest)] { rest(true); });
+}
+
+Download_Result Download_Sink::complete(const optional<HTTP_Response>& resp, bool written)
+{
+    if (m_verdict.has_value())
+    {
+        // nothing worth resuming
+        if (*m_verdict != Download_Result::FAILED)
+            discard_part();
+
+        return *m_verdict;
+    }
+
+    if (not resp.has_value())
+    {
+        // network error, keep the .part around for the next run
+        return Download_Result::FAILED;
+    }
+
+    if (m_already_complete)
+    {
+        if (m_sniff)
+            m_destination = std::format("{}.{}", m_destination_stem, m_extension);
+    }
+    else if (resp->code == 200 or resp->code == 206)
+    {
+        if (not written)
+        {
+            cout << std::format("[WARN] Cannot write <{}>", m_part_path) << endl;
+            return Download_Result::FAILED;
+        }
+    }
+    else
+    {
+        // the .part is not a prefix of what the server has anymore
+        if (resp->code == 416)
+            discard_part();
+
+        return Download_Result::FAILED;
+    }
+
+    std::error_code ec;
+
+    // download_media_to_disk() looked for every extension before the
+    // request, this one showed up since: the file there is kept
+    if (m_sniff and fs::exists(m_destination, ec))
+    {
+        discard_part();
+        return Download_Result::SKIPPED;
+    }
+
+    auto size = fs::file_size(m_part_path, ec);
+
+    if (ec or
+        (m_expected_length.has_value() and size != *m_expected_length))
+    {
+        // truncated, the next run resumes from here
+        return Download_Result::FAILED;
+    }
+
+    fs::rename(m_part_path, m_destination, ec);
+    if (ec)
+    {
+        cout << std::format("[WARN] Cannot rename <{}> to <{}>: {}",
+                            m_part_path, m_destination, ec.message()) << endl;
+        return Download_Result::FAILED;
+    }
+
+    fs::remove(m_meta_path, ec);
+
+    if (m_store != nullptr)
+    {
+        // hashed while streaming, unless the bytes came from somewhere else
+        // (a .part completed by a previous run)
+        optional<string> digest;
+
+        if (m_hasher.has_value() and m_hasher->bytes_hashed() == size)
+            digest = m_hasher->digest();
+        else
+            digest = hash_file(m_destination, m_store->mode());
+
+        if (digest.has_value())
+            m_store->deduplicate(m_destination, *digest);
+    }
+
+    return Download_Result::DOWNLOADED;
+}
+
+std::future<Download_Result> submit_to_sink(HTTP_Engine& engine,
+                                            string_cref url,
+                                            std::shared_ptr<Download_Sink> sink)
+{
+    auto promise = std::make_shared<std::promise<Download_Result>>();
+    auto future = promise->get_future();
+
+    submit_to_sink(engine, url, std::move(sink),
+                   [promise](Download_Result result) { promise->set_value(result); });
+
+    return future;
+}
+
+void submit_to_sink(HTTP_Engine& engine,
+                    string_cref url,
+                    std::shared_ptr<Download_Sink> sink,
+                    Download_Done done)
+{
+    engine.submit(
+        HTTP_Request{
+            .url = url,
+            .headers = sink->request_headers(),
+            .on_body = [sink](std::string_view chunk) { return sink->on_body(chunk); },
+            .on_headers = [sink](long code, string_cref content_type, string_cref raw_headers)
+            {
+                sink->on_headers(code, content_type, raw_headers);
+            }
+        },
+        [sink, done = std::move(done)](optional<HTTP_Response> resp)
+        {
+            sink->finish(resp, done);
+        });
+}
+
+void Download_Sink::save_meta() const
+{
+    std::ofstream ofs(m_meta_path, std::ofstream::trunc);
+
+    if (not ofs.is_open())
+        return;
+
+    if (m_expected_length.has_value())
+        ofs << "length=" << *m_expected_length << "\n";
+
+    ofs << "validator=" << m_validator << "\n";
+    ofs << "extension=" << m_extension << "\n";
+}
+
+void Download_Sink::write(std::string_view data)
+{
+    m_buffer.append(data);
+
+    if (m_buffer.size() >= g_WRITE_BATCH)
+        flush();
+}
+
+void Download_Sink::flush()
+{
+    // hashed by the writer thread, once written
+    m_writer.write(m_file, std::move(m_buffer));
+    m_buffer = {};
+}
+
+void Download_Sink::discard_part() const
+{
+    std::error_code ec;
+    fs::remove(m_part_path, ec);
+    fs::remove(m_meta_path, ec);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "rid.h"
+#include "content_hash.h"
+#include "file_writer.h"
+
+class Content_Store;
+
+// Receives a body from HTTP_Engine and streams it to "<destination>.part".
+// Expected length and ETag (or Last-Modified) are kept next to it in
+// "<destination>.part.meta", so an interrupted download is resumed with a
+// Range request on the next run. The file is renamed into place only
+// once it is complete: a file with the final name is always a good one.
+// With a Content_Store the body is hashed as it streams and the finished
+// file is handed to the store for deduplication.
+// The disk is only touched through a File_Writer: the thread delivering
+// the body (the engine thread) never waits on it.
+class Download_Sink : public std::enable_shared_from_this<Download_Sink>
+{
+public:
+    // destination known upfront
+    static std::shared_ptr<Download_Sink> to_file(string_cref destination,
+                                                  Content_Store* store = nullptr,
+                                                  File_Writer* writer = nullptr);
+
+    // saved as "<destination_stem>.<extension>", the extension comes from
+    // the Content-Type or from the magic bytes of the body
+    static std::shared_ptr<Download_Sink> to_media_file(string_cref destination_stem,
+                                                        Content_Store* store = nullptr,
+                                                        File_Writer* writer = nullptr);
+
+    // "Range" and "If-Range" when there is a previous attempt to resume
+    std::list<string> request_headers() const;
+
+    void on_headers(long code, string_cref content_type, string_cref raw_headers);
+
+    // false aborts the transfer
+    bool on_body(std::string_view chunk);
+
+    // `done` runs on a writer thread, once the .part is closed and renamed
+    // into place (or kept for the next run)
+    void finish(const optional<HTTP_Response>& resp,
+                std::function<void(Download_Result)> done);
+
+private:
+    Download_Sink(string part_path, string destination, bool sniff,
+                  Content_Store* store, File_Writer* writer);
+
+    // picks the destination and opens the .part file, false aborts the transfer
+    bool start(bool append);
+    void save_meta() const;
+    void discard_part() const;
+    void write(std::string_view data);
+    void flush();
+
+    // the rest of finish(), on the writer thread with the .part closed
+    Download_Result complete(const optional<HTTP_Response>& resp, bool written);
+
+    string m_part_path;
+    string m_meta_path;
+    string m_destination; // empty until the media type is known
+    string m_destination_stem;
+    bool m_sniff;
+
+    // previous attempt, from the .meta file
+    uint64_t m_resume_from = 0;
+    string m_validator; // ETag or Last-Modified
+    string m_extension;
+
+    bool m_headers_seen = false;
+    long m_code = -1;
+    string m_content_type;
+    optional<uint64_t> m_expected_length;
+    bool m_already_complete = false;
+
+    string m_head; // first bytes of the body, kept until the type is known
+
+    File_Writer& m_writer;
+    File_Writer::File_Handle m_file; // the .part, once started
+    string m_buffer; // not handed to the writer yet
+
+    Content_Store* m_store;
+    optional<Content_Hasher> m_hasher; // everything written to the .part so far, on the writer thread
+
+    optional<Download_Result> m_verdict; // set when the transfer is aborted on purpose
+};
+
+// the transfer of `url` into `sink`, the result once the file is in place
+std::future<Download_Result> submit_to_sink(HTTP_Engine& engine,
+                                            string_cref url,
+                                            std::shared_ptr<Download_Sink> sink);
+
+// same, `done` is called on a writer thread
+void submit_to_sink(HTTP_Engine& engine,
+                    string_cref url,
+                    std::shared_ptr<Download_Sink> sink,
+                    Download_Done done);
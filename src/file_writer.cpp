@@ -0,0 +1,357 @@
+#include "pch.h"
+
+#include "file_writer.h"
+#include "config.h"
+#include "memory_budget.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+// writes merged into one system call, at most
+constexpr size_t g_MAX_BATCH = 4 * 1024 * 1024;
+
+}
+
+struct File_Writer::File
+{
+    fs::path path;
+    bool append = false;
+    optional<uint64_t> preallocate;
+    std::function<void(std::string_view)> on_written;
+
+    // guarded by File_Writer::m_mutex
+    std::deque<Operation> operations;
+    bool scheduled = false; // in m_ready or being run
+
+    // only touched by the thread running the file
+    std::intptr_t handle = -1;
+    bool failed = false;
+};
+
+namespace
+{
+
+std::intptr_t open_native(const fs::path& path, bool append)
+{
+#ifdef _WIN32
+    HANDLE handle = CreateFileW(path.c_str(),
+                                GENERIC_WRITE,
+                                FILE_SHARE_READ,
+                                nullptr,
+                                append ? OPEN_ALWAYS : CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL,
+                                nullptr);
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return -1;
+
+    if (append)
+    {
+        LARGE_INTEGER zero{};
+        SetFilePointerEx(handle, zero, nullptr, FILE_END);
+    }
+
+    return reinterpret_cast<std::intptr_t>(handle);
+#else
+    int fd = open(path.c_str(),
+                  O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+                  0644);
+    return fd;
+#endif
+}
+
+// reserves the blocks, the size of the file stays what it is
+void preallocate_native(std::intptr_t handle, uint64_t bytes)
+{
+#ifdef _WIN32
+    LARGE_INTEGER size{};
+    if (not GetFileSizeEx(reinterpret_cast<HANDLE>(handle), &size))
+        return;
+
+    FILE_ALLOCATION_INFO info{};
+    info.AllocationSize.QuadPart = size.QuadPart + static_cast<LONGLONG>(bytes);
+
+    SetFileInformationByHandle(reinterpret_cast<HANDLE>(handle),
+                               FileAllocationInfo, &info, sizeof(info));
+#elif defined(__linux__)
+    off_t end = lseek(static_cast<int>(handle), 0, SEEK_END);
+
+    if (end >= 0)
+        fallocate(static_cast<int>(handle), FALLOC_FL_KEEP_SIZE, end, static_cast<off_t>(bytes));
+#else
+    (void)handle;
+    (void)bytes;
+#endif
+}
+
+bool write_native(std::intptr_t handle, std::string_view data)
+{
+    while (not data.empty())
+    {
+#ifdef _WIN32
+        DWORD written = 0;
+        if (not WriteFile(reinterpret_cast<HANDLE>(handle),
+                          data.data(),
+                          static_cast<DWORD>(std::min<size_t>(data.size(), 1u << 30)),
+                          &written,
+                          nullptr) or
+            written == 0)
+            return false;
+#else
+        auto written = ::write(static_cast<int>(handle), data.data(), data.size());
+        if (written <= 0)
+            return false;
+#endif
+
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+
+    return true;
+}
+
+bool close_native(std::intptr_t handle)
+{
+#ifdef _WIN32
+    return CloseHandle(reinterpret_cast<HANDLE>(handle)) != 0;
+#else
+    return ::close(static_cast<int>(handle)) == 0;
+#endif
+}
+
+}
+
+File_Writer::File_Writer(unsigned threads, Memory_Budget* budget) :
+    m_budget(budget)
+{
+    for (unsigned i = 0; i < threads; ++i)
+        m_threads.emplace_back(&File_Writer::worker_loop, this);
+}
+
+File_Writer::~File_Writer()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+
+    // whatever is queued is still written
+    for (auto& thread : m_threads)
+        thread.join();
+}
+
+File_Writer::File_Handle File_Writer::open(const fs::path& path,
+                                           bool append,
+                                           optional<uint64_t> preallocate,
+                                           std::function<void(std::string_view)> on_written)
+{
+    auto file = std::make_shared<File>();
+    file->path = path;
+    file->append = append;
+    file->preallocate = preallocate;
+    file->on_written = std::move(on_written);
+
+    enqueue(file, Operation{ .kind = Operation::Kind::OPEN });
+
+    return file;
+}
+
+void File_Writer::write(const File_Handle& file, string data)
+{
+    if (data.empty())
+        return;
+
+    m_pending_bytes += data.size();
+
+    if (m_budget != nullptr)
+        m_budget->charge(data.size());
+
+    enqueue(file, Operation{ .kind = Operation::Kind::WRITE, .data = std::move(data) });
+}
+
+void File_Writer::call(const File_Handle& file, std::function<void()> task)
+{
+    enqueue(file, Operation{ .kind = Operation::Kind::CALL, .task = std::move(task) });
+}
+
+void File_Writer::close(const File_Handle& file, std::function<void(bool ok)> done)
+{
+    enqueue(file, Operation{ .kind = Operation::Kind::CLOSE, .done = std::move(done) });
+}
+
+void File_Writer::post(std::function<void()> task)
+{
+    enqueue(std::make_shared<File>(), Operation{ .kind = Operation::Kind::CALL, .task = std::move(task) });
+}
+
+uint64_t File_Writer::pending_bytes() const
+{
+    return m_pending_bytes;
+}
+
+unsigned File_Writer::threads() const
+{
+    return static_cast<unsigned>(m_threads.size());
+}
+
+void File_Writer::enqueue(const File_Handle& file, Operation operation)
+{
+    if (m_threads.empty())
+    {
+        std::deque<Operation> operations;
+        operations.push_back(std::move(operation));
+        run(*file, operations);
+        return;
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        file->operations.push_back(std::move(operation));
+
+        if (file->scheduled)
+            return;
+
+        file->scheduled = true;
+        m_ready.push_back(file);
+    }
+
+    m_cv.notify_one();
+}
+
+void File_Writer::run(File& file, std::deque<Operation>& operations)
+{
+    while (not operations.empty())
+    {
+        auto& operation = operations.front();
+
+        switch (operation.kind)
+        {
+        case Operation::Kind::OPEN:
+        {
+            file.handle = open_native(file.path, file.append);
+            file.failed = file.handle == -1;
+
+            if (not file.failed and file.preallocate.value_or(0) > 0)
+                preallocate_native(file.handle, *file.preallocate);
+
+            operations.pop_front();
+            break;
+        }
+        case Operation::Kind::WRITE:
+        {
+            // every write queued back to back goes down in one call
+            size_t count = 1;
+            size_t bytes = operation.data.size();
+
+            while (count < operations.size() and
+                   operations[count].kind == Operation::Kind::WRITE and
+                   bytes + operations[count].data.size() <= g_MAX_BATCH)
+            {
+                bytes += operations[count].data.size();
+                ++count;
+            }
+
+            if (not file.failed)
+            {
+                if (count == 1)
+                {
+                    file.failed = not write_native(file.handle, operation.data);
+                }
+                else
+                {
+                    string batch;
+                    batch.reserve(bytes);
+
+                    for (size_t i = 0; i < count; ++i)
+                        batch += operations[i].data;
+
+                    file.failed = not write_native(file.handle, batch);
+                }
+            }
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (file.on_written and not file.failed)
+                    file.on_written(operations.front().data);
+
+                operations.pop_front();
+            }
+
+            m_pending_bytes -= bytes;
+
+            if (m_budget != nullptr)
+                m_budget->release(bytes);
+            break;
+        }
+        case Operation::Kind::CALL:
+        {
+            auto task = std::move(operation.task);
+            operations.pop_front();
+
+            if (task)
+                task();
+            break;
+        }
+        case Operation::Kind::CLOSE:
+        {
+            bool ok = not file.failed;
+
+            if (file.handle != -1)
+                ok = close_native(file.handle) and ok;
+
+            file.handle = -1;
+            file.on_written = {};
+
+            auto done = std::move(operation.done);
+            operations.pop_front();
+
+            if (done)
+                done(ok);
+            break;
+        }
+        }
+    }
+}
+
+void File_Writer::worker_loop()
+{
+    std::unique_lock lock(m_mutex);
+
+    while (true)
+    {
+        m_cv.wait(lock, [this] { return m_stopping or not m_ready.empty(); });
+
+        if (m_ready.empty())
+            break; // stopping, and nothing left to write
+
+        auto file = std::move(m_ready.front());
+        m_ready.pop_front();
+
+        auto operations = std::move(file->operations);
+        file->operations.clear();
+
+        lock.unlock();
+        run(*file, operations);
+        lock.lock();
+
+        // more arrived meanwhile, back in line behind the other files
+        if (not file->operations.empty())
+            m_ready.push_back(std::move(file));
+        else
+            file->scheduled = false;
+    }
+}
+
+File_Writer& file_writer()
+{
+    static File_Writer writer(config().writer_threads, &memory_budget());
+    return writer;
+}
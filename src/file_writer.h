@@ -0,0 +1,80 @@
+#pragma once
+
+#include "rid.h"
+
+class Memory_Budget;
+
+// Writer stage between the network and the disk: HTTP_Engine hands over
+// the chunks it receives and goes back to the sockets, a few threads of
+// our own do the opening, writing and closing. A slow disk then only
+// grows the queue, transfers keep going.
+// The operations on one file run in the order they were queued, one at a
+// time, on whichever writer thread is free. Consecutive writes to a file
+// are merged into a single system call.
+// With 0 threads every operation runs right away on the calling thread,
+// like a plain ofstream would.
+// Queued bytes are charged to a Memory_Budget until they are written.
+class File_Writer
+{
+public:
+    struct File;
+    using File_Handle = std::shared_ptr<File>;
+
+    explicit File_Writer(unsigned threads, Memory_Budget* budget = nullptr);
+    ~File_Writer();
+
+    File_Writer(const File_Writer&) = delete;
+    File_Writer& operator=(const File_Writer&) = delete;
+
+    // created (or appended to) on a writer thread. With `preallocate` the
+    // space for that many more bytes is reserved upfront, the size of the
+    // file does not change. `on_written` sees every byte once it is written,
+    // on the writer thread, in order
+    File_Handle open(const fs::path& path,
+                     bool append,
+                     optional<uint64_t> preallocate = {},
+                     std::function<void(std::string_view)> on_written = {});
+
+    void write(const File_Handle& file, string data);
+
+    // runs after everything queued before it for the same file
+    void call(const File_Handle& file, std::function<void()> task);
+
+    // `done` runs on a writer thread once the file is closed, false when
+    // opening or any write failed
+    void close(const File_Handle& file, std::function<void(bool ok)> done);
+
+    // any other storage work that should not run on the calling thread
+    void post(std::function<void()> task);
+
+    // bytes queued and not written yet
+    uint64_t pending_bytes() const;
+
+    unsigned threads() const;
+
+private:
+    struct Operation
+    {
+        enum class Kind : uint8_t { OPEN, WRITE, CALL, CLOSE } kind = Kind::CALL;
+        string data;
+        std::function<void()> task;
+        std::function<void(bool)> done;
+    };
+
+    void enqueue(const File_Handle& file, Operation operation);
+    void run(File& file, std::deque<Operation>& operations);
+    void worker_loop();
+
+    vector<std::thread> m_threads;
+    Memory_Budget* m_budget;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<File_Handle> m_ready; // files with operations and no thread on them
+    bool m_stopping = false;
+
+    std::atomic<uint64_t> m_pending_bytes = 0;
+};
+
+// shared by every download of the process, WRITER_THREADS threads
+File_Writer& file_writer();
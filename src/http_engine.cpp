@@ -0,0 +1,262 @@
+#include "pch.h"
+
+#include "http_engine.h"
+#include "http_share.h"
+
+struct HTTP_Engine::Transfer
+{
+    HTTP_Request request;
+    Callback on_done;
+
+    CURL* easy = nullptr;
+    curl_slist* header_list = nullptr;
+    string body;
+    string resp_headers;
+    bool headers_notified = false;
+};
+
+namespace
+{
+
+size_t write_header(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+    auto& headers = *static_cast<string*>(userdata);
+    headers.append(buffer, size * nitems);
+    return size * nitems;
+}
+
+}
+
+size_t HTTP_Engine::write_body(char* buffer, size_t size, size_t nitems, void* userdata)
+{
+    auto& transfer = *static_cast<Transfer*>(userdata);
+
+    if (transfer.request.on_headers and
+        not transfer.headers_notified)
+    {
+        long code = -1;
+        char* content_type = nullptr;
+        curl_easy_getinfo(transfer.easy, CURLINFO_RESPONSE_CODE, &code);
+        curl_easy_getinfo(transfer.easy, CURLINFO_CONTENT_TYPE, &content_type);
+
+        transfer.headers_notified = true;
+        transfer.request.on_headers(code,
+                                    content_type ? content_type : "",
+                                    transfer.resp_headers);
+    }
+
+    if (transfer.request.on_body)
+    {
+        bool keep_going = transfer.request.on_body({ buffer, size * nitems });
+        return keep_going ? size * nitems : 0; // 0 makes curl abort the transfer
+    }
+
+    transfer.body.append(buffer, size * nitems);
+    return size * nitems;
+}
+
+HTTP_Engine::HTTP_Engine(unsigned max_in_flight) :
+    m_max_in_flight(max_in_flight == 0 ? 1 : max_in_flight)
+{
+    m_multi = curl_multi_init();
+
+    if (m_multi == nullptr)
+        throw std::runtime_error("curl_multi_init() failed");
+
+    m_thread = std::thread(&HTTP_Engine::event_loop, this);
+}
+
+HTTP_Engine::~HTTP_Engine()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    curl_multi_wakeup(static_cast<CURLM*>(m_multi));
+
+    if (m_thread.joinable())
+        m_thread.join();
+
+    curl_multi_cleanup(static_cast<CURLM*>(m_multi));
+}
+
+void HTTP_Engine::submit(HTTP_Request request, Callback on_done)
+{
+    auto transfer = std::make_unique<Transfer>();
+    transfer->request = std::move(request);
+    transfer->on_done = std::move(on_done);
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_queued.push_back(std::move(transfer));
+    }
+    curl_multi_wakeup(static_cast<CURLM*>(m_multi));
+}
+
+std::future<optional<HTTP_Response>> HTTP_Engine::submit(HTTP_Request request)
+{
+    auto promise = std::make_shared<std::promise<optional<HTTP_Response>>>();
+    auto future = promise->get_future();
+
+    submit(std::move(request), [promise](optional<HTTP_Response> resp)
+    {
+        promise->set_value(std::move(resp));
+    });
+
+    return future;
+}
+
+size_t HTTP_Engine::in_flight() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_queued.size() + m_running;
+}
+
+void HTTP_Engine::start_transfer(std::unique_ptr<Transfer> transfer)
+{
+    CURL* easy = curl_easy_init();
+
+    if (easy == nullptr)
+    {
+        cout << std::format("[ERROR] curl_easy_init() failed for url {}",
+                            transfer->request.url) << endl;
+        {
+            std::lock_guard lock(m_mutex);
+            --m_running;
+        }
+        transfer->on_done({});
+        return;
+    }
+
+    for (const auto& header : transfer->request.headers)
+        transfer->header_list = curl_slist_append(transfer->header_list, header.c_str());
+
+    curl_easy_setopt(easy, CURLOPT_SHARE, http_share());
+    curl_easy_setopt(easy, CURLOPT_URL, transfer->request.url.c_str());
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, g_USER_AGENT);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_MAXREDIRS, 10L);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->header_list);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, write_header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, &transfer->resp_headers);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer.get());
+    curl_easy_setopt(easy, CURLOPT_NOBODY, transfer->request.headers_only ? 1L : 0L);
+    set_http_timeouts(easy);
+
+    transfer->easy = easy;
+
+    // the multi handle owns the transfer until finish_transfer()
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer.get());
+    curl_multi_add_handle(static_cast<CURLM*>(m_multi), easy);
+    m_active.push_back(transfer.release());
+}
+
+void HTTP_Engine::finish_transfer(void* handle, int result)
+{
+    CURL* easy = static_cast<CURL*>(handle);
+
+    char* raw = nullptr;
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &raw);
+    std::unique_ptr<Transfer> transfer(reinterpret_cast<Transfer*>(raw));
+    std::erase(m_active, transfer.get());
+
+    optional<HTTP_Response> resp;
+
+    if (result == CURLE_OK)
+    {
+        long code = -1;
+        long num_connects = -1;
+        char* content_type = nullptr;
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+        curl_easy_getinfo(easy, CURLINFO_CONTENT_TYPE, &content_type);
+        curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &num_connects);
+
+        record_http_request(num_connects);
+
+        resp = HTTP_Response{
+            .body = std::move(transfer->body),
+            .code = code,
+            .content_type = content_type ? content_type : "",
+            .resp_headers = std::move(transfer->resp_headers),
+            .num_connects = num_connects
+        };
+    }
+    else if (result != CURLE_WRITE_ERROR) // the sink aborted on purpose
+    {
+        cout << std::format("[ERROR] transfer failed with code {}: \"{}\" url: {}",
+                            result, curl_easy_strerror(static_cast<CURLcode>(result)),
+                            transfer->request.url) << endl;
+    }
+
+    curl_multi_remove_handle(static_cast<CURLM*>(m_multi), easy);
+    curl_easy_cleanup(easy);
+    curl_slist_free_all(transfer->header_list);
+
+    {
+        std::lock_guard lock(m_mutex);
+        --m_running;
+    }
+
+    transfer->on_done(std::move(resp));
+}
+
+void HTTP_Engine::event_loop()
+{
+    CURLM* multi = static_cast<CURLM*>(m_multi);
+
+    while (true)
+    {
+        vector<std::unique_ptr<Transfer>> to_start;
+
+        {
+            std::lock_guard lock(m_mutex);
+
+            if (m_stopping)
+                break;
+
+            while (not m_queued.empty() and
+                   m_running < m_max_in_flight)
+            {
+                to_start.push_back(std::move(m_queued.front()));
+                m_queued.pop_front();
+                ++m_running;
+            }
+        }
+
+        for (auto& transfer : to_start)
+            start_transfer(std::move(transfer));
+
+        int still_running = 0;
+        curl_multi_perform(multi, &still_running);
+
+        int msgs_left = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &msgs_left))
+        {
+            if (msg->msg == CURLMSG_DONE)
+                finish_transfer(msg->easy_handle, msg->data.result);
+        }
+
+        curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+
+    // fail whatever is left, nobody must wait forever on a future
+    int msgs_left = 0;
+    while (CURLMsg* msg = curl_multi_info_read(multi, &msgs_left))
+    {
+        if (msg->msg == CURLMSG_DONE)
+            finish_transfer(msg->easy_handle, msg->data.result);
+    }
+
+    while (not m_active.empty())
+        finish_transfer(m_active.back()->easy, CURLE_ABORTED_BY_CALLBACK);
+
+    std::deque<std::unique_ptr<Transfer>> never_started;
+    {
+        std::lock_guard lock(m_mutex);
+        never_started.swap(m_queued);
+    }
+
+    for (auto& transfer : never_started)
+        transfer->on_done({});
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "rid.h"
+
+struct HTTP_Request
+{
+    string url;
+    std::list<string> headers;
+    bool headers_only = false;
+
+    // when set the body is not kept in HTTP_Response::body, every chunk is
+    // handed over as soon as curl receives it, return false to abort
+    std::function<bool(std::string_view chunk)> on_body;
+
+    // called once, right before the first chunk of the body
+    std::function<void(long code,
+                       string_cref content_type,
+                       string_cref raw_headers)> on_headers;
+};
+
+// Event driven transfer engine on top of a libcurl multi handle.
+// One thread drives every transfer, so hundreds of requests can be in
+// flight without one OS thread (and one stack) per request.
+// Results are delivered through a callback, called on the engine thread,
+// or through a future.
+class HTTP_Engine
+{
+public:
+    using Callback = std::function<void(optional<HTTP_Response>)>;
+
+    explicit HTTP_Engine(unsigned max_in_flight = g_max_transfers);
+    ~HTTP_Engine();
+
+    HTTP_Engine(const HTTP_Engine&) = delete;
+    HTTP_Engine& operator=(const HTTP_Engine&) = delete;
+
+    void submit(HTTP_Request request, Callback on_done);
+
+    std::future<optional<HTTP_Response>> submit(HTTP_Request request);
+
+    // transfers queued or running
+    size_t in_flight() const;
+
+private:
+    struct Transfer;
+
+    static size_t write_body(char* buffer, size_t size, size_t nitems, void* userdata);
+    void event_loop();
+    void start_transfer(std::unique_ptr<Transfer> transfer);
+    void finish_transfer(void* easy, int result);
+
+    void* m_multi = nullptr;
+    unsigned m_max_in_flight;
+    unsigned m_running = 0;
+    vector<Transfer*> m_active; // owned by the multi handle, engine thread only
+
+    mutable std::mutex m_mutex;
+    std::deque<std::unique_ptr<Transfer>> m_queued;
+    bool m_stopping = false;
+
+    std::thread m_thread;
+};
@@ -0,0 +1,77 @@
+#include "pch.h"
+
+#include "http_share.h"
+#include "config.h"
+
+namespace
+{
+
+std::mutex g_share_locks[CURL_LOCK_DATA_LAST];
+
+void lock_share(CURL*, curl_lock_data data, curl_lock_access, void*)
+{
+    g_share_locks[data].lock();
+}
+
+void unlock_share(CURL*, curl_lock_data data, void*)
+{
+    g_share_locks[data].unlock();
+}
+
+std::atomic<size_t> g_requests = 0;
+std::atomic<size_t> g_new_connections = 0;
+
+}
+
+CURLSH* http_share()
+{
+    // never cleaned up: handles of other threads may still point to it
+    // until the very end of the process
+    static CURLSH* share = []
+    {
+        CURLSH* s = curl_share_init();
+        curl_share_setopt(s, CURLSHOPT_LOCKFUNC, lock_share);
+        curl_share_setopt(s, CURLSHOPT_UNLOCKFUNC, unlock_share);
+        curl_share_setopt(s, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(s, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        return s;
+    }();
+
+    return share;
+}
+
+void set_http_timeouts(CURL* easy)
+{
+    const auto& settings = config();
+
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, static_cast<long>(settings.connect_timeout.count()));
+
+    // under 1 byte per second for that long, 0 turns the check off
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, settings.stall_timeout.count() > 0 ? 1L : 0L);
+    curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, static_cast<long>(settings.stall_timeout.count()));
+}
+
+double HTTP_Stats::reuse_ratio() const
+{
+    if (requests == 0)
+        return 0.0;
+
+    auto reused = requests > new_connections ? requests - new_connections : 0;
+    return static_cast<double>(reused) / static_cast<double>(requests);
+}
+
+void record_http_request(long num_connects)
+{
+    ++g_requests;
+
+    if (num_connects > 0)
+        g_new_connections += static_cast<size_t>(num_connects);
+}
+
+HTTP_Stats http_stats()
+{
+    return {
+        .requests = g_requests,
+        .new_connections = g_new_connections
+    };
+}
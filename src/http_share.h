@@ -0,0 +1,26 @@
+#pragma once
+
+// DNS cache and TLS sessions live in one CURLSH shared by every curl handle
+// of the process, the blocking ones and the HTTP_Engine ones.
+// Connections themselves are not put in the share (libcurl does not support
+// sharing them between threads), they are kept alive by reusing handles:
+// one curlpp::Easy per thread for the blocking requests and the connection
+// pool of the multi handle for HTTP_Engine.
+CURLSH* http_share();
+
+// CONNECT_TIMEOUT and STALL_TIMEOUT of config() on a handle, before perform
+void set_http_timeouts(CURL* easy);
+
+struct HTTP_Stats
+{
+    size_t requests = 0;
+    size_t new_connections = 0;
+
+    // fraction of requests served on an already open connection
+    double reuse_ratio() const;
+};
+
+// num_connects is CURLINFO_NUM_CONNECTS of the finished transfer
+void record_http_request(long num_connects);
+
+HTTP_Stats http_stats();
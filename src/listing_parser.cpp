@@ -0,0 +1,719 @@
+#include "pch.h"
+
+#include "listing_parser.h"
+
+namespace
+{
+
+// thrown by the scanner, parse_listing() then lets njson::parse() report the error
+struct Malformed_Json {};
+
+// Single pass over the text of a listing:
+// {"data": {"after": ..., "children": [{"data": {<post>}}, ...]}}
+// Only the values that end up in a Post are decoded, everything else is
+// skipped over by matching brackets and string quotes, no allocation.
+class Listing_Scanner
+{
+public:
+    explicit Listing_Scanner(std::string_view json) :
+        m_cur(json.data()),
+        m_end(json.data() + json.size())
+    {}
+
+    optional<Listing> scan()
+    {
+        Listing listing;
+        bool is_listing = false;
+
+        whitespace();
+
+        if (peek() == '{')
+        {
+            object([&](std::string_view key)
+            {
+                if (key == "data" and peek() == '{')
+                    is_listing = listing_data(listing);
+                else
+                    skip_value();
+            });
+        }
+        else
+        {
+            skip_value();
+        }
+
+        whitespace();
+        if (m_cur != m_end)
+            throw Malformed_Json{};
+
+        if (not is_listing)
+            return {};
+
+        return listing;
+    }
+
+private:
+    // true when data.children is an array
+    bool listing_data(Listing& listing)
+    {
+        bool has_children = false;
+
+        object([&](std::string_view key)
+        {
+            if (key == "after")
+            {
+                listing.after = string_value();
+            }
+            else if (key == "children" and peek() == '[')
+            {
+                has_children = true;
+                listing.posts.clear(); // a duplicate key replaces the value, like njson
+
+                array([&]
+                {
+                    auto& post = listing.posts.emplace_back();
+
+                    if (peek() != '{')
+                    {
+                        skip_value();
+                        return;
+                    }
+
+                    object([&](std::string_view child_key)
+                    {
+                        if (child_key == "data" and peek() == '{')
+                            post_data(post);
+                        else
+                            skip_value();
+                    });
+                });
+            }
+            else
+            {
+                skip_value();
+            }
+        });
+
+        return has_children;
+    }
+
+    // same rules as post_from_json()
+    void post_data(Post& post)
+    {
+        post = {};
+        m_gallery.clear();
+
+        object([&](std::string_view key)
+        {
+            if (key == "id") assign(post.id, string_value());
+            else if (key == "title") assign(post.title, string_value());
+            else if (key == "domain") assign(post.domain, string_value());
+            else if (key == "url") assign(post.url, string_value());
+            else if (key == "subreddit") assign(post.subreddit, string_value());
+            else if (key == "ups") post.ups = number_value().value_or(0);
+            else if (key == "is_gallery") post.is_gallery = bool_value().value_or(false);
+            else if (key == "post_hint") assign(post.post_hint, string_value());
+            else if (key == "media_metadata" and peek() == '{') media_metadata();
+            else if (key == "secure_media" and peek() == '{') secure_media(post);
+            else if (key == "preview" and peek() == '{') preview(post);
+            else skip_value();
+        });
+
+        if (post.is_gallery)
+        {
+            // njson keeps object keys sorted, the parts are numbered in media id order
+            std::stable_sort(m_gallery.begin(), m_gallery.end(),
+                             [](const auto& a, const auto& b) { return a.media_id < b.media_id; });
+
+            post.gallery_urls.reserve(m_gallery.size());
+            post.gallery_types.reserve(m_gallery.size());
+
+            for (auto& item : m_gallery)
+            {
+                post.gallery_urls.push_back(std::move(item.url));
+                post.gallery_types.push_back(std::move(item.type));
+            }
+        }
+    }
+
+    void media_metadata()
+    {
+        m_gallery.clear(); // a duplicate key replaces the value, like njson
+
+        object([&](std::string_view media_id)
+        {
+            if (peek() != '{')
+            {
+                skip_value();
+                return;
+            }
+
+            optional<string> url, mp4, gif, type;
+
+            object([&](std::string_view key)
+            {
+                if (key == "m")
+                {
+                    type = string_value();
+                    return;
+                }
+
+                if (key != "s" or peek() != '{')
+                {
+                    skip_value();
+                    return;
+                }
+
+                url.reset();
+                mp4.reset();
+                gif.reset();
+
+                object([&](std::string_view source_key)
+                {
+                    if (source_key == "u")
+                        url = string_value();
+                    else if (source_key == "mp4")
+                        mp4 = string_value();
+                    else if (source_key == "gif")
+                        gif = string_value();
+                    else
+                        skip_value();
+                });
+            });
+
+            Gallery_Item item{ .media_id = string(media_id),
+                               .url = url.value_or(""),
+                               .type = type.value_or("") };
+
+            // animated items have no "u", their mp4 is the smaller one
+            if (item.url == "")
+            {
+                item.url = mp4.value_or("");
+                item.type = item.url != "" ? "video/mp4" : "image/gif";
+            }
+
+            if (item.url == "")
+                item.url = gif.value_or("");
+
+            if (item.url != "")
+                m_gallery.push_back(std::move(item));
+        });
+    }
+
+    void secure_media(Post& post)
+    {
+        post.video_url.clear();
+        post.video_size = 0;
+
+        object([&](std::string_view key)
+        {
+            if (key != "reddit_video" or peek() != '{')
+            {
+                skip_value();
+                return;
+            }
+
+            optional<long> bitrate_kbps, duration;
+
+            object([&](std::string_view video_key)
+            {
+                if (video_key == "fallback_url")
+                    assign(post.video_url, string_value());
+                else if (video_key == "bitrate_kbps")
+                    bitrate_kbps = number_value();
+                else if (video_key == "duration")
+                    duration = number_value();
+                else
+                    skip_value();
+            });
+
+            post.video_size = bitrate_kbps.has_value() and duration.has_value() ?
+                estimated_video_size(*bitrate_kbps, *duration) :
+                0;
+        });
+    }
+
+    // the first image only, like post_from_json()
+    void preview(Post& post)
+    {
+        post.preview_url.clear();
+        post.preview_video_url.clear();
+
+        object([&](std::string_view key)
+        {
+            if (key == "images" and peek() == '[')
+            {
+                post.preview_url.clear();
+                size_t index = 0;
+
+                array([&]
+                {
+                    if (index++ != 0 or peek() != '{')
+                    {
+                        skip_value();
+                        return;
+                    }
+
+                    object([&](std::string_view image_key)
+                    {
+                        if (image_key != "source" or peek() != '{')
+                        {
+                            skip_value();
+                            return;
+                        }
+
+                        object([&](std::string_view source_key)
+                        {
+                            if (source_key == "url")
+                                assign(post.preview_url, string_value());
+                            else
+                                skip_value();
+                        });
+                    });
+                });
+            }
+            else if (key == "reddit_video_preview" and peek() == '{')
+            {
+                post.preview_video_url.clear();
+
+                object([&](std::string_view video_key)
+                {
+                    if (video_key == "fallback_url")
+                        assign(post.preview_video_url, string_value());
+                    else
+                        skip_value();
+                });
+            }
+            else
+            {
+                skip_value();
+            }
+        });
+    }
+
+    static void assign(string& field, optional<string>&& value)
+    {
+        field = value.has_value() ? std::move(*value) : string{};
+    }
+
+    // --- generic json ---
+
+    char peek() const
+    {
+        return m_cur != m_end ? *m_cur : '\0';
+    }
+
+    void expect(char c)
+    {
+        if (peek() != c)
+            throw Malformed_Json{};
+        ++m_cur;
+    }
+
+    void whitespace()
+    {
+        while (m_cur != m_end and
+               (*m_cur == ' ' or *m_cur == '\n' or *m_cur == '\r' or *m_cur == '\t'))
+            ++m_cur;
+    }
+
+    // calls on_member(key) with the cursor on the value, on_member consumes it
+    template <typename On_Member>
+    void object(On_Member on_member)
+    {
+        expect('{');
+        whitespace();
+
+        if (peek() == '}')
+        {
+            ++m_cur;
+            return;
+        }
+
+        while (true)
+        {
+            whitespace();
+            bool escaped = false;
+            std::string_view raw_key = raw_string(escaped);
+            whitespace();
+            expect(':');
+            whitespace();
+
+            if (escaped)
+            {
+                string key = decode(raw_key);
+                on_member(std::string_view(key));
+            }
+            else
+            {
+                on_member(raw_key);
+            }
+
+            whitespace();
+            if (peek() == ',')
+            {
+                ++m_cur;
+                continue;
+            }
+
+            expect('}');
+            return;
+        }
+    }
+
+    // calls on_element() with the cursor on each element, on_element consumes it
+    template <typename On_Element>
+    void array(On_Element on_element)
+    {
+        expect('[');
+        whitespace();
+
+        if (peek() == ']')
+        {
+            ++m_cur;
+            return;
+        }
+
+        while (true)
+        {
+            whitespace();
+            on_element();
+            whitespace();
+
+            if (peek() == ',')
+            {
+                ++m_cur;
+                continue;
+            }
+
+            expect(']');
+            return;
+        }
+    }
+
+    // the text between the quotes, escapes not decoded
+    std::string_view raw_string(bool& escaped)
+    {
+        expect('"');
+        const char* begin = m_cur;
+        escaped = false;
+
+        while (true)
+        {
+            const char* quote = static_cast<const char*>(
+                std::memchr(m_cur, '"', m_end - m_cur));
+
+            if (quote == nullptr)
+                throw Malformed_Json{};
+
+            // a quote preceded by an odd number of backslashes is escaped
+            const char* slash = quote;
+            while (slash != begin and *(slash - 1) == '\\')
+                --slash;
+
+            m_cur = quote + 1;
+
+            if ((quote - slash) % 2 == 0)
+            {
+                size_t len = static_cast<size_t>(quote - begin);
+                escaped = std::memchr(begin, '\\', len) != nullptr;
+                return { begin, len };
+            }
+        }
+    }
+
+    // nothing when the value is not a string, the value is consumed either way
+    optional<string> string_value()
+    {
+        if (peek() != '"')
+        {
+            skip_value();
+            return {};
+        }
+
+        bool escaped = false;
+        std::string_view raw = raw_string(escaped);
+
+        if (escaped)
+            return decode(raw);
+
+        for (char c : raw)
+        {
+            if (static_cast<unsigned char>(c) < 0x20)
+                throw Malformed_Json{};
+        }
+
+        return string(raw);
+    }
+
+    optional<long> number_value()
+    {
+        if (peek() != '-' and not (peek() >= '0' and peek() <= '9'))
+        {
+            skip_value();
+            return {};
+        }
+
+        const char* begin = m_cur;
+        skip_scalar();
+
+        long val = 0;
+        auto [end, ec] = std::from_chars(begin, m_cur, val);
+
+        if (ec == std::errc{} and end == m_cur)
+            return val;
+
+        // 1.5e3 and friends
+        double d = 0;
+        auto [d_end, d_ec] = std::from_chars(begin, m_cur, d);
+
+        if (d_ec != std::errc{} or d_end != m_cur)
+            throw Malformed_Json{};
+
+        return static_cast<long>(d);
+    }
+
+    optional<bool> bool_value()
+    {
+        const char* begin = m_cur;
+        skip_value();
+
+        std::string_view token(begin, m_cur - begin);
+
+        if (token == "true")
+            return true;
+        if (token == "false")
+            return false;
+        return {};
+    }
+
+    // numbers and literals, checked only when they are one of ours
+    void skip_scalar()
+    {
+        const char* begin = m_cur;
+
+        while (m_cur != m_end and
+               *m_cur != ',' and *m_cur != '}' and *m_cur != ']' and
+               *m_cur != ' ' and *m_cur != '\n' and *m_cur != '\r' and *m_cur != '\t')
+            ++m_cur;
+
+        if (m_cur == begin)
+            throw Malformed_Json{};
+    }
+
+    // values we don't use are only checked for balanced brackets and closed strings
+    void skip_value()
+    {
+        char c = peek();
+
+        if (c == '"')
+        {
+            bool escaped = false;
+            raw_string(escaped);
+            return;
+        }
+
+        if (c != '{' and c != '[')
+        {
+            skip_scalar();
+            return;
+        }
+
+        m_brackets.clear();
+
+        while (m_cur != m_end)
+        {
+            switch (*m_cur)
+            {
+            case '"':
+            {
+                bool escaped = false;
+                raw_string(escaped);
+                continue;
+            }
+            case '{': m_brackets.push_back('}'); break;
+            case '[': m_brackets.push_back(']'); break;
+            case '}':
+            case ']':
+                if (m_brackets.empty() or m_brackets.back() != *m_cur)
+                    throw Malformed_Json{};
+
+                m_brackets.pop_back();
+
+                if (m_brackets.empty())
+                {
+                    ++m_cur;
+                    return;
+                }
+                break;
+            default: break;
+            }
+
+            ++m_cur;
+        }
+
+        throw Malformed_Json{};
+    }
+
+    static unsigned hex4(std::string_view raw, size_t pos)
+    {
+        if (pos + 4 > raw.size())
+            throw Malformed_Json{};
+
+        unsigned val = 0;
+        auto [end, ec] = std::from_chars(raw.data() + pos, raw.data() + pos + 4, val, 16);
+
+        if (ec != std::errc{} or end != raw.data() + pos + 4)
+            throw Malformed_Json{};
+
+        return val;
+    }
+
+    static void append_utf8(string& out, unsigned cp)
+    {
+        if (cp < 0x80)
+        {
+            out += static_cast<char>(cp);
+        }
+        else if (cp < 0x800)
+        {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else if (cp < 0x10000)
+        {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        else
+        {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    static string decode(std::string_view raw)
+    {
+        string out;
+        out.reserve(raw.size());
+
+        for (size_t i = 0; i < raw.size(); ++i)
+        {
+            char c = raw[i];
+
+            if (static_cast<unsigned char>(c) < 0x20)
+                throw Malformed_Json{};
+
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+
+            if (++i == raw.size())
+                throw Malformed_Json{};
+
+            switch (raw[i])
+            {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u':
+            {
+                unsigned cp = hex4(raw, i + 1);
+                i += 4;
+
+                if (cp >= 0xD800 and cp <= 0xDBFF)
+                {
+                    // high surrogate, the low one must follow
+                    if (i + 2 >= raw.size() or raw[i + 1] != '\\' or raw[i + 2] != 'u')
+                        throw Malformed_Json{};
+
+                    unsigned low = hex4(raw, i + 3);
+                    if (low < 0xDC00 or low > 0xDFFF)
+                        throw Malformed_Json{};
+
+                    i += 6;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                else if (cp >= 0xDC00 and cp <= 0xDFFF)
+                {
+                    throw Malformed_Json{};
+                }
+
+                append_utf8(out, cp);
+                break;
+            }
+            default:
+                throw Malformed_Json{};
+            }
+        }
+
+        return out;
+    }
+
+    const char* m_cur;
+    const char* m_end;
+
+    string m_brackets; // closing brackets still expected by skip_value()
+    struct Gallery_Item
+    {
+        string media_id;
+        string url;
+        string type;
+    };
+
+    vector<Gallery_Item> m_gallery; // of the post being scanned
+};
+
+}
+
+optional<Listing> parse_listing(std::string_view json)
+{
+    try
+    {
+        return Listing_Scanner(json).scan();
+    }
+    catch (const Malformed_Json&)
+    {
+        // the slow path knows how to describe what is wrong, and throws it
+        return parse_listing_dom(json);
+    }
+}
+
+optional<Listing> parse_listing_dom(std::string_view json)
+{
+    njson root = njson::parse(json.begin(), json.end());
+
+    if (not (root.is_object() and
+             root.contains("data") and
+             root["data"].is_object() and
+             root["data"].contains("children") and
+             root["data"]["children"].is_array()))
+    {
+        return {};
+    }
+
+    const auto& data = root["data"];
+
+    Listing listing;
+
+    if (data.contains("after") and data["after"].is_string())
+        listing.after = data["after"].get<string>();
+
+    vector_cref children = data["children"].get_ref<vector_cref>();
+    listing.posts.reserve(children.size());
+
+    for (const auto& child : children)
+        listing.posts.push_back(post_from_json(child));
+
+    return listing;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "rid.h"
+
+struct Listing
+{
+    optional<string> after; // cursor of the next page, nothing on the last one
+    vector<Post> posts; // same order as data.children
+};
+
+// Scans the json of a listing page once and decodes only the fields of Post,
+// everything else is skipped and the DOM of the page is never built.
+// Returns nothing when the json is not a listing (no data.children),
+// throws njson::parse_error when it is malformed.
+optional<Listing> parse_listing(std::string_view json);
+
+// same result as parse_listing() through njson::parse() + post_from_json(),
+// kept as the reference for tests and benchmarks
+optional<Listing> parse_listing_dom(std::string_view json);
@@ -0,0 +1,132 @@
+#include "pch.h"
+
+#include "listing_prefetcher.h"
+#include "listing_parser.h"
+
+Listing_Prefetcher::Listing_Prefetcher(const string& subreddit,
+                                       const string& when,
+                                       const string& after,
+                                       const string& dest_folder,
+                                       size_t depth) :
+    m_subreddit(subreddit),
+    m_when(when),
+    m_dest_folder(dest_folder),
+    m_depth(depth == 0 ? 1 : depth)
+{
+    m_thread = std::thread(&Listing_Prefetcher::fetch_loop, this, after);
+}
+
+Listing_Prefetcher::~Listing_Prefetcher()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+optional<Listing_Page> Listing_Prefetcher::next()
+{
+    std::unique_lock lock(m_mutex);
+
+    m_cv.wait(lock, [this] { return m_finished or not m_pages.empty(); });
+
+    if (m_pages.empty())
+    {
+        if (m_error)
+            std::rethrow_exception(m_error);
+
+        return {};
+    }
+
+    Listing_Page page = std::move(m_pages.front());
+    m_pages.pop_front();
+
+    lock.unlock();
+    m_cv.notify_all(); // room for one more page
+
+    return page;
+}
+
+void Listing_Prefetcher::fetch_loop(string after)
+{
+    try
+    {
+        while (true)
+        {
+            {
+                std::unique_lock lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_stopping or m_pages.size() < m_depth; });
+
+                if (m_stopping)
+                    break;
+            }
+
+            auto resp = download_json_from_reddit(m_subreddit,
+                                                  m_when,
+                                                  after);
+
+            if (not resp.has_value())
+            {
+                cout << "[WARN] Cannot download json from subreddit /r/" << m_subreddit << endl;
+                break;
+            }
+
+#if 1
+            // save json to disk for debugging purposes 
+            {
+                std::ofstream out(m_dest_folder + "/!#_" + m_subreddit
+                                  + "_" + m_when + "_" + after + ".json",
+                                  std::ofstream::trunc |
+                                  std::ofstream::binary);
+
+                if (out.is_open())
+                {
+                    out << *resp;
+                }
+            }
+#endif 
+
+            // only the fields of Post are extracted, no DOM for the whole page
+            auto listing = parse_listing(*resp);
+
+            if (not listing.has_value())
+            {
+                throw std::runtime_error("Unexpected json content... 😳");
+            }
+
+            Listing_Page page{
+                .after = after,
+                .next_after = std::move(listing->after),
+                .posts = std::move(listing->posts)
+            };
+
+            bool last_page = not page.next_after.has_value();
+            if (not last_page)
+                after = *page.next_after;
+
+            {
+                std::lock_guard lock(m_mutex);
+                m_pages.push_back(std::move(page));
+            }
+            m_cv.notify_all();
+
+            if (last_page)
+                break;
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard lock(m_mutex);
+        m_error = std::current_exception();
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_finished = true;
+    }
+    m_cv.notify_all();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "rid.h"
+
+// only the posts of a page are kept, see parse_listing()
+struct Listing_Page
+{
+    string after; // cursor used to fetch this page, "" for the first one
+    optional<string> next_after; // nothing on the last page
+    vector<Post> posts; // same order as the listing
+};
+
+// Fetches and parses the listing pages of a subreddit on a background
+// thread, up to `depth` pages ahead of the consumer, so the network is not
+// idle at the start of every page while we wait on reddit.
+class Listing_Prefetcher
+{
+public:
+    Listing_Prefetcher(const string& subreddit,
+                       const string& when,
+                       const string& after,
+                       const string& dest_folder,
+                       size_t depth = 2);
+    ~Listing_Prefetcher();
+
+    Listing_Prefetcher(const Listing_Prefetcher&) = delete;
+    Listing_Prefetcher& operator=(const Listing_Prefetcher&) = delete;
+
+    // blocks until the next page is ready, returns nothing once the listing
+    // is over or a page cannot be downloaded, rethrows parse errors
+    optional<Listing_Page> next();
+
+private:
+    void fetch_loop(string after);
+
+    string m_subreddit;
+    string m_when;
+    string m_dest_folder;
+    size_t m_depth;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Listing_Page> m_pages;
+    bool m_finished = false; // no more pages will be pushed
+    bool m_stopping = false;
+    std::exception_ptr m_error;
+
+    std::thread m_thread;
+};
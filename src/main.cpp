@@ -1,7 +1,10 @@
 ﻿#include "pch.h"
 
 #include "test.h"
+#include "bench.h"
+#include "pack_tool.h"
 #include "rid.h"
+#include "config.h"
 
 int main(int argc, char* argv[])
 {
@@ -9,7 +12,8 @@ int main(int argc, char* argv[])
     SetConsoleOutputCP(CP_UTF8);
     std::locale::global(std::locale("en_US.UTF-8")); // set the C/C++ locale
 
-    Test::run_test();
+    const string command = argc > 1 ? argv[1] : "";
+    const bool tool = command == "--test" or command == "--bench" or command == "--pack-ls" or command == "--pack-extract";
 
     argparse::ArgumentParser program("rid", "1.0.0");
     program.add_description("Reddit Image Downloader\nAllows you to download all the top images from a specified subreddit");
@@ -19,14 +23,71 @@ int main(int argc, char* argv[])
         .help("choose between: [hour | day | week | month | year | all]");
     program.add_argument("dest-folder")
         .help("the folder where to put all the downloaded images (the folder will be created if it doesn't exit)");
+    program.add_argument("--pack")
+        .help("append the images to a few big pack files inside dest-folder instead of one file each, see --pack-ls and --pack-extract")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--set")
+        .help("KEY=value, overrides the same key of .env and of the RID_KEY environment variable, e.g. --set WORKERS=16 (see config.h)")
+        .metavar("KEY=value")
+        .default_value(vector<string>{})
+        .append();
+
+    // settings first: everything below, the tests included, reads them
+    std::map<string, string> overrides;
+
+    if (not tool)
+    {
+        try
+        {
+            program.parse_args(argc, argv);
+        }
+        catch (const std::runtime_error& err)
+        {
+            cout << err.what() << endl;
+            cout << program; // print help
+            return 1;
+        }
+
+        for (const auto& setting : program.get<vector<string>>("--set"))
+        {
+            auto pos = setting.find('=');
+
+            if (pos == string::npos)
+            {
+                cout << std::format("[ERROR] --set {} is not KEY=value", setting) << endl;
+                return 1;
+            }
+
+            overrides[setting.substr(0, pos)] = setting.substr(pos + 1);
+        }
+
+        if (program.get<bool>("--pack"))
+            overrides["OUTPUT"] = "pack";
+    }
+
+    set_config(load_config(".env", overrides));
+
+    Test::run_test();
 
-    try
+    if (command == "--test")
     {
-        program.parse_args(argc, argv);
+        Test::run_integration_test();
+        cout << "[INFO] tests done" << endl;
+        return 0;
     }
-    catch (const std::runtime_error& err)
+
+    if (command == "--bench")
+        return Bench::run_bench(argc > 2 ? argv[2] : "");
+
+    if (argc > 2 and command == "--pack-ls")
+        return Pack_Tool::list(argv[2]);
+
+    if (argc > 3 and command == "--pack-extract")
+        return Pack_Tool::extract(argv[2], argv[3], argc > 4 ? argv[4] : "");
+
+    if (tool)
     {
-        cout << err.what() << endl;
         cout << program; // print help
         return 1;
     }
@@ -35,5 +96,5 @@ int main(int argc, char* argv[])
     const string when = program.get<string>("when"); // "day"; 
     const string dest = program.get<string>("dest-folder"); // "🌟vaporwave-aesthetics🌟";
 
-    return rid(subreddit, when, dest);
+    return rid(subreddit, when, dest, config().output);
 }
@@ -0,0 +1,57 @@
+#include "pch.h"
+
+#include "media_storage.h"
+#include "utils.h"
+#include "memory_budget.h"
+
+std::future<Download_Result> Media_Storage::download(HTTP_Engine& engine,
+                                                     string_cref url,
+                                                     const Media_Item& item)
+{
+    auto promise = std::make_shared<std::promise<Download_Result>>();
+    auto future = promise->get_future();
+
+    download(engine, url, item, [promise](Download_Result result) { promise->set_value(result); });
+
+    return future;
+}
+
+File_Storage::File_Storage(const string& dest_folder,
+                           Content_Store* store,
+                           Memory_Budget* budget) :
+    m_dest_folder(dest_folder),
+    m_store(store),
+    m_budget(budget)
+{
+}
+
+string File_Storage::stem(const Media_Item& item) const
+{
+    return std::format("{}\\{}", m_dest_folder, item.name);
+}
+
+void File_Storage::download(HTTP_Engine& engine,
+                            string_cref url,
+                            const Media_Item& item,
+                            Download_Done done)
+{
+    if (m_budget != nullptr)
+        m_budget->wait_for_room();
+
+    download_media_to_disk(engine, url, stem(item), m_store, std::move(done));
+}
+
+bool File_Storage::contains(const Media_Item& item)
+{
+    return Utils::find_media_file(stem(item)).has_value();
+}
+
+optional<fs::path> File_Storage::file(const Media_Item& item)
+{
+    auto file = Utils::find_media_file(stem(item));
+
+    if (not file.has_value())
+        return {};
+
+    return fs::path(*file);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "rid.h"
+
+class Memory_Budget;
+
+// one file of a post: the whole post, or a part of a gallery
+struct Media_Item
+{
+    string post_id;
+    size_t part = 0; // 1 based for the parts of a gallery, 0 otherwise
+    string name; // file name without extension, e.g. "Title_p0002"
+    uint64_t expected_size = 0; // bytes, from the listing, 0 when not known
+};
+
+// Where download_media() puts what it downloads.
+class Media_Storage
+{
+public:
+    virtual ~Media_Storage() = default;
+
+    // SKIPPED when the item is stored already, without any request.
+    // `done` is called on the engine or a writer thread, or before
+    // download() returns when nothing is downloaded
+    virtual void download(HTTP_Engine& engine,
+                          string_cref url,
+                          const Media_Item& item,
+                          Download_Done done) = 0;
+
+    // same, waited for through a future
+    std::future<Download_Result> download(HTTP_Engine& engine,
+                                          string_cref url,
+                                          const Media_Item& item);
+
+    virtual bool contains(const Media_Item& item) = 0;
+
+    // the item as a file of its own, for the stages that read it back
+    // (near duplicates), nothing when it is not stored as one
+    virtual optional<fs::path> file(const Media_Item& item) = 0;
+};
+
+// One file per item in the destination folder, "<folder>\<name>.<extension>",
+// through download_media_to_disk(). Bodies are streamed, what they hold in
+// memory is the File_Writer queue: with a budget no download starts while
+// that queue has spent it.
+class File_Storage : public Media_Storage
+{
+public:
+    File_Storage(const string& dest_folder,
+                 Content_Store* store = nullptr,
+                 Memory_Budget* budget = nullptr);
+
+    using Media_Storage::download;
+
+    void download(HTTP_Engine& engine,
+                  string_cref url,
+                  const Media_Item& item,
+                  Download_Done done) override;
+
+    bool contains(const Media_Item& item) override;
+
+    optional<fs::path> file(const Media_Item& item) override;
+
+private:
+    string stem(const Media_Item& item) const;
+
+    string m_dest_folder;
+    Content_Store* m_store;
+    Memory_Budget* m_budget;
+};
@@ -0,0 +1,146 @@
+#include "pch.h"
+
+#include "memory_budget.h"
+#include "config.h"
+
+Memory_Budget::Lease::Lease(Memory_Budget* budget, uint64_t bytes) :
+    m_budget(budget),
+    m_bytes(bytes)
+{
+}
+
+Memory_Budget::Lease::~Lease()
+{
+    release();
+}
+
+Memory_Budget::Lease::Lease(Lease&& other) noexcept :
+    m_budget(std::exchange(other.m_budget, nullptr)),
+    m_bytes(std::exchange(other.m_bytes, 0))
+{
+}
+
+Memory_Budget::Lease& Memory_Budget::Lease::operator=(Lease&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        m_budget = std::exchange(other.m_budget, nullptr);
+        m_bytes = std::exchange(other.m_bytes, 0);
+    }
+
+    return *this;
+}
+
+uint64_t Memory_Budget::Lease::bytes() const
+{
+    return m_bytes;
+}
+
+bool Memory_Budget::Lease::try_grow(uint64_t bytes)
+{
+    if (m_budget == nullptr)
+        return false;
+
+    {
+        std::lock_guard lock(m_budget->m_mutex);
+
+        if (not m_budget->fits(bytes))
+            return false;
+
+        m_budget->m_in_use += bytes;
+        m_budget->m_peak = std::max(m_budget->m_peak, m_budget->m_in_use);
+    }
+
+    m_bytes += bytes;
+    return true;
+}
+
+void Memory_Budget::Lease::release()
+{
+    if (m_budget != nullptr and m_bytes > 0)
+        m_budget->release(m_bytes);
+
+    m_bytes = 0;
+}
+
+Memory_Budget::Memory_Budget(uint64_t limit) :
+    m_limit(limit)
+{
+}
+
+Memory_Budget::Lease Memory_Budget::acquire(uint64_t bytes)
+{
+    std::unique_lock lock(m_mutex);
+
+    if (not fits(bytes) and m_in_use > 0)
+    {
+        ++m_waits;
+        m_cv.wait(lock, [&] { return fits(bytes) or m_in_use == 0; });
+    }
+
+    m_in_use += bytes;
+    m_peak = std::max(m_peak, m_in_use);
+
+    return Lease(this, bytes);
+}
+
+void Memory_Budget::wait_for_room()
+{
+    acquire(0);
+}
+
+void Memory_Budget::charge(uint64_t bytes)
+{
+    std::lock_guard lock(m_mutex);
+
+    m_in_use += bytes;
+    m_peak = std::max(m_peak, m_in_use);
+}
+
+void Memory_Budget::release(uint64_t bytes)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_in_use -= std::min(bytes, m_in_use);
+    }
+
+    // any waiter may fit now, they are few and wake rarely
+    m_cv.notify_all();
+}
+
+bool Memory_Budget::has_room(uint64_t bytes) const
+{
+    std::lock_guard lock(m_mutex);
+    return fits(bytes);
+}
+
+void Memory_Budget::record_spill()
+{
+    std::lock_guard lock(m_mutex);
+    ++m_spills;
+}
+
+Memory_Stats Memory_Budget::stats() const
+{
+    std::lock_guard lock(m_mutex);
+
+    return {
+        .limit = m_limit,
+        .in_use = m_in_use,
+        .peak = m_peak,
+        .waits = m_waits,
+        .spills = m_spills
+    };
+}
+
+bool Memory_Budget::fits(uint64_t bytes) const
+{
+    return m_limit == 0 or (m_in_use <= m_limit and bytes <= m_limit - m_in_use);
+}
+
+Memory_Budget& memory_budget()
+{
+    static Memory_Budget budget(config().memory_budget);
+    return budget;
+}
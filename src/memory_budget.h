@@ -0,0 +1,90 @@
+#pragma once
+
+#include "rid.h"
+
+struct Memory_Stats
+{
+    uint64_t limit = 0; // 0 when there is none
+    uint64_t in_use = 0;
+    uint64_t peak = 0;
+    size_t waits = 0; // acquire() calls that had to wait
+    size_t spills = 0; // bodies that went to disk instead of memory
+};
+
+// Bytes of response bodies held in memory at once, across every transfer:
+// the chunks queued in File_Writer and the bodies Pack_Storage keeps whole.
+// Nobody is ever failed for it. The engine and writer threads only count,
+// charge() may go over the limit. The workers wait in acquire() before
+// starting a transfer while the budget is spent, and a body that would go
+// over it is streamed to disk instead.
+class Memory_Budget
+{
+public:
+    // Bytes taken from the budget, given back when the lease goes away
+    class Lease
+    {
+    public:
+        Lease() = default;
+        ~Lease();
+
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&& other) noexcept;
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        uint64_t bytes() const;
+
+        // never blocks: false, and nothing taken, when `bytes` more do not fit
+        bool try_grow(uint64_t bytes);
+
+        void release();
+
+    private:
+        friend class Memory_Budget;
+
+        Lease(Memory_Budget* budget, uint64_t bytes);
+
+        Memory_Budget* m_budget = nullptr;
+        uint64_t m_bytes = 0;
+    };
+
+    // 0 counts without ever making anybody wait
+    explicit Memory_Budget(uint64_t limit);
+
+    Memory_Budget(const Memory_Budget&) = delete;
+    Memory_Budget& operator=(const Memory_Budget&) = delete;
+
+    // blocks until `bytes` more fit. More than the whole budget only waits
+    // for the budget to be empty, so it can still run, alone
+    Lease acquire(uint64_t bytes);
+
+    // acquire(0): nothing taken, blocks while the budget is spent
+    void wait_for_room();
+
+    // never blocks, for the threads that cannot wait
+    void charge(uint64_t bytes);
+    void release(uint64_t bytes);
+
+    bool has_room(uint64_t bytes) const;
+
+    void record_spill();
+
+    Memory_Stats stats() const;
+
+private:
+    // m_mutex must be held
+    bool fits(uint64_t bytes) const;
+
+    const uint64_t m_limit;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    uint64_t m_in_use = 0;
+    uint64_t m_peak = 0;
+    size_t m_waits = 0;
+    size_t m_spills = 0;
+};
+
+// shared by every transfer of the process, MEMORY_BUDGET of config()
+Memory_Budget& memory_budget();
@@ -0,0 +1,230 @@
+#include "pch.h"
+
+#include "rid.h"
+#include "utils.h"
+#include "mock_server.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+using socket_t = SOCKET;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using socket_t = int;
+#define INVALID_SOCKET (-1)
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+#endif
+
+namespace
+{
+
+socket_t to_socket(std::intptr_t s)
+{
+    return static_cast<socket_t>(s);
+}
+
+bool send_all(socket_t s, string_cref data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        auto n = send(s, data.data() + sent,
+                      static_cast<int>(data.size() - sent), 0);
+        if (n <= 0)
+            return false;
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+string reason_phrase(long code)
+{
+    switch (code)
+    {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 404: return "Not Found";
+    case 416: return "Range Not Satisfiable";
+    case 429: return "Too Many Requests";
+    default: return "Whatever";
+    }
+}
+
+}
+
+Mock_Server::Mock_Server(Handler handler) :
+    m_handler(std::move(handler))
+{
+#ifdef _WIN32
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+
+    socket_t s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET)
+    {
+        cout << "[ERROR] Mock_Server cannot create socket" << endl;
+        return;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; // let the OS choose
+
+    socklen_t addr_len = sizeof(addr);
+
+    if (bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 or
+        listen(s, SOMAXCONN) != 0 or
+        getsockname(s, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0)
+    {
+        cout << "[ERROR] Mock_Server cannot listen on 127.0.0.1" << endl;
+        closesocket(s);
+        return;
+    }
+
+    m_listen_socket = static_cast<std::intptr_t>(s);
+    m_port = ntohs(addr.sin_port);
+    m_accept_thread = std::thread(&Mock_Server::accept_loop, this);
+}
+
+Mock_Server::~Mock_Server()
+{
+    m_stopping = true;
+
+    if (m_listen_socket != -1)
+    {
+        shutdown(to_socket(m_listen_socket), SD_BOTH);
+        closesocket(to_socket(m_listen_socket));
+    }
+
+    if (m_accept_thread.joinable())
+        m_accept_thread.join();
+
+    {
+        std::lock_guard lock(m_clients_mutex);
+        for (auto client : m_clients)
+            shutdown(to_socket(client), SD_BOTH);
+    }
+
+    for (auto& t : m_client_threads)
+    {
+        if (t.joinable())
+            t.join();
+    }
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+bool Mock_Server::is_running() const
+{
+    return m_listen_socket != -1;
+}
+
+unsigned short Mock_Server::port() const
+{
+    return m_port;
+}
+
+string Mock_Server::url(string_cref path) const
+{
+    return std::format("http://127.0.0.1:{}{}", m_port, path);
+}
+
+size_t Mock_Server::requests_served() const
+{
+    return m_requests;
+}
+
+size_t Mock_Server::connections_accepted() const
+{
+    return m_connections;
+}
+
+void Mock_Server::accept_loop()
+{
+    while (not m_stopping)
+    {
+        socket_t client = accept(to_socket(m_listen_socket), nullptr, nullptr);
+
+        if (client == INVALID_SOCKET)
+            break;
+
+        ++m_connections;
+
+        std::lock_guard lock(m_clients_mutex);
+        m_clients.push_back(static_cast<std::intptr_t>(client));
+        m_client_threads.emplace_back(&Mock_Server::connection_loop, this,
+                                      static_cast<std::intptr_t>(client));
+    }
+}
+
+void Mock_Server::connection_loop(std::intptr_t client_handle)
+{
+    socket_t client = to_socket(client_handle);
+
+    string buffer;
+    char chunk[4096];
+
+    while (not m_stopping)
+    {
+        auto header_end = buffer.find("\r\n\r\n");
+
+        if (header_end == string::npos)
+        {
+            auto n = recv(client, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                break;
+            buffer.append(chunk, static_cast<size_t>(n));
+            continue;
+        }
+
+        string head = buffer.substr(0, header_end);
+        buffer.erase(0, header_end + 4);
+
+        auto lines = Utils::split_string(head, "\r\n");
+        auto request_line = Utils::split_string(lines[0], " ");
+
+        if (request_line.size() < 2)
+            break;
+
+        Mock_Request req{
+            .method = request_line[0],
+            .path = request_line[1],
+            .headers = {lines.begin() + 1, lines.end()}
+        };
+
+        ++m_requests;
+
+        Mock_Response resp = m_handler(req);
+
+        std::stringstream ss;
+        ss << "HTTP/1.1 " << resp.code << " " << reason_phrase(resp.code) << "\r\n";
+        ss << "Content-Type: " << resp.content_type << "\r\n";
+        ss << "Content-Length: " << resp.body.size() << "\r\n";
+        for (const auto& header : resp.headers)
+            ss << header << "\r\n";
+        ss << "\r\n";
+
+        if (req.method != "HEAD")
+            ss << resp.body;
+
+        if (not send_all(client, ss.str()))
+            break;
+    }
+
+    {
+        std::lock_guard lock(m_clients_mutex);
+        std::erase(m_clients, client_handle);
+    }
+
+    closesocket(client);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+// Tiny HTTP/1.1 server bound to 127.0.0.1, used by the benchmarks to stand
+// in for reddit and the media hosts. Every connection gets its own thread
+// and keep-alive is supported, so it behaves like a real CDN from the point
+// of view of curl. Only GET and HEAD requests without a body are understood.
+
+struct Mock_Request
+{
+    string method;
+    string path;
+    std::list<string> headers;
+};
+
+struct Mock_Response
+{
+    long code = 200;
+    string content_type = "text/plain";
+    std::list<string> headers; // extra headers, e.g. "ETag: \"abc\""
+    string body;
+};
+
+class Mock_Server
+{
+public:
+    using Handler = std::function<Mock_Response(const Mock_Request&)>;
+
+    explicit Mock_Server(Handler handler);
+    ~Mock_Server();
+
+    Mock_Server(const Mock_Server&) = delete;
+    Mock_Server& operator=(const Mock_Server&) = delete;
+
+    bool is_running() const;
+
+    unsigned short port() const;
+
+    // "http://127.0.0.1:<port><path>"
+    string url(string_cref path) const;
+
+    size_t requests_served() const;
+    size_t connections_accepted() const;
+
+private:
+    void accept_loop();
+    void connection_loop(std::intptr_t client);
+
+    Handler m_handler;
+    std::intptr_t m_listen_socket = -1;
+    unsigned short m_port = 0;
+
+    std::thread m_accept_thread;
+    std::mutex m_clients_mutex;
+    vector<std::intptr_t> m_clients;
+    vector<std::thread> m_client_threads;
+
+    std::atomic<bool> m_stopping = false;
+    std::atomic<size_t> m_requests = 0;
+    std::atomic<size_t> m_connections = 0;
+};
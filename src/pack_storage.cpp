@@ -0,0 +1,703 @@
+#include "pch.h"
+
+#include "pack_storage.h"
+#include "http_engine.h"
+#include "file_writer.h"
+#include "utils.h"
+#include "memory_budget.h"
+
+namespace
+{
+
+constexpr uint32_t g_RECORD_MAGIC = 0x52444952; // "RIDR"
+
+// the longest magic we look for is 12 bytes (RIFF....WEBP)
+constexpr size_t g_SNIFF_LEN = 16;
+
+// spooled bodies are read back this much at a time
+constexpr size_t g_COPY_CHUNK = 1024 * 1024;
+
+// body bytes taken from the memory budget at a time, not one lock per chunk
+constexpr uint64_t g_LEASE_STEP = 1024 * 1024;
+
+// a whole body, kept in memory until the transfer is over. A body that does
+// not fit the memory budget goes to "<folder>/<post id>_<part>.spool"
+// instead, through the File_Writer, and is packed from there
+struct Pack_Transfer
+{
+    long code = -1;
+    string content_type;
+    string head; // first bytes of the body, for the sniffing
+    string body;
+    optional<Media_Type> media;
+    bool rejected = false;
+
+    Memory_Budget::Lease lease; // covers body
+    Memory_Budget* budget = nullptr;
+    fs::path spool_path;
+    File_Writer::File_Handle spool; // once spilled
+
+    optional<Media_Type> detect_media() const
+    {
+        auto type = Utils::media_type_from_content_type(content_type);
+
+        // CDNs love to send "application/octet-stream"
+        if (not type.has_value())
+            type = Utils::sniff_media_type(head);
+
+        return type;
+    }
+
+    void on_headers(long response_code, string_cref type, string_cref raw_headers)
+    {
+        code = response_code;
+        content_type = type;
+
+        // without a budget nothing is counted, nothing is spilled
+        if (code != 200 or budget == nullptr)
+            return;
+
+        // the whole body is taken upfront when its length is known
+        auto headers = Utils::parse_http_headers(raw_headers);
+        auto it = headers.find("content-length");
+
+        if (it == headers.end())
+            return;
+
+        uint64_t length = 0;
+        auto [end, error] = std::from_chars(it->second.data(), it->second.data() + it->second.size(), length);
+
+        if (error != std::errc{} or length <= lease.bytes())
+            return;
+
+        if (not lease.try_grow(length - lease.bytes()))
+            spill();
+    }
+
+    bool on_body(std::string_view chunk)
+    {
+        // error page, don't care about the body
+        if (code != 200)
+            return false;
+
+        if (not media.has_value())
+        {
+            head.append(chunk.substr(0, g_SNIFF_LEN - std::min(head.size(), g_SNIFF_LEN)));
+
+            if (head.size() >= g_SNIFF_LEN)
+            {
+                media = detect_media();
+                rejected = not media.has_value();
+            }
+        }
+
+        if (rejected)
+            return false;
+
+        if (budget != nullptr and spool == nullptr and body.size() + chunk.size() > lease.bytes())
+        {
+            uint64_t missing = body.size() + chunk.size() - lease.bytes();
+
+            if (not lease.try_grow(std::max(missing, g_LEASE_STEP)) and
+                not lease.try_grow(missing))
+                spill();
+        }
+
+        if (spool != nullptr)
+            file_writer().write(spool, string(chunk));
+        else
+            body.append(chunk);
+
+        return true;
+    }
+
+    // what is in memory so far to the spool, the rest follows it there
+    void spill()
+    {
+        spool = file_writer().open(spool_path, false);
+        file_writer().write(spool, std::move(body));
+        body = {};
+        lease.release();
+
+        if (budget != nullptr)
+            budget->record_spill();
+    }
+
+    Download_Result finish(Pack_Storage& storage,
+                           const Media_Item& item,
+                           const optional<HTTP_Response>& resp,
+                           bool spool_written)
+    {
+        if (rejected)
+            return Download_Result::UNABLE;
+
+        if (not resp.has_value())
+            return Download_Result::FAILED;
+
+        if (code == -1)
+        {
+            code = resp->code;
+            content_type = resp->content_type;
+        }
+
+        if (code != 200)
+            return Download_Result::FAILED;
+
+        if (not media.has_value())
+            media = detect_media();
+
+        if (not media.has_value())
+            return Download_Result::UNABLE;
+
+        bool packed = spool != nullptr ?
+            spool_written and storage.append_file(item, media->extension, spool_path) :
+            storage.append(item, media->extension, body);
+
+        return packed ? Download_Result::DOWNLOADED : Download_Result::FAILED;
+    }
+
+    // memory and spool given back, whatever the result
+    void discard()
+    {
+        body = {};
+        lease.release();
+
+        if (spool != nullptr)
+        {
+            std::error_code ec;
+            fs::remove(spool_path, ec);
+        }
+    }
+};
+
+// one item per line, fields separated by tabs
+string clean_field(string field)
+{
+    std::replace_if(field.begin(), field.end(),
+                    [](char c) { return c == '\t' or c == '\r' or c == '\n'; }, ' ');
+    return field;
+}
+
+template<typename T>
+optional<T> parse_number(std::string_view str)
+{
+    T value{};
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+
+    if (ec != std::errc{} or ptr != str.data() + str.size())
+        return {};
+
+    return value;
+}
+
+}
+
+Pack_Storage::Pack_Storage(const fs::path& folder,
+                           Hash_Mode mode,
+                           uint64_t segment_size,
+                           bool read_only,
+                           Memory_Budget* budget) :
+    m_folder(folder),
+    m_mode(mode),
+    m_segment_size(segment_size),
+    m_read_only(read_only),
+    m_budget(budget)
+{
+    std::error_code ec;
+
+    if (not m_read_only)
+        fs::create_directories(m_folder, ec);
+
+    if (not fs::is_directory(m_folder, ec))
+    {
+        if (not m_read_only)
+            cout << std::format("[WARN] Cannot create pack folder <{}>", m_folder.string()) << endl;
+        return;
+    }
+
+    load_index();
+
+    if (not m_read_only)
+    {
+        // bodies of a run that stopped before they were packed
+        for (const auto& entry : fs::directory_iterator(m_folder, ec))
+        {
+            if (entry.path().extension() == ".spool")
+                fs::remove(entry.path(), ec);
+        }
+
+        m_index_out.open(m_folder / "index.txt", std::ofstream::binary | std::ofstream::app);
+
+        if (not m_index_out.is_open())
+        {
+            cout << std::format("[WARN] Cannot open <{}>", (m_folder / "index.txt").string()) << endl;
+            return;
+        }
+    }
+
+    recover_last_segment();
+
+    if (not m_read_only and not open_segment(m_segment))
+    {
+        cout << std::format("[WARN] Cannot open <{}>", segment_path(m_segment).string()) << endl;
+        return;
+    }
+
+    m_open = true;
+}
+
+bool Pack_Storage::is_open() const
+{
+    return m_open;
+}
+
+string Pack_Storage::key(string_cref post_id, size_t part)
+{
+    return std::format("{}/{}", post_id, part);
+}
+
+fs::path Pack_Storage::segment_path(uint32_t segment) const
+{
+    return m_folder / std::format("segment_{:05}.rpk", segment);
+}
+
+void Pack_Storage::load_index()
+{
+    std::ifstream ifs(m_folder / "index.txt", std::ifstream::binary);
+
+    if (not ifs.is_open())
+        return;
+
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    string data = ss.str();
+    ifs.close();
+
+    // a line cut by a crash is dropped, its record is found again by
+    // recover_last_segment()
+    size_t end = data.rfind('\n');
+    end = end == string::npos ? 0 : end + 1;
+
+    if (end != data.size() and not m_read_only)
+    {
+        std::error_code ec;
+        fs::resize_file(m_folder / "index.txt", end, ec);
+    }
+
+    std::string_view rest(data.data(), end);
+
+    while (not rest.empty())
+    {
+        auto line = rest.substr(0, rest.find('\n'));
+        rest.remove_prefix(line.size() + 1);
+
+        // post id, part, name, extension, segment, offset, length, digest
+        std::string_view fields[8];
+        size_t count = 0;
+
+        while (count < 8)
+        {
+            auto tab = line.find('\t');
+            fields[count++] = line.substr(0, tab);
+
+            if (tab == std::string_view::npos)
+                break;
+
+            line.remove_prefix(tab + 1);
+        }
+
+        if (count != 8)
+            continue;
+
+        auto part = parse_number<size_t>(fields[1]);
+        auto segment = parse_number<uint32_t>(fields[4]);
+        auto offset = parse_number<uint64_t>(fields[5]);
+        auto length = parse_number<uint64_t>(fields[6]);
+
+        if (not part or not segment or not offset or not length)
+            continue;
+
+        add_entry(Pack_Entry{
+            .post_id = string(fields[0]),
+            .part = *part,
+            .name = string(fields[2]),
+            .extension = string(fields[3]),
+            .segment = *segment,
+            .offset = *offset,
+            .length = *length,
+            .digest = string(fields[7])
+        });
+
+        if (*segment > m_segment or
+            (*segment == m_segment and *offset + *length > m_segment_end))
+        {
+            m_segment = *segment;
+            m_segment_end = *offset + *length;
+        }
+    }
+}
+
+void Pack_Storage::recover_last_segment()
+{
+    // records written after the last line of the index: the process died
+    // between the two writes, or the index line was cut
+    for (uint32_t segment = m_segment; ; ++segment)
+    {
+        auto path = segment_path(segment);
+
+        std::error_code ec;
+        auto size = fs::file_size(path, ec);
+
+        if (ec)
+            break;
+
+        std::ifstream ifs(path, std::ifstream::binary);
+        uint64_t pos = segment == m_segment ? m_segment_end : 0;
+
+        while (pos < size)
+        {
+            Record_Header header;
+            ifs.seekg(static_cast<std::streamoff>(pos));
+            ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+            uint64_t strings_len = uint64_t(header.post_id_len) + header.name_len + header.extension_len;
+
+            if (not ifs or
+                header.magic != g_RECORD_MAGIC or
+                header.extension_len > 16 or
+                pos + sizeof(header) + strings_len + header.body_len > size)
+                break;
+
+            string strings(static_cast<size_t>(strings_len), '\0');
+            ifs.read(strings.data(), static_cast<std::streamsize>(strings.size()));
+
+            Pack_Entry entry{
+                .post_id = strings.substr(0, header.post_id_len),
+                .part = header.part,
+                .name = strings.substr(header.post_id_len, header.name_len),
+                .extension = strings.substr(header.post_id_len + header.name_len),
+                .segment = segment,
+                .offset = pos + sizeof(header) + strings_len,
+                .length = header.body_len
+            };
+
+            Content_Hasher hasher(m_mode);
+            vector<char> buffer(256 * 1024);
+
+            for (uint64_t left = header.body_len; left > 0 and ifs; )
+            {
+                auto chunk = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+                ifs.read(buffer.data(), static_cast<std::streamsize>(chunk));
+                hasher.update({ buffer.data(), chunk });
+                left -= chunk;
+            }
+
+            if (not ifs)
+                break;
+
+            entry.digest = hasher.digest();
+
+            if (not m_by_key.contains(key(entry.post_id, entry.part)))
+            {
+                if (not m_read_only)
+                    write_index_line(entry);
+
+                add_entry(std::move(entry));
+            }
+
+            pos += sizeof(header) + strings_len + header.body_len;
+        }
+
+        ifs.close();
+
+        // a record cut in half, the next one must start where it started
+        if (pos < size and not m_read_only)
+            fs::resize_file(path, pos, ec);
+
+        m_segment = segment;
+        m_segment_end = pos;
+    }
+}
+
+bool Pack_Storage::open_segment(uint32_t segment)
+{
+    m_segment_out.close();
+    m_segment_out.clear();
+    m_segment_out.open(segment_path(segment), std::ofstream::binary | std::ofstream::app);
+
+    std::error_code ec;
+    auto size = fs::file_size(segment_path(segment), ec);
+
+    m_segment = segment;
+    m_segment_end = ec ? 0 : size;
+
+    return m_segment_out.is_open();
+}
+
+void Pack_Storage::add_entry(Pack_Entry entry)
+{
+    size_t position = m_entries.size();
+
+    m_by_key[key(entry.post_id, entry.part)] = position;
+
+    if (entry.digest != "")
+        m_by_digest.emplace(entry.digest, position);
+
+    m_entries.push_back(std::move(entry));
+}
+
+void Pack_Storage::write_index_line(const Pack_Entry& entry)
+{
+    m_index_out << std::format("{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}\n",
+                               clean_field(entry.post_id),
+                               entry.part,
+                               clean_field(entry.name),
+                               clean_field(entry.extension),
+                               entry.segment,
+                               entry.offset,
+                               entry.length,
+                               entry.digest);
+    m_index_out.flush();
+}
+
+void Pack_Storage::download(HTTP_Engine& engine,
+                            string_cref url,
+                            const Media_Item& item,
+                            Download_Done done)
+{
+    if (contains(item))
+    {
+        done(Download_Result::SKIPPED);
+        return;
+    }
+
+    auto transfer = std::make_shared<Pack_Transfer>();
+    transfer->budget = m_budget;
+    transfer->spool_path = m_folder / std::format("{}_{}.spool", item.post_id, item.part);
+
+    // on the worker: no new body while the budget is spent, the size the
+    // listing gave is taken upfront
+    if (m_budget != nullptr)
+        transfer->lease = m_budget->acquire(item.expected_size);
+
+    engine.submit(
+        HTTP_Request{
+            .url = url,
+            .on_body = [transfer](std::string_view chunk) { return transfer->on_body(chunk); },
+            .on_headers = [transfer](long code, string_cref content_type, string_cref raw_headers)
+            {
+                transfer->on_headers(code, content_type, raw_headers);
+            }
+        },
+        [this, done = std::move(done), transfer, item](optional<HTTP_Response> resp)
+        {
+            auto finish = [this, done, transfer, item, resp = std::move(resp)](bool spool_written)
+            {
+                auto result = transfer->finish(*this, item, resp, spool_written);
+                transfer->discard();
+                done(result);
+            };
+
+            // hashing and appending off the engine thread, once the spool is on disk
+            if (transfer->spool != nullptr)
+                file_writer().close(transfer->spool, std::move(finish));
+            else
+                file_writer().post([finish = std::move(finish)] { finish(true); });
+        });
+}
+
+bool Pack_Storage::contains(const Media_Item& item)
+{
+    std::lock_guard lock(m_mutex);
+    return m_by_key.contains(key(item.post_id, item.part));
+}
+
+optional<fs::path> Pack_Storage::file(const Media_Item&)
+{
+    return {};
+}
+
+bool Pack_Storage::append(const Media_Item& item, string_cref extension, std::string_view body)
+{
+    // hashing is the expensive part, outside the lock
+    Content_Hasher hasher(m_mode);
+    hasher.update(body);
+
+    return append_record(item, extension, body.size(), hasher.digest(), [&](std::ofstream& out)
+    {
+        out.write(body.data(), static_cast<std::streamsize>(body.size()));
+    });
+}
+
+bool Pack_Storage::append_file(const Media_Item& item, string_cref extension, const fs::path& body_file)
+{
+    std::ifstream ifs(body_file, std::ifstream::binary);
+
+    if (not ifs.is_open())
+        return false;
+
+    vector<char> buffer(g_COPY_CHUNK);
+
+    // one chunk in memory at a time, read twice: once to hash, once to copy
+    auto for_each_chunk = [&](auto on_chunk)
+    {
+        ifs.clear();
+        ifs.seekg(0);
+
+        uint64_t total = 0;
+
+        while (ifs.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) or ifs.gcount() > 0)
+        {
+            auto read = static_cast<size_t>(ifs.gcount());
+            on_chunk(std::string_view(buffer.data(), read));
+            total += read;
+        }
+
+        return total;
+    };
+
+    Content_Hasher hasher(m_mode);
+    uint64_t length = for_each_chunk([&](std::string_view chunk) { hasher.update(chunk); });
+
+    return append_record(item, extension, length, hasher.digest(), [&](std::ofstream& out)
+    {
+        for_each_chunk([&](std::string_view chunk)
+        {
+            out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        });
+    });
+}
+
+bool Pack_Storage::append_record(const Media_Item& item,
+                                 string_cref extension,
+                                 uint64_t length,
+                                 string_cref digest,
+                                 const std::function<void(std::ofstream&)>& write_body)
+{
+    std::lock_guard lock(m_mutex);
+
+    if (not m_open or m_read_only)
+        return false;
+
+    if (m_by_key.contains(key(item.post_id, item.part)))
+        return true;
+
+    Pack_Entry entry{
+        .post_id = item.post_id,
+        .part = item.part,
+        .name = item.name,
+        .extension = extension,
+        .digest = digest
+    };
+
+    // same bytes as an item already packed: only a new index line
+    if (auto it = m_by_digest.find(digest); it != m_by_digest.end())
+    {
+        const auto& copy = m_entries[it->second];
+
+        if (copy.length == length)
+        {
+            entry.segment = copy.segment;
+            entry.offset = copy.offset;
+            entry.length = copy.length;
+
+            write_index_line(entry);
+            add_entry(std::move(entry));
+
+            ++m_items_deduplicated;
+            return true;
+        }
+    }
+
+    Record_Header header{
+        .magic = g_RECORD_MAGIC,
+        .post_id_len = static_cast<uint16_t>(std::min<size_t>(item.post_id.size(), std::numeric_limits<uint16_t>::max())),
+        .name_len = static_cast<uint16_t>(std::min<size_t>(item.name.size(), std::numeric_limits<uint16_t>::max())),
+        .part = static_cast<uint32_t>(item.part),
+        .extension_len = static_cast<uint32_t>(std::min<size_t>(extension.size(), 16)),
+        .body_len = length
+    };
+
+    uint64_t strings_len = uint64_t(header.post_id_len) + header.name_len + header.extension_len;
+    uint64_t record_len = sizeof(header) + strings_len + length;
+
+    if (m_segment_end > 0 and
+        m_segment_end + record_len > m_segment_size and
+        not open_segment(m_segment + 1))
+    {
+        cout << std::format("[WARN] Cannot open <{}>", segment_path(m_segment).string()) << endl;
+        m_open = false;
+        return false;
+    }
+
+    m_segment_out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_segment_out.write(item.post_id.data(), header.post_id_len);
+    m_segment_out.write(item.name.data(), header.name_len);
+    m_segment_out.write(extension.data(), header.extension_len);
+    write_body(m_segment_out);
+
+    // the record is on its way to disk before the index points to it
+    m_segment_out.flush();
+
+    if (not m_segment_out.good())
+    {
+        // a half written record would shift every record after it
+        cout << std::format("[WARN] Cannot write <{}>, nothing else is packed", segment_path(m_segment).string()) << endl;
+        m_open = false;
+        return false;
+    }
+
+    entry.name = item.name.substr(0, header.name_len);
+    entry.segment = m_segment;
+    entry.offset = m_segment_end + sizeof(header) + strings_len;
+    entry.length = length;
+    m_segment_end += record_len;
+
+    write_index_line(entry);
+    add_entry(std::move(entry));
+
+    ++m_items_packed;
+    return true;
+}
+
+vector<Pack_Entry> Pack_Storage::entries()
+{
+    std::lock_guard lock(m_mutex);
+    return m_entries;
+}
+
+bool Pack_Storage::extract(const Pack_Entry& entry, const fs::path& destination)
+{
+    std::ifstream ifs(segment_path(entry.segment), std::ifstream::binary);
+    std::ofstream ofs(destination, std::ofstream::binary | std::ofstream::trunc);
+
+    if (not ifs.is_open() or not ofs.is_open())
+        return false;
+
+    ifs.seekg(static_cast<std::streamoff>(entry.offset));
+
+    vector<char> buffer(256 * 1024);
+
+    for (uint64_t left = entry.length; left > 0; )
+    {
+        auto chunk = static_cast<size_t>(std::min<uint64_t>(left, buffer.size()));
+
+        if (not ifs.read(buffer.data(), static_cast<std::streamsize>(chunk)))
+            return false;
+
+        ofs.write(buffer.data(), static_cast<std::streamsize>(chunk));
+        left -= chunk;
+    }
+
+    return ofs.good();
+}
+
+size_t Pack_Storage::items_packed() const
+{
+    return m_items_packed;
+}
+
+size_t Pack_Storage::items_deduplicated() const
+{
+    return m_items_deduplicated;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "rid.h"
+#include "content_hash.h"
+#include "media_storage.h"
+
+class Memory_Budget;
+
+// a new segment is started past this size
+constexpr uint64_t g_PACK_SEGMENT_SIZE = 1024ull * 1024 * 1024;
+
+// where an item lives inside the pack
+struct Pack_Entry
+{
+    string post_id;
+    size_t part = 0;
+    string name;
+    string extension;
+    uint32_t segment = 0;
+    uint64_t offset = 0; // of the body inside the segment
+    uint64_t length = 0;
+    string digest;
+};
+
+// Every body appended to a few big segment files, "<folder>/segment_00000.rpk"
+// and following, instead of one file per image: writes are sequential and
+// the file system sees a handful of files, not millions.
+// Each record is a small header (post id, part, name, extension, length)
+// followed by the body, so the segments alone are enough to rebuild
+// everything. "<folder>/index.txt" maps post id and part to segment, offset
+// and length, one line per item, and is replayed when the pack is opened.
+// Bodies already in the pack are not written twice, the new item points to
+// the earlier copy.
+// Bodies are kept in memory until complete, interrupted transfers start
+// over instead of resuming. With a Memory_Budget a body that does not fit
+// is spooled to a file in the folder and packed from there.
+class Pack_Storage : public Media_Storage
+{
+public:
+    // read only: nothing is repaired or written, safe while another
+    // process is appending. Without a budget bodies are always kept in memory
+    explicit Pack_Storage(const fs::path& folder,
+                          Hash_Mode mode = Hash_Mode::FAST,
+                          uint64_t segment_size = g_PACK_SEGMENT_SIZE,
+                          bool read_only = false,
+                          Memory_Budget* budget = nullptr);
+
+    Pack_Storage(const Pack_Storage&) = delete;
+    Pack_Storage& operator=(const Pack_Storage&) = delete;
+
+    bool is_open() const;
+
+    using Media_Storage::download;
+
+    void download(HTTP_Engine& engine,
+                  string_cref url,
+                  const Media_Item& item,
+                  Download_Done done) override;
+
+    bool contains(const Media_Item& item) override;
+
+    // packed items are never files of their own
+    optional<fs::path> file(const Media_Item& item) override;
+
+    // a complete body: appended to the last segment, or pointed to the
+    // copy already in the pack. False when it cannot be written
+    bool append(const Media_Item& item, string_cref extension, std::string_view body);
+
+    // same, the body is the content of `body_file`, read in chunks
+    bool append_file(const Media_Item& item, string_cref extension, const fs::path& body_file);
+
+    // in the order they were added
+    vector<Pack_Entry> entries();
+
+    // copies the body of `entry` to `destination`
+    bool extract(const Pack_Entry& entry, const fs::path& destination);
+
+    size_t items_packed() const;
+    size_t items_deduplicated() const;
+
+private:
+    struct Record_Header
+    {
+        uint32_t magic = 0;
+        uint16_t post_id_len = 0;
+        uint16_t name_len = 0;
+        uint32_t part = 0;
+        uint32_t extension_len = 0;
+        uint64_t body_len = 0;
+    };
+
+    static string key(string_cref post_id, size_t part);
+    fs::path segment_path(uint32_t segment) const;
+
+    void load_index();
+    void recover_last_segment();
+    void add_entry(Pack_Entry entry);
+    void write_index_line(const Pack_Entry& entry);
+    bool open_segment(uint32_t segment);
+
+    // the record or the index line of a copy, `write_body` writes `length` bytes
+    bool append_record(const Media_Item& item,
+                       string_cref extension,
+                       uint64_t length,
+                       string_cref digest,
+                       const std::function<void(std::ofstream&)>& write_body);
+
+    fs::path m_folder;
+    Hash_Mode m_mode;
+    uint64_t m_segment_size;
+    bool m_read_only;
+    Memory_Budget* m_budget;
+    bool m_open = false;
+
+    std::mutex m_mutex;
+    vector<Pack_Entry> m_entries;
+    std::map<string, size_t> m_by_key; // "<post id>/<part>" -> m_entries
+    std::map<string, size_t> m_by_digest; // -> m_entries
+
+    uint32_t m_segment = 0; // the one we append to
+    uint64_t m_segment_end = 0;
+    std::ofstream m_segment_out;
+    std::ofstream m_index_out;
+
+    std::atomic<size_t> m_items_packed = 0;
+    std::atomic<size_t> m_items_deduplicated = 0;
+};
@@ -0,0 +1,114 @@
+#include "pch.h"
+
+#include "pack_tool.h"
+#include "pack_storage.h"
+
+namespace Pack_Tool
+{
+
+namespace
+{
+
+optional<vector<Pack_Entry>> read_entries(const fs::path& pack_folder)
+{
+    if (not fs::is_directory(pack_folder))
+    {
+        cout << std::format("[ERROR] No pack in <{}>", pack_folder.string()) << endl;
+        return {};
+    }
+
+    // another rid may be appending right now, don't touch anything
+    Pack_Storage pack(pack_folder, Hash_Mode::FAST, 0, true);
+
+    return pack.entries();
+}
+
+}
+
+int list(const string& dest_folder)
+{
+    auto entries = read_entries(fs::path(dest_folder) / "pack");
+
+    if (not entries.has_value())
+        return 1;
+
+    uint64_t bytes = 0;
+    std::map<string, bool> bodies; // digest -> seen
+
+    for (const auto& entry : *entries)
+    {
+        cout << std::format("{:<10} {:>4} {:>12} {:05}:{:<12} {}.{}",
+                            entry.post_id,
+                            entry.part,
+                            entry.length,
+                            entry.segment,
+                            entry.offset,
+                            entry.name,
+                            entry.extension) << endl;
+
+        if (not bodies.contains(entry.digest))
+            bytes += entry.length;
+
+        bodies[entry.digest] = true;
+    }
+
+    cout << std::format("{} items, {} bodies, {:.1f} MB",
+                        entries->size(),
+                        bodies.size(),
+                        bytes / (1024.0 * 1024.0)) << endl;
+
+    return 0;
+}
+
+int extract(const string& dest_folder,
+            const string& out_folder,
+            const string& post_id)
+{
+    fs::path pack_folder = fs::path(dest_folder) / "pack";
+    auto entries = read_entries(pack_folder);
+
+    if (not entries.has_value())
+        return 1;
+
+    std::error_code ec;
+    fs::create_directories(out_folder, ec);
+
+    if (not fs::is_directory(out_folder))
+    {
+        cout << std::format("[ERROR] Cannot create folder <{}>", out_folder) << endl;
+        return 1;
+    }
+
+    Pack_Storage pack(pack_folder, Hash_Mode::FAST, 0, true);
+
+    unsigned extracted = 0;
+    unsigned failed = 0;
+
+    for (const auto& entry : *entries)
+    {
+        if (post_id != "" and entry.post_id != post_id)
+            continue;
+
+        auto destination = fs::path(out_folder) / std::format("{}.{}", entry.name, entry.extension);
+
+        if (fs::exists(destination))
+            continue;
+
+        if (pack.extract(entry, destination))
+        {
+            ++extracted;
+        }
+        else
+        {
+            ++failed;
+            fs::remove(destination, ec);
+            cout << std::format("[WARN] Cannot extract <{}>", destination.string()) << endl;
+        }
+    }
+
+    cout << std::format("Extracted: {} Failed: {}", extracted, failed) << endl;
+
+    return failed == 0 ? 0 : 1;
+}
+
+}
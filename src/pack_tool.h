@@ -0,0 +1,17 @@
+#pragma once
+
+namespace Pack_Tool
+{
+
+// the items packed into "<dest-folder>/pack", launched with:
+// rid --pack-ls <dest-folder>
+int list(const string& dest_folder);
+
+// every item (or only the ones of `post_id`) as "<out-folder>/<name>.<extension>",
+// launched with:
+// rid --pack-extract <dest-folder> <out-folder> [post-id]
+int extract(const string& dest_folder,
+            const string& out_folder,
+            const string& post_id = "");
+
+}
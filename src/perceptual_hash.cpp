@@ -0,0 +1,377 @@
+#include "pch.h"
+
+#include "perceptual_hash.h"
+#include "config.h"
+#include "utils.h"
+
+// vcpkg install stb
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_PNG
+#define STBI_ONLY_GIF
+#define STBI_ONLY_BMP
+#include <stb_image.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RID_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RID_TARGET_AVX2
+#else
+#include <immintrin.h>
+#define RID_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define RID_X86 0
+#endif
+
+namespace
+{
+
+// bigger than this is not a picture anybody re-uploads, don't decode it
+constexpr long long g_MAX_PIXELS = 64ll * 1024 * 1024;
+
+}
+
+uint64_t dhash(const uint8_t* grey, int width, int height)
+{
+    // box filter down to 9x8, every source pixel lands in exactly one cell
+    uint64_t sums[8][9] = {};
+    uint64_t counts[8][9] = {};
+
+    for (int y = 0; y < height; ++y)
+    {
+        int cy = static_cast<int>(static_cast<long long>(y) * 8 / height);
+        const uint8_t* row = grey + static_cast<size_t>(y) * width;
+
+        for (int x = 0; x < width; ++x)
+        {
+            int cx = static_cast<int>(static_cast<long long>(x) * 9 / width);
+            sums[cy][cx] += row[x];
+            ++counts[cy][cx];
+        }
+    }
+
+    double cells[8][9] = {};
+    for (int cy = 0; cy < 8; ++cy)
+    {
+        for (int cx = 0; cx < 9; ++cx)
+        {
+            // images smaller than 9x8 leave cells empty, they borrow the left neighbour
+            if (counts[cy][cx] > 0)
+                cells[cy][cx] = static_cast<double>(sums[cy][cx]) / counts[cy][cx];
+            else if (cx > 0)
+                cells[cy][cx] = cells[cy][cx - 1];
+        }
+    }
+
+    uint64_t hash = 0;
+    for (int cy = 0; cy < 8; ++cy)
+    {
+        for (int cx = 0; cx < 8; ++cx)
+        {
+            hash <<= 1;
+            if (cells[cy][cx] > cells[cy][cx + 1])
+                hash |= 1;
+        }
+    }
+
+    return hash;
+}
+
+optional<uint64_t> dhash_file(const fs::path& file)
+{
+    std::ifstream ifs(file, std::ifstream::binary);
+
+    if (not ifs.is_open())
+        return {};
+
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    string data = ss.str();
+
+    auto bytes = reinterpret_cast<const stbi_uc*>(data.data());
+    auto len = static_cast<int>(std::min<size_t>(data.size(), std::numeric_limits<int>::max()));
+
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+
+    // videos and webp end up here
+    if (not stbi_info_from_memory(bytes, len, &width, &height, &channels) or
+        static_cast<long long>(width) * height > g_MAX_PIXELS)
+        return {};
+
+    stbi_uc* grey = stbi_load_from_memory(bytes, len, &width, &height, &channels, 1);
+
+    if (grey == nullptr)
+        return {};
+
+    uint64_t hash = dhash(grey, width, height);
+    stbi_image_free(grey);
+
+    return hash;
+}
+
+optional<Hamming_Match> nearest_within_scalar(std::span<const uint64_t> hashes,
+                                              uint64_t query,
+                                              int max_distance)
+{
+    optional<Hamming_Match> best;
+
+    for (size_t i = 0; i < hashes.size(); ++i)
+    {
+        int distance = std::popcount(hashes[i] ^ query);
+
+        if (distance <= max_distance)
+        {
+            best = Hamming_Match{ .position = i, .distance = distance };
+            max_distance = distance - 1; // only something closer from now on
+
+            if (distance == 0)
+                break;
+        }
+    }
+
+    return best;
+}
+
+#if RID_X86
+
+RID_TARGET_AVX2
+optional<Hamming_Match> nearest_within_avx2(std::span<const uint64_t> hashes,
+                                            uint64_t query,
+                                            int max_distance)
+{
+    // popcount of 4 lanes at once: a nibble lookup table through pshufb,
+    // then the byte counts of each 64 bit lane summed by psadbw
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i q = _mm256_set1_epi64x(static_cast<long long>(query));
+
+    optional<Hamming_Match> best;
+    __m256i limit = _mm256_set1_epi64x(max_distance + 1); // distance < limit
+
+    size_t i = 0;
+    const size_t n = hashes.size();
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_xor_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hashes.data() + i)), q);
+
+        __m256i lo = _mm256_and_si256(x, low_nibble);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_nibble);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                        _mm256_shuffle_epi8(lut, hi));
+        __m256i distances = _mm256_sad_epu8(bytes, zero);
+
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(limit, distances)));
+
+        if (mask == 0)
+            continue;
+
+        // rare: a near duplicate, or a closer one than the best so far
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            int distance = std::popcount(hashes[i + lane] ^ query);
+
+            if ((mask & (1 << lane)) and distance <= max_distance)
+            {
+                best = Hamming_Match{ .position = i + lane, .distance = distance };
+                max_distance = distance - 1;
+            }
+        }
+
+        if (max_distance < 0)
+            return best;
+
+        limit = _mm256_set1_epi64x(max_distance + 1);
+    }
+
+    // the last < 4
+    auto tail = nearest_within_scalar(hashes.subspan(i), query, max_distance);
+    if (tail.has_value())
+    {
+        tail->position += i;
+        best = tail;
+    }
+
+    return best;
+}
+
+bool cpu_has_avx2()
+{
+    static const bool has_avx2 = []
+    {
+#if defined(_MSC_VER)
+        int info[4] = {};
+        __cpuid(info, 0);
+        if (info[0] < 7)
+            return false;
+
+        // the OS must save the ymm registers too
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (not osxsave or not avx or (_xgetbv(0) & 6) != 6)
+            return false;
+
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+#else
+        return __builtin_cpu_supports("avx2") != 0;
+#endif
+    }();
+
+    return has_avx2;
+}
+
+#else
+
+optional<Hamming_Match> nearest_within_avx2(std::span<const uint64_t> hashes,
+                                            uint64_t query,
+                                            int max_distance)
+{
+    return nearest_within_scalar(hashes, query, max_distance);
+}
+
+bool cpu_has_avx2()
+{
+    return false;
+}
+
+#endif
+
+optional<Hamming_Match> nearest_within(std::span<const uint64_t> hashes,
+                                       uint64_t query,
+                                       int max_distance)
+{
+    if (max_distance < 0)
+        return {};
+
+    if (cpu_has_avx2())
+        return nearest_within_avx2(hashes, query, max_distance);
+
+    return nearest_within_scalar(hashes, query, max_distance);
+}
+
+Near_Duplicate_Filter::Near_Duplicate_Filter(const fs::path& hashes_file,
+                                             Near_Duplicate_Action action,
+                                             int max_distance) :
+    m_hashes_file(hashes_file),
+    m_action(action),
+    m_max_distance(max_distance)
+{
+    if (m_action == Near_Duplicate_Action::OFF)
+        return;
+
+    std::error_code ec;
+    fs::create_directories(m_hashes_file.parent_path(), ec);
+
+    {
+        std::ifstream ifs(m_hashes_file, std::ifstream::binary);
+        auto size = fs::file_size(m_hashes_file, ec);
+
+        if (ifs.is_open() and not ec)
+        {
+            // a torn last write leaves a few extra bytes, ignore them
+            m_hashes.resize(size / sizeof(uint64_t));
+            ifs.read(reinterpret_cast<char*>(m_hashes.data()),
+                     static_cast<std::streamsize>(m_hashes.size() * sizeof(uint64_t)));
+            m_hashes.resize(static_cast<size_t>(ifs.gcount()) / sizeof(uint64_t));
+        }
+    }
+
+    if (ec)
+        fs::resize_file(m_hashes_file, 0, ec);
+    else
+        fs::resize_file(m_hashes_file, m_hashes.size() * sizeof(uint64_t), ec);
+
+    m_out.open(m_hashes_file, std::ofstream::binary | std::ofstream::app);
+
+    if (not m_out.is_open())
+    {
+        cout << std::format("[WARN] Cannot open <{}>, near duplicates are not checked",
+                            m_hashes_file.string()) << endl;
+        m_action = Near_Duplicate_Action::OFF;
+    }
+}
+
+Near_Duplicate_Action Near_Duplicate_Filter::action() const
+{
+    return m_action;
+}
+
+Download_Result Near_Duplicate_Filter::check(const fs::path& file)
+{
+    if (m_action == Near_Duplicate_Action::OFF)
+        return Download_Result::DOWNLOADED;
+
+    // decoding is the expensive part, outside the lock
+    auto hash = dhash_file(file);
+
+    if (not hash.has_value())
+        return Download_Result::DOWNLOADED;
+
+    std::unique_lock lock(m_mutex);
+
+    auto match = nearest_within(m_hashes, *hash, m_max_distance);
+
+    if (not match.has_value())
+    {
+        m_hashes.push_back(*hash);
+        m_out.write(reinterpret_cast<const char*>(&*hash), sizeof(uint64_t));
+        m_out.flush();
+
+        return Download_Result::DOWNLOADED;
+    }
+
+    ++m_near_duplicates;
+
+    if (m_action == Near_Duplicate_Action::FLAG)
+    {
+        std::ofstream log(file.parent_path() / "near_duplicates.txt", std::ofstream::app);
+        log << file.filename().string() << "\t" << match->distance << "\n";
+
+        return Download_Result::DOWNLOADED;
+    }
+
+    lock.unlock();
+
+    std::error_code ec;
+    fs::remove(file, ec);
+
+    return Download_Result::SKIPPED;
+}
+
+size_t Near_Duplicate_Filter::size()
+{
+    std::lock_guard lock(m_mutex);
+    return m_hashes.size();
+}
+
+size_t Near_Duplicate_Filter::near_duplicates() const
+{
+    return m_near_duplicates;
+}
+
+Near_Duplicate_Filter& near_duplicate_filter()
+{
+    static Near_Duplicate_Filter filter = []
+    {
+        auto action = config().near_duplicates;
+        int max_distance = config().near_duplicate_distance;
+
+        auto app_data = Utils::app_data_folder();
+
+        if (not app_data.has_value())
+            return Near_Duplicate_Filter({}, Near_Duplicate_Action::OFF, max_distance);
+
+        return Near_Duplicate_Filter(*app_data / "dhash.bin", action, max_distance);
+    }();
+
+    return filter;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "rid.h"
+
+// 64 bit difference hash: the image shrunk to 9x8 grey pixels, one bit per
+// pair of horizontal neighbours. Re-encoding and resizing barely move it,
+// unrelated images are ~32 bits apart.
+uint64_t dhash(const uint8_t* grey, int width, int height);
+
+// decodes the file with stb_image, nothing for videos and undecodable files
+optional<uint64_t> dhash_file(const fs::path& file);
+
+struct Hamming_Match
+{
+    size_t position = 0;
+    int distance = 0;
+};
+
+// closest hash at most max_distance bits away from query, AVX2 when the cpu has it
+optional<Hamming_Match> nearest_within(std::span<const uint64_t> hashes,
+                                       uint64_t query,
+                                       int max_distance);
+
+optional<Hamming_Match> nearest_within_scalar(std::span<const uint64_t> hashes,
+                                              uint64_t query,
+                                              int max_distance);
+
+// only when cpu_has_avx2()
+optional<Hamming_Match> nearest_within_avx2(std::span<const uint64_t> hashes,
+                                            uint64_t query,
+                                            int max_distance);
+
+bool cpu_has_avx2();
+
+enum class Near_Duplicate_Action : uint8_t
+{
+    OFF,
+    FLAG, // keep the file, list it in "<folder>/near_duplicates.txt"
+    SKIP // delete the file, the part counts as SKIPPED
+};
+
+// Post-download stage: the dHash of every new image is compared with the
+// ones of all the images downloaded before, by any run into any folder.
+// The hashes are kept in a flat array, appended to a file as they come.
+class Near_Duplicate_Filter
+{
+public:
+    Near_Duplicate_Filter(const fs::path& hashes_file,
+                          Near_Duplicate_Action action,
+                          int max_distance);
+
+    Near_Duplicate_Filter(const Near_Duplicate_Filter&) = delete;
+    Near_Duplicate_Filter& operator=(const Near_Duplicate_Filter&) = delete;
+
+    Near_Duplicate_Action action() const;
+
+    // `file` was just downloaded: SKIPPED when it was deleted as a near
+    // duplicate, DOWNLOADED otherwise
+    Download_Result check(const fs::path& file);
+
+    size_t size();
+    size_t near_duplicates() const;
+
+private:
+    fs::path m_hashes_file;
+    Near_Duplicate_Action m_action;
+    int m_max_distance;
+
+    std::mutex m_mutex;
+    vector<uint64_t> m_hashes;
+    std::ofstream m_out;
+
+    std::atomic<size_t> m_near_duplicates = 0;
+};
+
+// NEAR_DUPLICATES (off | flag | skip, off by default) and
+// NEAR_DUPLICATE_DISTANCE (bits, 6 by default) from the .env file
+Near_Duplicate_Filter& near_duplicate_filter();
@@ -0,0 +1,128 @@
+#include "pch.h"
+
+#include "rate_limiter.h"
+
+namespace
+{
+
+optional<double> parse_double(const std::map<string, string>& headers, const char* name)
+{
+    auto it = headers.find(name);
+    if (it == headers.end())
+        return {};
+
+    try
+    {
+        return std::stod(it->second);
+    }
+    catch (const std::exception&)
+    {
+        return {};
+    }
+}
+
+Rate_Limiter::Clock::duration seconds(double s)
+{
+    return std::chrono::duration_cast<Rate_Limiter::Clock::duration>(
+        std::chrono::duration<double>(s));
+}
+
+}
+
+Ratelimit_Headers parse_ratelimit_headers(const std::map<string, string>& headers)
+{
+    return {
+        .remaining = parse_double(headers, "x-ratelimit-remaining"),
+        .used = parse_double(headers, "x-ratelimit-used"),
+        .reset = parse_double(headers, "x-ratelimit-reset"),
+        .retry_after = parse_double(headers, "retry-after")
+    };
+}
+
+void Rate_Limiter::acquire(string_cref host)
+{
+    auto wait = reserve(host, Clock::now());
+
+    if (wait > Clock::duration::zero())
+    {
+        cout << std::format("[INFO] rate limit reached for {}, waiting {:.1f} s",
+                            host, std::chrono::duration<double>(wait).count()) << endl;
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+Rate_Limiter::Clock::duration Rate_Limiter::reserve(string_cref host, Clock::time_point now)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto& bucket = m_buckets[host];
+    ++bucket.in_flight;
+
+    auto ready_at = now;
+
+    if (bucket.blocked_until > ready_at)
+        ready_at = bucket.blocked_until;
+
+    // no window to count against, only a 429 to wait out
+    if (not bucket.known)
+        return ready_at - now;
+
+    // a new window starts with a full budget
+    if (ready_at >= bucket.window_reset and
+        bucket.tokens < 1.0)
+    {
+        bucket.tokens = bucket.window_size;
+    }
+
+    if (bucket.tokens < 1.0)
+    {
+        // budget spent, wait for the next window and take the first token of it
+        ready_at = bucket.window_reset;
+        bucket.tokens = bucket.window_size;
+    }
+
+    bucket.tokens -= 1.0;
+
+    return ready_at - now;
+}
+
+void Rate_Limiter::update(string_cref host,
+                          long code,
+                          const std::map<string, string>& headers,
+                          Clock::time_point now)
+{
+    auto rl = parse_ratelimit_headers(headers);
+
+    std::lock_guard lock(m_mutex);
+
+    auto& bucket = m_buckets[host];
+
+    if (bucket.in_flight > 0)
+        --bucket.in_flight;
+
+    if (code == 429)
+    {
+        double wait_s = rl.retry_after.value_or(rl.reset.value_or(60.0));
+        bucket.blocked_until = now + seconds(wait_s);
+    }
+
+    if (not (rl.remaining.has_value() and
+             rl.reset.has_value()))
+        return;
+
+    bucket.known = true;
+    bucket.window_reset = now + seconds(*rl.reset);
+    bucket.window_size = *rl.remaining + rl.used.value_or(0.0);
+
+    // the server does not know yet about the requests still in flight
+    bucket.tokens = std::max(0.0, std::floor(*rl.remaining) - bucket.in_flight);
+
+    if (code == 429)
+        bucket.tokens = 0.0;
+}
+
+Rate_Limiter& rate_limiter()
+{
+    static Rate_Limiter limiter;
+    return limiter;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "rid.h"
+
+// X-Ratelimit-* headers sent by reddit, all optional
+struct Ratelimit_Headers
+{
+    optional<double> remaining; // requests left in the current window
+    optional<double> used; // requests done in the current window
+    optional<double> reset; // seconds until the window resets
+    optional<double> retry_after; // seconds, sent along a 429
+};
+
+Ratelimit_Headers parse_ratelimit_headers(const std::map<string, string>& headers);
+
+// Per host token bucket fed by the X-Ratelimit headers of the responses.
+// While the budget of the current window lasts requests go out as fast as
+// they are asked for, once it is spent callers wait exactly until the
+// window resets instead of running into a 429.
+// A host that never sent the headers is not limited, but for the
+// Retry-After of a 429.
+class Rate_Limiter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // blocks until a request to host is allowed
+    void acquire(string_cref host);
+
+    // takes a token for a request to host, returns how long
+    // the caller has to wait before sending it
+    Clock::duration reserve(string_cref host, Clock::time_point now);
+
+    // every reserve() must be followed by exactly one update(), code is -1
+    // and headers are empty when the request failed without a response
+    void update(string_cref host,
+                long code,
+                const std::map<string, string>& headers,
+                Clock::time_point now);
+
+private:
+    struct Bucket
+    {
+        bool known = false; // headers seen at least once
+        double tokens = 0.0; // requests left in the window, in flight ones excluded
+        double window_size = 0.0; // used + remaining of the last window
+        Clock::time_point window_reset;
+        Clock::time_point blocked_until; // after a 429
+        unsigned in_flight = 0;
+    };
+
+    std::mutex m_mutex;
+    std::map<string, Bucket> m_buckets;
+};
+
+// limiter shared by every request of the process
+Rate_Limiter& rate_limiter();
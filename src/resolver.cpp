@@ -0,0 +1,297 @@
+#include "pch.h"
+
+#include "resolver.h"
+#include "resolver_cache.h"
+
+namespace
+{
+
+std::atomic<size_t> g_from_listing = 0;
+std::atomic<size_t> g_from_api = 0;
+
+Resolution gone(string reason)
+{
+    return { .status = Resolution::Status::GONE, .reason = std::move(reason) };
+}
+
+Resolution resolved(vector<Media_Link> media)
+{
+    return { .status = Resolution::Status::RESOLVED, .media = std::move(media) };
+}
+
+// "" for an extension that is not one of the media ones
+string content_type_of(std::string_view extension)
+{
+    string ext(extension);
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+    if (ext == "jpg" or ext == "jpeg") return "image/jpeg";
+    if (ext == "png" or ext == "gif" or ext == "webp") return "image/" + ext;
+    if (ext == "mp4" or ext == "webm") return "video/" + ext;
+
+    return {};
+}
+
+// the url of the post as is, the type from its extension
+Resolution direct_link(const Post& post, const Url_View& url)
+{
+    return resolved({ { .url = post.url, .content_type = content_type_of(url.extension()) } });
+}
+
+// reddit's own copy, for links to pages it took a picture or a clip from
+optional<Resolution> from_preview(const Post& post)
+{
+    if (post.post_hint == "image" and post.preview_url != "")
+        return resolved({ { .url = post.preview_url } });
+
+    if (post.post_hint.ends_with("video") and post.preview_video_url != "")
+        return resolved({ { .url = post.preview_video_url, .content_type = "video/mp4" } });
+
+    return {};
+}
+
+optional<Resolution> vreddit_from_listing(const Post& post, const Url_View&)
+{
+    string video = get_url_from_vreddit(post);
+
+    if (video != "")
+    {
+        return resolved({ { .url = std::move(video),
+                            .content_type = "video/mp4",
+                            .expected_size = post.video_size } });
+    }
+
+    if (post.preview_video_url != "")
+        return resolved({ { .url = post.preview_video_url, .content_type = "video/mp4" } });
+
+    return gone("no fallback_url in the listing");
+}
+
+// "i.imgur.com/<id>.<ext>" as is, a ".gifv" is a page around the ".mp4".
+// "imgur.com/<id>" is a single image or clip the listing has a preview of.
+// Albums and galleries list their images through the api only
+optional<Resolution> imgur_from_listing(const Post& post, const Url_View& url)
+{
+    std::string_view extension = url.extension();
+
+    if (extension == "gifv")
+    {
+        // views into post.url
+        auto offset = static_cast<size_t>(extension.data() - post.url.data());
+        string mp4 = post.url.substr(0, offset) + "mp4" + post.url.substr(offset + extension.size());
+
+        return resolved({ { .url = std::move(mp4), .content_type = "video/mp4" } });
+    }
+
+    if (extension != "")
+        return direct_link(post, url);
+
+    std::string_view id = url.path.substr(std::min<size_t>(1, url.path.size()));
+
+    if (id == "" or id.find('/') != std::string_view::npos)
+        return {};
+
+    if (post.preview_video_url != "")
+        return resolved({ { .url = std::format("https://i.imgur.com/{}.mp4", id), .content_type = "video/mp4" } });
+
+    if (post.post_hint == "image")
+        return resolved({ { .url = std::format("https://i.imgur.com/{}.jpg", id), .content_type = "image/jpeg" } });
+
+    return {};
+}
+
+Resolution imgur_from_api(const Post& post, const Url_View&)
+{
+    return resolver_cache().resolve(post.url, [&] { return get_url_from_imgur(post); });
+}
+
+// reddit keeps an mp4 of every gfycat clip it shows
+optional<Resolution> gfycat_from_listing(const Post& post, const Url_View&)
+{
+    if (post.preview_video_url != "")
+        return resolved({ { .url = post.preview_video_url, .content_type = "video/mp4" } });
+
+    return {};
+}
+
+Resolution gfycat_from_api(const Post& post, const Url_View&)
+{
+    return resolver_cache().resolve(post.url, [&] { return get_url_from_gfycat(post); });
+}
+
+optional<Resolution> reddit_from_listing(const Post& post, const Url_View& url)
+{
+    if (post.is_gallery)
+    {
+        auto urls = get_url_from_reddit_gallery(post);
+
+        vector<Media_Link> media;
+        media.reserve(urls.size());
+
+        for (size_t i = 0; i < urls.size(); ++i)
+        {
+            media.push_back({ .url = std::move(urls[i]),
+                              .content_type = i < post.gallery_types.size() ? post.gallery_types[i] : "" });
+        }
+
+        if (media.empty())
+            return gone("gallery without any media in the listing");
+
+        return resolved(std::move(media));
+    }
+
+    if (url.extension() != "")
+        return direct_link(post, url);
+
+    if (auto preview = from_preview(post); preview.has_value())
+        return preview;
+
+    return gone("reddit link without a file extension");
+}
+
+// every domain that is not in the table
+optional<Resolution> direct_from_listing(const Post& post, const Url_View& url)
+{
+    if (url.extension() != "")
+        return direct_link(post, url);
+
+    if (auto preview = from_preview(post); preview.has_value())
+        return preview;
+
+    // unknown domain and no extension, no good
+    return gone(std::format("unknown domain {} and no file extension", domain_of(post, url)));
+}
+
+constexpr Resolver g_VREDDIT{ .name = "v.redd.it", .from_listing = vreddit_from_listing };
+constexpr Resolver g_IMGUR{ .name = "imgur", .from_listing = imgur_from_listing, .from_api = imgur_from_api };
+constexpr Resolver g_GFYCAT{ .name = "gfycat", .from_listing = gfycat_from_listing, .from_api = gfycat_from_api };
+constexpr Resolver g_REDDIT{ .name = "reddit", .from_listing = reddit_from_listing };
+constexpr Resolver g_DIRECT{ .name = "direct link", .from_listing = direct_from_listing };
+
+struct Host_Entry
+{
+    std::string_view host;
+    const Resolver* resolver;
+};
+
+constexpr Host_Entry g_HOSTS[] = {
+    { "v.redd.it", &g_VREDDIT },
+    { "imgur.com", &g_IMGUR },
+    { "i.imgur.com", &g_IMGUR },
+    { "gfycat.com", &g_GFYCAT },
+    { "reddit.com", &g_REDDIT },
+};
+
+constexpr size_t g_SLOTS = 16; // power of 2, a few times the hosts so a seed is quick to find
+
+// FNV-1a, widened so the multiplication does not overflow in a constant expression
+constexpr uint32_t host_hash(std::string_view host, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (char c : host)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash = static_cast<uint32_t>((static_cast<uint64_t>(hash) * 16777619u) & 0xFFFFFFFFu);
+    }
+
+    return hash;
+}
+
+struct Host_Table
+{
+    uint32_t seed = 0;
+    int8_t slots[g_SLOTS] = {}; // index into g_HOSTS, -1 when empty
+};
+
+// the first seed that gives every host a slot of its own
+consteval Host_Table build_host_table()
+{
+    for (uint32_t seed = 0; seed < 1'000'000; ++seed)
+    {
+        Host_Table table{ .seed = seed };
+
+        for (auto& slot : table.slots)
+            slot = -1;
+
+        bool collision = false;
+
+        for (size_t i = 0; i < std::size(g_HOSTS) and not collision; ++i)
+        {
+            auto& slot = table.slots[host_hash(g_HOSTS[i].host, seed) % g_SLOTS];
+
+            if (slot != -1)
+                collision = true;
+            else
+                slot = static_cast<int8_t>(i);
+        }
+
+        if (not collision)
+            return table;
+    }
+
+    throw "no perfect hash for the hosts of g_HOSTS, raise g_SLOTS";
+}
+
+constexpr Host_Table g_HOST_TABLE = build_host_table();
+
+}
+
+const Resolver& resolver_for(std::string_view domain)
+{
+    auto slot = g_HOST_TABLE.slots[host_hash(domain, g_HOST_TABLE.seed) % g_SLOTS];
+
+    if (slot != -1 and g_HOSTS[static_cast<size_t>(slot)].host == domain)
+        return *g_HOSTS[static_cast<size_t>(slot)].resolver;
+
+    return g_DIRECT;
+}
+
+std::string_view domain_of(const Post& post, const Url_View& url)
+{
+    return post.domain != "" ? std::string_view(post.domain) : url.host;
+}
+
+Resolution resolve(const Resolver& resolver, const Post& post, const Url_View& url)
+{
+    if (resolver.from_listing != nullptr)
+    {
+        if (auto resolution = resolver.from_listing(post, url); resolution.has_value())
+        {
+            ++g_from_listing;
+            return std::move(*resolution);
+        }
+    }
+
+    if (resolver.from_api == nullptr)
+        return gone(std::format("nothing in the listing and no api for {}", resolver.name));
+
+    ++g_from_api;
+    return resolver.from_api(post, url);
+}
+
+bool needs_network(const Resolver& resolver, const Post& post, const Url_View& url)
+{
+    if (resolver.from_api == nullptr)
+        return false;
+
+    return resolver.from_listing == nullptr or
+        not resolver.from_listing(post, url).has_value();
+}
+
+double Resolver_Stats::offline_ratio() const
+{
+    if (from_listing + from_api == 0)
+        return 0.0;
+
+    return static_cast<double>(from_listing) / static_cast<double>(from_listing + from_api);
+}
+
+Resolver_Stats resolver_stats()
+{
+    return {
+        .from_listing = g_from_listing,
+        .from_api = g_from_api
+    };
+}
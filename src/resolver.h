@@ -0,0 +1,48 @@
+#pragma once
+
+#include "rid.h"
+#include "url.h"
+
+// How the media urls of a post are found, picked by the domain of the post.
+// The registry is a table built at compile time, looked up through a
+// perfect hash of the host: one hash and one string compare per post.
+// Adding a host is one line in the table of resolver.cpp.
+// The listing carries the final url, type and size of most posts, an api is
+// only asked for the ones it does not describe, imgur albums for instance.
+struct Resolver
+{
+    std::string_view name;
+
+    // what the listing alone tells, nothing when only the api knows.
+    // `url` is post.url, parsed
+    optional<Resolution> (*from_listing)(const Post& post, const Url_View& url) = nullptr;
+
+    // nullptr for hosts without an api, from_listing() then always answers
+    Resolution (*from_api)(const Post& post, const Url_View& url) = nullptr;
+};
+
+// from_listing(), or from_api() when the listing is not enough
+Resolution resolve(const Resolver& resolver, const Post& post, const Url_View& url);
+
+// true when resolve() would ask an api, such posts are queued after the
+// ones the listing describes
+bool needs_network(const Resolver& resolver, const Post& post, const Url_View& url);
+
+struct Resolver_Stats
+{
+    size_t from_listing = 0;
+    size_t from_api = 0;
+
+    // fraction of the posts resolved without a request
+    double offline_ratio() const;
+};
+
+// every resolve() of the process
+Resolver_Stats resolver_stats();
+
+// the resolver registered for `domain`, the direct link one (any url with
+// a file extension) for every other domain
+const Resolver& resolver_for(std::string_view domain);
+
+// the domain of the listing, the host of the url for posts without one
+std::string_view domain_of(const Post& post, const Url_View& url);
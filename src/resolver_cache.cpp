@@ -0,0 +1,228 @@
+#include "pch.h"
+
+#include "resolver_cache.h"
+#include "config.h"
+#include "utils.h"
+
+namespace
+{
+
+// a tab or a new line in a field would break the line apart
+string clean_field(string_cref field)
+{
+    string res = field;
+    std::replace_if(res.begin(), res.end(), [](char c)
+    {
+        return c == '\t' or c == '\r' or c == '\n';
+    }, ' ');
+    return res;
+}
+
+template<typename T>
+optional<T> to_number(std::string_view text)
+{
+    T number{};
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+
+    if (error != std::errc{} or end != text.data() + text.size())
+        return {};
+
+    return number;
+}
+
+}
+
+Resolver_Cache::Resolver_Cache(const fs::path& file,
+                               std::chrono::seconds ttl,
+                               std::chrono::seconds negative_ttl) :
+    m_file(file),
+    m_ttl(ttl),
+    m_negative_ttl(negative_ttl)
+{
+    if (m_file.empty())
+        return;
+
+    load();
+
+    m_out.open(m_file, std::ofstream::binary | std::ofstream::app);
+
+    if (not m_out.is_open())
+    {
+        cout << std::format("[WARN] Cannot open <{}>, resolved urls are kept for this run only",
+                            m_file.string()) << endl;
+    }
+}
+
+optional<Resolution> Resolver_Cache::find(string_cref url)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto it = m_entries.find(url);
+
+    if (it == m_entries.end() or it->second.expires <= now())
+    {
+        ++m_misses;
+        return {};
+    }
+
+    ++m_hits;
+    return it->second.resolution;
+}
+
+void Resolver_Cache::store(string_cref url, const Resolution& resolution)
+{
+    if (resolution.status == Resolution::Status::FAILED)
+        return;
+
+    auto ttl = resolution.status == Resolution::Status::RESOLVED ? m_ttl : m_negative_ttl;
+
+    if (ttl.count() <= 0)
+        return;
+
+    Entry entry{ .expires = now() + ttl.count(), .resolution = resolution };
+
+    std::lock_guard lock(m_mutex);
+
+    append(url, entry);
+    m_entries[url] = std::move(entry);
+}
+
+Resolution Resolver_Cache::resolve(string_cref url, const std::function<Resolution()>& resolver)
+{
+    if (auto cached = find(url); cached.has_value())
+        return *cached;
+
+    // two workers can miss on the same url, both resolve it, the answer is the same
+    auto resolution = resolver();
+    store(url, resolution);
+
+    return resolution;
+}
+
+size_t Resolver_Cache::hits() const
+{
+    return m_hits;
+}
+
+size_t Resolver_Cache::misses() const
+{
+    return m_misses;
+}
+
+int64_t Resolver_Cache::now()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void Resolver_Cache::load()
+{
+    std::ifstream ifs(m_file, std::ifstream::binary);
+
+    if (not ifs.is_open())
+        return;
+
+    const auto current = now();
+    size_t lines = 0;
+
+    for (string line; std::getline(ifs, line); )
+    {
+        ++lines;
+
+        Utils::Split_View split(line, "\t");
+        vector<std::string_view> fields(split.begin(), split.end());
+
+        // a torn last line has fewer fields, or pairs cut in half
+        if (fields.size() < 3 or fields.size() % 2 == 0)
+            continue;
+
+        auto expires = to_number<int64_t>(fields[0]);
+
+        if (not expires.has_value() or (fields[2] != "R" and fields[2] != "G"))
+            continue;
+
+        string url(fields[1]);
+
+        if (*expires <= current)
+        {
+            m_entries.erase(url);
+            continue;
+        }
+
+        Entry entry{ .expires = *expires };
+        entry.resolution.status = fields[2] == "R" ?
+            Resolution::Status::RESOLVED :
+            Resolution::Status::GONE;
+
+        for (size_t i = 3; i + 1 < fields.size(); i += 2)
+        {
+            entry.resolution.media.push_back({ .url = string(fields[i]),
+                                               .content_type = string(fields[i + 1]) });
+        }
+
+        m_entries[url] = std::move(entry);
+    }
+
+    ifs.close();
+
+    // mostly expired or overwritten lines, written again with the live ones only
+    if (lines > 1024 and lines > 2 * m_entries.size())
+    {
+        fs::path compacted = m_file;
+        compacted += ".tmp";
+
+        m_out.open(compacted, std::ofstream::binary | std::ofstream::trunc);
+
+        for (const auto& [url, entry] : m_entries)
+            append(url, entry);
+
+        m_out.close();
+
+        std::error_code ec;
+        fs::rename(compacted, m_file, ec);
+    }
+}
+
+void Resolver_Cache::append(string_cref url, const Entry& entry)
+{
+    if (not m_out.is_open())
+        return;
+
+    m_out << entry.expires << '\t'
+        << clean_field(url) << '\t'
+        << (entry.resolution.status == Resolution::Status::RESOLVED ? 'R' : 'G');
+
+    for (const auto& media : entry.resolution.media)
+        m_out << '\t' << clean_field(media.url) << '\t' << clean_field(media.content_type);
+
+    m_out << '\n';
+    m_out.flush();
+}
+
+Resolver_Cache& resolver_cache()
+{
+    static Resolver_Cache cache = []
+    {
+        const auto& settings = config();
+        fs::path file = settings.resolver_cache;
+
+        if (file == "off")
+            return Resolver_Cache({}, std::chrono::seconds(0), std::chrono::seconds(0));
+
+        if (file.empty())
+        {
+            auto app_data = Utils::app_data_folder();
+
+            if (app_data.has_value())
+            {
+                std::error_code ec;
+                fs::create_directories(*app_data, ec);
+                file = *app_data / "resolver_cache.txt";
+            }
+        }
+
+        return Resolver_Cache(file, settings.resolver_cache_ttl, settings.resolver_negative_ttl);
+    }();
+
+    return cache;
+}
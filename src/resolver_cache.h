@@ -0,0 +1,61 @@
+#pragma once
+
+#include "rid.h"
+
+// What the API resolvers found behind the url of a post, kept across runs
+// so a re-crawl of the same listing does not spend the imgur quota again.
+// RESOLVED entries are kept for `ttl`, GONE ones for `negative_ttl`,
+// FAILED ones are never kept: the next run asks again.
+// One line per entry, appended as the resolutions come, the last line of
+// a url wins:
+//     <expires, unix seconds> \t <url> \t <R|G> \t <media url> \t <content type> ...
+// Expired lines are dropped when the file is opened.
+class Resolver_Cache
+{
+public:
+    // an empty `file` keeps the cache in memory only
+    Resolver_Cache(const fs::path& file,
+                   std::chrono::seconds ttl,
+                   std::chrono::seconds negative_ttl);
+
+    Resolver_Cache(const Resolver_Cache&) = delete;
+    Resolver_Cache& operator=(const Resolver_Cache&) = delete;
+
+    // nothing when the url was never resolved or the entry expired
+    optional<Resolution> find(string_cref url);
+
+    void store(string_cref url, const Resolution& resolution);
+
+    // find(), or `resolver` and store() on a miss
+    Resolution resolve(string_cref url, const std::function<Resolution()>& resolver);
+
+    size_t hits() const;
+    size_t misses() const;
+
+private:
+    struct Entry
+    {
+        int64_t expires = 0; // unix seconds
+        Resolution resolution;
+    };
+
+    static int64_t now();
+
+    void load();
+    void append(string_cref url, const Entry& entry);
+
+    fs::path m_file;
+    std::chrono::seconds m_ttl;
+    std::chrono::seconds m_negative_ttl;
+
+    std::mutex m_mutex;
+    std::map<string, Entry> m_entries;
+    std::ofstream m_out;
+
+    std::atomic<size_t> m_hits = 0;
+    std::atomic<size_t> m_misses = 0;
+};
+
+// shared by every run of the process: RESOLVER_CACHE, RESOLVER_CACHE_TTL
+// and RESOLVER_NEGATIVE_TTL of config()
+Resolver_Cache& resolver_cache();
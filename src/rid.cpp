@@ -2,7 +2,25 @@
 
 #include "rid.h"
 #include "utils.h"
+#include "url.h"
 #include "test.h"
+#include "download_pool.h"
+#include "http_engine.h"
+#include "http_share.h"
+#include "download_sink.h"
+#include "file_writer.h"
+#include "rate_limiter.h"
+#include "listing_prefetcher.h"
+#include "download_index.h"
+#include "download_journal.h"
+#include "content_store.h"
+#include "perceptual_hash.h"
+#include "media_storage.h"
+#include "pack_storage.h"
+#include "config.h"
+#include "resolver_cache.h"
+#include "resolver.h"
+#include "memory_budget.h"
 
 /*
 
@@ -17,6 +35,24 @@ TODO:
 
  */
 
+namespace
+{
+
+// one handle per thread: curl keeps the connection open after a request,
+// so the next one to the same host skips DNS, TCP and TLS handshakes
+curlpp::Easy& thread_http_handle()
+{
+    thread_local curlpp::Easy request;
+
+    request.reset();
+    curl_easy_setopt(request.getHandle(), CURLOPT_SHARE, http_share());
+    set_http_timeouts(request.getHandle());
+
+    return request;
+}
+
+}
+
 optional<HTTP_Response> perform_http_request(const string& url,
                                              const std::list<string>& headers)
 {
@@ -25,7 +61,7 @@ optional<HTTP_Response> perform_http_request(const string& url,
         using namespace curlpp::options;
         using namespace curlpp::infos;
 
-        curlpp::Easy request;
+        curlpp::Easy& request = thread_http_handle();
 
         std::stringstream header_ss;
 
@@ -37,7 +73,7 @@ optional<HTTP_Response> perform_http_request(const string& url,
         };
 
         request.setOpt<Url>(url);
-        request.setOpt<UserAgent>("Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/101.0.4951.64 Safari/537.36");
+        request.setOpt<UserAgent>(g_USER_AGENT);
         request.setOpt<FollowLocation>(true);
         request.setOpt<MaxRedirs>(10);
         request.setOpt<Verbose>(false);
@@ -53,11 +89,16 @@ optional<HTTP_Response> perform_http_request(const string& url,
         auto code = ResponseCode::get(request);
         auto content_type = ContentType::get(request);
 
+        long num_connects = -1;
+        curl_easy_getinfo(request.getHandle(), CURLINFO_NUM_CONNECTS, &num_connects);
+        record_http_request(num_connects);
+
         return HTTP_Response{
             .body = body_ss.str(),
             .code = code,
             .content_type = content_type,
-            .resp_headers = header_ss.str()
+            .resp_headers = header_ss.str(),
+            .num_connects = num_connects
         };
     }
     catch (const curlpp::LibcurlRuntimeError& e)
@@ -79,7 +120,7 @@ optional<HTTP_Response> request_headers_only(const string& url,
         using namespace curlpp::options;
         using namespace curlpp::infos;
 
-        curlpp::Easy request;
+        curlpp::Easy& request = thread_http_handle();
 
         std::stringstream header_ss;
 
@@ -91,7 +132,7 @@ optional<HTTP_Response> request_headers_only(const string& url,
         };
 
         request.setOpt<Url>(url);
-        request.setOpt<UserAgent>("Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/101.0.4951.64 Safari/537.36");
+        request.setOpt<UserAgent>(g_USER_AGENT);
         request.setOpt<FollowLocation>(true);
         request.setOpt<MaxRedirs>(10);
         request.setOpt<HttpHeader>(headers);
@@ -103,11 +144,16 @@ optional<HTTP_Response> request_headers_only(const string& url,
         auto code = ResponseCode::get(request);
         auto content_type = ContentType::get(request);
 
+        long num_connects = -1;
+        curl_easy_getinfo(request.getHandle(), CURLINFO_NUM_CONNECTS, &num_connects);
+        record_http_request(num_connects);
+
         return HTTP_Response{
             .body = "",
             .code = code,
             .content_type = content_type,
-            .resp_headers = header_ss.str()
+            .resp_headers = header_ss.str(),
+            .num_connects = num_connects
         };
     }
     catch (const curlpp::LibcurlRuntimeError& e)
@@ -121,14 +167,9 @@ optional<HTTP_Response> request_headers_only(const string& url,
     }
 }
 
-Download_Result download_file_to_disk(string_cref url,
+Download_Result save_response_to_disk(const optional<HTTP_Response>& resp,
                                       string_cref destination)
 {
-    if (fs::exists(destination))
-        return Download_Result::SKIPPED;
-
-    auto resp = perform_http_request(url);
-
     if ((not resp.has_value()) or
         resp->code != 200)
         return Download_Result::FAILED;
@@ -152,6 +193,82 @@ Download_Result download_file_to_disk(string_cref url,
     return Download_Result::DOWNLOADED;
 }
 
+namespace
+{
+
+std::future<Download_Result> ready_result(Download_Result result)
+{
+    std::promise<Download_Result> promise;
+    promise.set_value(result);
+    return promise.get_future();
+}
+
+}
+
+std::future<Download_Result> download_file_to_disk(HTTP_Engine& engine,
+                                                   string_cref url,
+                                                   string_cref destination,
+                                                   Download_Mode mode)
+{
+    auto promise = std::make_shared<std::promise<Download_Result>>();
+    auto future = promise->get_future();
+
+    if (fs::exists(destination))
+    {
+        promise->set_value(Download_Result::SKIPPED);
+        return future;
+    }
+
+    if (mode == Download_Mode::IN_MEMORY)
+    {
+        engine.submit(HTTP_Request{ .url = url },
+                      [promise, destination](optional<HTTP_Response> resp)
+        {
+            // not on the engine thread, the other transfers would wait on the disk
+            file_writer().post([promise, destination, resp = std::move(resp)]
+            {
+                promise->set_value(save_response_to_disk(resp, destination));
+            });
+        });
+
+        return future;
+    }
+
+    // memory used by a transfer is just curl's buffer plus the chunks queued for the writer
+    return submit_to_sink(engine, url, Download_Sink::to_file(destination));
+}
+
+
+std::future<Download_Result> download_media_to_disk(HTTP_Engine& engine,
+                                                    string_cref url,
+                                                    string_cref destination_stem,
+                                                    Content_Store* store)
+{
+    auto promise = std::make_shared<std::promise<Download_Result>>();
+    auto future = promise->get_future();
+
+    download_media_to_disk(engine, url, destination_stem, store,
+                           [promise](Download_Result result) { promise->set_value(result); });
+
+    return future;
+}
+
+void download_media_to_disk(HTTP_Engine& engine,
+                            string_cref url,
+                            string_cref destination_stem,
+                            Content_Store* store,
+                            Download_Done done)
+{
+    // the extension is not known yet, any of them means already downloaded
+    if (Utils::find_media_file(destination_stem).has_value())
+    {
+        done(Download_Result::SKIPPED);
+        return;
+    }
+
+    submit_to_sink(engine, url, Download_Sink::to_media_file(destination_stem, store), std::move(done));
+}
+
 
 optional<string> download_json_from_reddit(
     const string& subreddit,
@@ -172,7 +289,26 @@ optional<string> download_json_from_reddit(
         reddit_url << "&after=" << after;
     }
 
-    auto resp = perform_http_request(reddit_url.str());
+    optional<HTTP_Response> resp;
+
+    // a 429 should not happen thanks to the limiter, but if the budget
+    // is shared with someone else we wait for the reset and try again
+    for (int attempt = 0; attempt < 3; ++attempt)
+    {
+        rate_limiter().acquire("www.reddit.com");
+
+        resp = perform_http_request(reddit_url.str());
+
+        rate_limiter().update("www.reddit.com",
+                              resp.has_value() ? resp->code : -1,
+                              resp.has_value() ?
+                              Utils::parse_http_headers(resp->resp_headers) :
+                              std::map<string, string>{},
+                              Rate_Limiter::Clock::now());
+
+        if (not (resp.has_value() and resp->code == 429))
+            break;
+    }
 
     if (!resp.has_value())
         return {};
@@ -187,8 +323,141 @@ optional<string> download_json_from_reddit(
     return resp->body;
 }
 
-std::vector<string> get_url_from_imgur(string_cref subreddit,
-                                       string_cref orig_url)
+uint64_t estimated_video_size(long bitrate_kbps, long duration_seconds)
+{
+    if (bitrate_kbps <= 0 or duration_seconds <= 0)
+        return 0;
+
+    return static_cast<uint64_t>(bitrate_kbps) * 1000 / 8 * static_cast<uint64_t>(duration_seconds);
+}
+
+Post post_from_json(const njson& child)
+{
+    Post post;
+
+    if (not child.contains("data") or
+        not child["data"].is_object())
+        return post;
+
+    const auto& data = child["data"];
+
+    auto get_string = [](const njson& obj, const char* key) -> string
+    {
+        auto it = obj.find(key);
+        return (it != obj.end() and it->is_string()) ? it->get<string>() : string{};
+    };
+
+    post.id = get_string(data, "id");
+    post.title = get_string(data, "title");
+    post.domain = get_string(data, "domain");
+    post.url = get_string(data, "url");
+    post.subreddit = get_string(data, "subreddit");
+
+    if (auto it = data.find("ups"); it != data.end() and it->is_number())
+        post.ups = it->get<long>();
+
+    if (auto it = data.find("is_gallery"); it != data.end() and it->is_boolean())
+        post.is_gallery = it->get<bool>();
+
+    post.post_hint = get_string(data, "post_hint");
+
+    // njson keeps object keys sorted, the parts are numbered in media id order
+    if (post.is_gallery and
+        data.contains("media_metadata") and
+        data["media_metadata"].is_object())
+    {
+        const auto& media_metadata = data["media_metadata"];
+        post.gallery_urls.reserve(media_metadata.size());
+
+        for (const auto& media : media_metadata)
+        {
+            // items still processing or failed on reddit's side have no source
+            if (not media.contains("s") or not media["s"].is_object())
+                continue;
+
+            // animated items have no "u", their mp4 is the smaller one
+            string url = get_string(media["s"], "u");
+            string type = get_string(media, "m");
+
+            if (url == "")
+            {
+                url = get_string(media["s"], "mp4");
+                type = url != "" ? "video/mp4" : "image/gif";
+            }
+
+            if (url == "")
+                url = get_string(media["s"], "gif");
+
+            if (url != "")
+            {
+                post.gallery_urls.push_back(std::move(url));
+                post.gallery_types.push_back(std::move(type));
+            }
+        }
+    }
+
+    if (data.contains("secure_media") and
+        data["secure_media"].is_object() and
+        data["secure_media"].contains("reddit_video") and
+        data["secure_media"]["reddit_video"].is_object())
+    {
+        const auto& video = data["secure_media"]["reddit_video"];
+        post.video_url = get_string(video, "fallback_url");
+
+        if (video.contains("bitrate_kbps") and video["bitrate_kbps"].is_number() and
+            video.contains("duration") and video["duration"].is_number())
+        {
+            post.video_size = estimated_video_size(video["bitrate_kbps"].get<long>(),
+                                                   video["duration"].get<long>());
+        }
+    }
+
+    if (data.contains("preview") and data["preview"].is_object())
+    {
+        const auto& preview = data["preview"];
+
+        if (preview.contains("images") and
+            preview["images"].is_array() and
+            not preview["images"].empty() and
+            preview["images"][0].is_object() and
+            preview["images"][0].contains("source") and
+            preview["images"][0]["source"].is_object())
+        {
+            post.preview_url = get_string(preview["images"][0]["source"], "url");
+        }
+
+        if (preview.contains("reddit_video_preview") and
+            preview["reddit_video_preview"].is_object())
+        {
+            post.preview_video_url = get_string(preview["reddit_video_preview"], "fallback_url");
+        }
+    }
+
+    return post;
+}
+
+namespace
+{
+
+// what an api answered with something other than 200
+Resolution::Status status_of_http_error(long code)
+{
+    return code == 404 or code == 410 ?
+        Resolution::Status::GONE :
+        Resolution::Status::FAILED;
+}
+
+string string_or_empty(const njson& object, const char* key)
+{
+    if (not object.contains(key) or not object[key].is_string())
+        return {};
+
+    return object[key].get<string>();
+}
+
+}
+
+Resolution get_url_from_imgur(const Post& post)
 {
     // https://apidocs.imgur.com/#10456589-7167-4b5c-acd3-a1e4eb6a95ed
     // api endpoint:
@@ -196,15 +465,15 @@ std::vector<string> get_url_from_imgur(string_cref subreddit,
 
     try
     {
-        string image_id = Utils::extract_image_id_from_url(orig_url);
+        string image_id = Utils::extract_image_id_from_url(post.url);
 
-        string api_endpoint = "https://api.imgur.com/3/gallery/r/" + subreddit + "/" + image_id;
+        string api_endpoint = "https://api.imgur.com/3/gallery/r/" + post.subreddit + "/" + image_id;
 
-        auto imgur_client_id = Utils::env("IMGUR_CLIENT_ID");
+        string_cref imgur_client_id = config().imgur_client_id;
 
         if (imgur_client_id == "")
         {
-            cout << "[WARN] no client id for imgur inside file .env" << endl;
+            cout << "[WARN] no client id for imgur, IMGUR_CLIENT_ID is not set" << endl;
             return {};
         }
 
@@ -216,7 +485,7 @@ std::vector<string> get_url_from_imgur(string_cref subreddit,
             return {};
 
         if (resp->code != 200)
-            return {};
+            return { .status = status_of_http_error(resp->code) };
 
         njson json = njson::parse(resp->body);
 
@@ -224,11 +493,13 @@ std::vector<string> get_url_from_imgur(string_cref subreddit,
         {
             cout << "[ERROR] json returned from imgur.com contains an error, status: "
                 << json["status"] << endl;
-            return {};
+            return { .status = json["status"] == 404 ?
+                     Resolution::Status::GONE :
+                     Resolution::Status::FAILED };
         }
 
-        std::vector<string> urls;
-        urls.reserve(20); // feels like 20 is a good number
+        Resolution res{ .status = Resolution::Status::RESOLVED };
+        res.media.reserve(20); // feels like 20 is a good number
 
         if (json["data"].contains("images"))
         {
@@ -236,15 +507,20 @@ std::vector<string> get_url_from_imgur(string_cref subreddit,
 
             for (const auto& image : images)
             {
-                urls.push_back(image["link"].get_ref<string_cref>());
+                res.media.push_back({ .url = image["link"].get_ref<string_cref>(),
+                                      .content_type = string_or_empty(image, "type") });
             }
         }
         else
         {
-            urls.push_back(json["data"]["link"].get_ref<string_cref>());
+            res.media.push_back({ .url = json["data"]["link"].get_ref<string_cref>(),
+                                  .content_type = string_or_empty(json["data"], "type") });
         }
 
-        return urls;
+        if (res.media.empty())
+            res.status = Resolution::Status::GONE;
+
+        return res;
     }
     catch (const njson::parse_error& e)
     {
@@ -253,14 +529,14 @@ std::vector<string> get_url_from_imgur(string_cref subreddit,
     }
 }
 
-string get_url_from_gfycat(string_cref orig_url)
+Resolution get_url_from_gfycat(const Post& post)
 {
     // https://developers.gfycat.com/api/?curl#getting-info-for-a-single-gfycat
     // example: https://api.gfycat.com/v1/gfycats/JampackedUnrulyArcherfish
 
     try
     {
-        string image_id = Utils::extract_image_id_from_url(orig_url);
+        string image_id = Utils::extract_image_id_from_url(post.url);
 
         if (image_id.find_first_of('-') != string::npos)
         {
@@ -276,34 +552,28 @@ string get_url_from_gfycat(string_cref orig_url)
             return {};
 
         if (resp->code != 200)
-            return {};
+            return { .status = status_of_http_error(resp->code) };
 
         njson json;
         json = njson::parse(resp->body);
 
+        const Resolution gone{ .status = Resolution::Status::GONE };
 
         if (not json.contains("gfyItem"))
-            return {};
+            return gone;
 
         if (json.contains("errorMessage"))
-            return {};
+            return gone;
 
-        string* actual_url = nullptr;
+        const auto& item = json["gfyItem"];
 
-        if (json["gfyItem"].contains("url"))
-        {
-            actual_url = json["gfyItem"]["url"].get_ptr<string*>();
-        }
-        else if (json["gfyItem"].contains("mp4Url"))
-        {
-            actual_url = json["gfyItem"]["mp4Url"].get_ptr<string*>();
-        }
-        else
-        {
-            return {};
-        }
+        if (auto url = string_or_empty(item, "url"); url != "")
+            return { .status = Resolution::Status::RESOLVED, .media = { { .url = url } } };
+
+        if (auto url = string_or_empty(item, "mp4Url"); url != "")
+            return { .status = Resolution::Status::RESOLVED, .media = { { .url = url, .content_type = "video/mp4" } } };
 
-        return actual_url ? *actual_url : "";
+        return gone;
     }
     catch (const njson::parse_error& e)
     {
@@ -312,190 +582,405 @@ string get_url_from_gfycat(string_cref orig_url)
     }
 }
 
-string get_url_from_vreddit(const njson& child)
+string get_url_from_vreddit(const Post& post)
 {
-    try
+    // empty when the listing had no fallback_url, adiossssssss
+    return post.video_url;
+}
+
+std::vector<string> get_url_from_reddit_gallery(const Post& post)
+{
+    return post.gallery_urls;
+}
+
+namespace
+{
+
+// what is left of a post once it is resolved, one entry per part
+struct Post_Downloads
+{
+    string title;
+    vector<string> urls;
+    vector<Media_Item> items;
+    vector<bool> done; // parts the journal knows as done, not downloaded again
+};
+
+// everything download_media() does before the first download: a result when
+// the post is over already, `downloads` is filled otherwise
+optional<Thread_Result> start_post(Download_Index& index,
+                                   Download_Journal& journal,
+                                   long file_id,
+                                   const Post& post,
+                                   Post_Downloads& downloads)
+{
+    char title_buffer[g_TITLE_MAX_LEN_LIMIT * 4];
+    auto title_info = Utils::make_file_name(post.title, config().title_max_len, title_buffer);
+    string title(title_buffer, title_info.size);
+
+    const auto& orig_url = post.url;
+
+    // before any api call or request
+    if (index.contains(post))
     {
-        auto& video_url = child["data"]["secure_media"]
-            ["reddit_video"]["fallback_url"].get_ref<string_cref>();
+        return Thread_Result{
+            .file_id = file_id,
+            .title = title,
+            .url = orig_url,
+            .download_res = {Download_Result::SKIPPED}
+        };
+    }
 
-        return video_url;
+    // finished by a run that crashed before after.txt moved past its page
+    if (auto finished = journal.finished(post.id); finished.has_value())
+    {
+        return Thread_Result{
+            .file_id = file_id,
+            .title = title,
+            .url = orig_url,
+            .download_res = {*finished == Download_Result::UNABLE ?
+                             Download_Result::UNABLE :
+                             Download_Result::SKIPPED}
+        };
     }
-    catch (...)
+
+    auto unable = [&](string_cref reason) -> Thread_Result
     {
-        // unable to grab the fallback_url, adiossssssss
-        return {};
+        journal.record_post(post.id, Download_Result::UNABLE, reason);
+
+        return {
+            .file_id = file_id,
+            .title = title,
+            .url = orig_url,
+            .download_res = {Download_Result::UNABLE}
+        };
+    };
+
+    if (post.ups < config().min_upvotes)
+    {
+        return Thread_Result{
+            .file_id = file_id,
+            .title = title,
+            .url = orig_url,
+            .download_res = {Download_Result::SKIPPED}
+        };
     }
-}
 
-std::vector<string> get_url_from_reddit_gallery(const njson& child)
-{
-    std::vector<string> res;
+    // views into post.url, only read below
+    auto url = parse_url(orig_url).value_or(Url_View{});
+    std::string_view domain = domain_of(post, url);
+
+    const Resolver& resolver = resolver_for(domain);
+    Resolution resolution = resolve(resolver, post, url);
 
-    for (const auto& id : child["data"]["media_metadata"])
+    // not journaled as UNABLE: the next run asks again
+    if (resolution.status == Resolution::Status::FAILED)
     {
-        auto& url = id["s"]["u"].get_ref<string_cref>();
-        res.push_back(url);
+        journal.record_post(post.id, Download_Result::FAILED,
+                            std::format("no answer from the {} api", resolver.name));
+        return Thread_Result{
+            .file_id = file_id,
+            .title = title,
+            .url = orig_url,
+            .download_res = {Download_Result::FAILED}
+        };
+    }
+
+    auto& urls = downloads.urls;
+    urls.reserve(resolution.media.size());
+
+    for (auto& media : resolution.media)
+        urls.push_back(std::move(media.url));
+
+    if (urls.size() == 0)
+    {
+        return unable(resolution.reason != "" ?
+                      resolution.reason :
+                      std::format("no media url found for {}", domain));
+    }
+
+    // two posts with the same title get two files, the second one
+    // carries its id. Files found on disk under a name nobody claimed
+    // predate the index and are still taken as this post's
+    string file_name = title;
+
+    if (not index.claim_name(file_name, post.id))
+    {
+        file_name = std::format("{}_{}", title, post.id);
+        index.claim_name(file_name, post.id);
     }
 
-    return res;
+    // numbered here, in the order of urls, whoever downloads them
+    downloads.items.reserve(urls.size());
+    downloads.done.reserve(urls.size());
+
+    for (size_t i = 0; i < urls.size(); ++i)
+    {
+        Media_Item item{ .post_id = post.id,
+                         .name = file_name,
+                         .expected_size = resolution.media[i].expected_size };
+
+        if (urls.size() > 1)
+        {
+            item.part = i + 1;
+            item.name = std::format("{}_p{:04}", file_name, item.part);
+        }
+
+        downloads.items.push_back(std::move(item));
+        downloads.done.push_back(urls.size() > 1 and journal.part_done(post.id, i + 1));
+    }
+
+    downloads.title = std::move(title);
+    return {};
 }
 
-Thread_Result download_media(long file_id,
-                             const njson& child,
-                             const string& dest_folder)
+// reposts that were re-encoded or resized, on the worker thread so
+// decoding never holds up the transfers
+Download_Result check_near_duplicate(Media_Storage& storage,
+                                     const Media_Item& item,
+                                     Download_Result result)
 {
-    try
+    auto& near_duplicates = near_duplicate_filter();
+
+    if (result != Download_Result::DOWNLOADED or
+        near_duplicates.action() == Near_Duplicate_Action::OFF)
+        return result;
+
+    if (auto file = storage.file(item); file.has_value())
+        return near_duplicates.check(*file);
+
+    return result;
+}
+
+// index, journal and result of a post once every part is over
+Thread_Result finish_post(Download_Index& index,
+                          Download_Journal& journal,
+                          long file_id,
+                          const Post& post,
+                          const Post_Downloads& downloads,
+                          vector<Download_Result> download_result)
+{
+    bool complete = std::all_of(download_result.begin(), download_result.end(),
+                                [](Download_Result res)
     {
-        const auto& data = child["data"];
+        return res == Download_Result::DOWNLOADED or
+            res == Download_Result::SKIPPED;
+    });
 
-        auto title = Utils::remove_invalid_charaters(
-            data["title"].get_ref<str_cref>());
+    if (complete)
+        index.add(post);
 
-        if (Utils::UTF8_len(title) > g_TITLE_MAX_LEN)
-            Utils::resize_string(title, g_TITLE_MAX_LEN);
+    // the parts of a gallery one by one, a retry only downloads what failed
+    size_t failed = 0;
 
-        const auto& orig_url = data["url"].get_ref<string_cref>();
+    for (size_t i = 0; i < download_result.size(); ++i)
+    {
+        if (download_result[i] == Download_Result::FAILED)
+            ++failed;
 
-#if 0
-        unsigned upvote = data["ups"].get<unsigned>();
-        if (upvote < g_upvote_threshold)
+        if (download_result.size() > 1)
         {
-            return {
-                .file_id = file_id,
-                .title = title,
-                .url = orig_url,
-                .download_res = Download_Result::SKIPPED,
-            };
+            journal.record_part(post.id, i + 1, download_result[i],
+                                download_result[i] == Download_Result::FAILED ? downloads.urls[i] : "");
         }
-#endif // 0
+    }
 
-        string_cref domain = data["domain"].get_ref<str_cref>();
+    if (complete)
+        journal.record_post(post.id, Download_Result::DOWNLOADED);
+    else if (failed == 0)
+        journal.record_post(post.id, Download_Result::UNABLE, "no part could be downloaded");
+    else
+        journal.record_post(post.id, Download_Result::FAILED,
+                            std::format("{} of {} parts failed", failed, download_result.size()));
+
+    return {
+        .file_id = file_id,
+        .title = downloads.title,
+        .url = post.url,
+        .download_res = std::move(download_result)
+    };
+}
 
-        vector<string> urls;
+Thread_Result post_failed(Download_Journal& journal, const Post& post, const std::exception& e)
+{
+    cout << std::format("[EXCEP][download_media()] {} url: {}",
+                        e.what(), post.url)
+        << endl;
+
+    journal.record_post(post.id, Download_Result::FAILED, e.what());
+    return {};
+}
 
-        if (domain == "v.redd.it")
+// the parts of a post spread over the pool, the last one to finish
+// reports the whole post
+struct Fan_Out
+{
+    Post_Downloads downloads;
+    vector<Download_Result> results;
+    std::atomic<size_t> remaining = 0;
+};
+
+// part `i` of a post, from a task of `pool`. The transfer is started and
+// the task returns: what follows it, the near duplicate check and for the
+// last part the report of the post, is resumed on the pool by the engine
+optional<Thread_Result> download_part(HTTP_Engine& engine,
+                                      Download_Index& index,
+                                      Download_Journal& journal,
+                                      Media_Storage& storage,
+                                      long file_id,
+                                      const Post& post,
+                                      Download_Pool& pool,
+                                      const std::shared_ptr<Fan_Out>& fan_out,
+                                      size_t i)
+{
+    auto finish_part = [&index, &journal, &storage, file_id, &post, fan_out, i]
+                       (Download_Result result) -> optional<Thread_Result>
+    {
+        auto& parts = fan_out->downloads;
+
+        try
         {
-            urls.push_back(get_url_from_vreddit(child));
+            fan_out->results[i] = check_near_duplicate(storage, parts.items[i], result);
         }
-        else if (domain == "imgur.com" or
-                 domain == "i.imgur.com")
+        catch (const std::exception& e)
         {
-            string_cref subreddit = data["subreddit"].get_ref<str_cref>();
-
-            urls = get_url_from_imgur(subreddit, orig_url);
+            cout << std::format("[EXCEP][download_media()] {} url: {}", e.what(), parts.urls[i]) << endl;
         }
-        else if (domain == "gfycat.com")
+
+        // every other part is over, their results are visible
+        if (--fan_out->remaining != 0)
+            return {};
+
+        try
         {
-            urls.push_back(get_url_from_gfycat(orig_url));
+            return finish_post(index, journal, file_id, post, parts, std::move(fan_out->results));
         }
-        else if (domain == "reddit.com")
+        catch (const std::exception& e)
         {
-            if (data.contains("is_gallery") and
-                data["is_gallery"].get<bool>() == true)
-            {
-                urls = get_url_from_reddit_gallery(child);
-            }
-            else if (Utils::extract_file_extension_from_url(orig_url) != "")
-            {
-                urls.push_back(orig_url);
-            }
-            else
-            {
-                return {
-                    .file_id = file_id,
-                    .title = title,
-                    .url = orig_url,
-                    .download_res = {Download_Result::UNABLE}
-                };
-            }
+            auto res = post_failed(journal, post, e);
+            res.file_id = file_id;
+            return res;
         }
-        else // unknown domain
+    };
+
+    auto& parts = fan_out->downloads;
+
+    if (parts.done[i])
+        return finish_part(Download_Result::SKIPPED);
+
+    auto hold = pool.hold();
+
+    try
+    {
+        storage.download(engine, parts.urls[i], parts.items[i],
+                         [&pool, hold, finish_part](Download_Result result)
         {
-            // try direct download if url has extension
-            if (Utils::extract_file_extension_from_url(orig_url) != "")
-            {
-                urls.push_back(orig_url);
-            }
+            pool.resume(hold, [finish_part, result] { return finish_part(result); });
+        });
+    }
+    catch (const std::exception& e)
+    {
+        cout << std::format("[EXCEP][download_media()] {} url: {}", e.what(), parts.urls[i]) << endl;
+        pool.resume(hold, [finish_part] { return finish_part(Download_Result::FAILED); });
+    }
+
+    // reported by the resumed task
+    return {};
+}
+
+}
+
+Thread_Result download_media(HTTP_Engine& engine,
+                             Download_Index& index,
+                             Download_Journal& journal,
+                             Media_Storage& storage,
+                             long file_id,
+                             const Post& post)
+{
+    try
+    {
+        Post_Downloads downloads;
+
+        if (auto over = start_post(index, journal, file_id, post, downloads); over.has_value())
+            return std::move(*over);
+
+        // every part is a single GET, all of them in flight at once,
+        // one future per part so results keep the order of urls
+        vector<std::future<Download_Result>> parts;
+        parts.reserve(downloads.urls.size());
+
+        for (size_t i = 0; i < downloads.urls.size(); ++i)
+        {
+            if (downloads.done[i])
+                parts.push_back(ready_result(Download_Result::SKIPPED));
             else
-            {
-                // unknown domain and no extension, no good
-                return {
-                    .file_id = file_id,
-                    .title = title,
-                    .url = orig_url,
-                    .download_res = {Download_Result::UNABLE}
-                };
-            }
+                parts.push_back(storage.download(engine, downloads.urls[i], downloads.items[i]));
         }
 
         vector<Download_Result> download_result;
+        download_result.reserve(parts.size());
 
-        if (urls.size() == 0)
-            return {
-                .file_id = file_id,
-                .title = title,
-                .url = orig_url,
-                .download_res = {Download_Result::UNABLE}
-            };
+        for (size_t i = 0; i < parts.size(); ++i)
+            download_result.push_back(check_near_duplicate(storage, downloads.items[i], parts[i].get()));
 
-        unsigned part = 1;
-        for (const auto& url : urls)
-        {
-            auto resp = request_headers_only(url);
-
-            if (not resp.has_value())
-                return {
-                    .file_id = file_id,
-                    .title = title,
-                    .url = orig_url,
-                    .download_res = {Download_Result::FAILED}
-                };
-
-            auto split_content_type = Utils::split_string(resp->content_type, "/");
-            // TODO: big ass assumption that Utils::split_string return al least 2 values here
-            auto& type = split_content_type[0];
-            auto& extension = split_content_type[1];
-
-            if (not (type == "video" or
-                     type == "image"))
-            {
-                download_result.push_back(Download_Result::UNABLE);
-                continue;
-            }
+        return finish_post(index, journal, file_id, post, downloads, std::move(download_result));
+    }
+    catch (const std::exception& e)
+    {
+        return post_failed(journal, post, e);
+    }
+}
+
+optional<Thread_Result> download_media(HTTP_Engine& engine,
+                                       Download_Index& index,
+                                       Download_Journal& journal,
+                                       Media_Storage& storage,
+                                       long file_id,
+                                       const Post& post,
+                                       Download_Pool& pool)
+{
+    try
+    {
+        auto fan_out = std::make_shared<Fan_Out>();
+        auto& downloads = fan_out->downloads;
 
-            string destination = std::format("{}\\{}", dest_folder, title);
+        if (auto over = start_post(index, journal, file_id, post, downloads); over.has_value())
+            return over;
 
-            if (urls.size() > 1)
-                destination = std::format("{}_p{:04}.{}", destination, part++, extension);
-            else
-                destination = std::format("{}.{}", destination, extension);
+        const size_t count = downloads.urls.size();
 
-            download_result.push_back(download_file_to_disk(url, destination));
-        }
+        fan_out->results.resize(count, Download_Result::FAILED);
+        fan_out->remaining = count;
 
-        return {
-            .file_id = file_id,
-            .title = title,
-            .url = orig_url,
-            .download_res = download_result
-        };
+        // a single file from this task, no other task to hand it to
+        if (count == 1)
+            return download_part(engine, index, journal, storage, file_id, post, pool, fan_out, 0);
 
+        for (size_t i = 0; i < count; ++i)
+        {
+            // the host of the part, i.redd.it for a gallery of reddit.com
+            auto part_url = parse_url(downloads.urls[i]).value_or(Url_View{});
+            string host = host_key_for_domain(string(part_url.host));
+
+            pool.submit([&engine, &index, &journal, &storage, file_id, &post, &pool, fan_out, i]
+            {
+                return download_part(engine, index, journal, storage, file_id, post, pool, fan_out, i);
+            }, host);
+        }
+
+        // reported by the last part
+        return {};
     }
     catch (const std::exception& e)
     {
-        cout << std::format("[EXCEP][download_media()] {} url: {}",
-                            e.what(), child["data"]["url"].get_ref<str_cref>())
-            << endl;
-        return {};
+        return post_failed(journal, post, e);
     }
-
 }
 
 // reddit image downloader
 int rid(const string& subreddit,
         const string& when,
-        const string& dest_folder)
+        const string& dest_folder,
+        Output_Mode output)
 {
     try
     {
@@ -512,6 +997,49 @@ int rid(const string& subreddit,
             }
         }
 
+        // a listing page stays alive until all of its posts are done,
+        // the tasks of the pool read straight from its posts
+        struct Page_In_Flight
+        {
+            Listing_Page page;
+            long first_file_id = 0;
+            long last_file_id = 0;
+            size_t outstanding = 0;
+        };
+
+        HTTP_Engine engine(config().max_transfers);
+        Download_Index index(fs::path(dest_folder) / "download_index.bin");
+        Download_Journal journal(fs::path(dest_folder) / "journal.txt");
+
+        std::unique_ptr<Media_Storage> storage;
+        Pack_Storage* pack = nullptr;
+
+        if (output == Output_Mode::PACK)
+        {
+            auto pack_storage = std::make_unique<Pack_Storage>(fs::path(dest_folder) / "pack",
+                                                               content_store().mode(),
+                                                               g_PACK_SEGMENT_SIZE,
+                                                               false,
+                                                               &memory_budget());
+            if (not pack_storage->is_open())
+                return 1;
+
+            pack = pack_storage.get();
+            storage = std::move(pack_storage);
+        }
+        else
+        {
+            storage = std::make_unique<File_Storage>(dest_folder, &content_store(), &memory_budget());
+        }
+        std::deque<Page_In_Flight> pages; // oldest first, must outlive the pool
+        Download_Pool pool(config().workers, [](string_cref host)
+        {
+            return config().host_limit(host);
+        });
+
+        // pages N+1 and N+2 are downloaded and parsed while N downloads
+        Listing_Prefetcher prefetcher(subreddit, when, after, dest_folder);
+
         long files_processed = 0;
 
         unsigned downloaded = 0;
@@ -519,127 +1047,194 @@ int rid(const string& subreddit,
         unsigned skipped = 0;
         unsigned unable = 0;
 
-        while (true)
-        {
-            auto resp = download_json_from_reddit(subreddit,
-                                                  when,
-                                                  after);
+        bool listing_over = false;
+        bool all_done = false;
 
-            if (not resp.has_value())
+        // after.txt only moves past a page once it and every page
+        // before it are completely downloaded
+        auto commit_completed_pages = [&]
+        {
+            while (not pages.empty() and
+                   pages.front().outstanding == 0)
             {
-                cout << "[WARN] Cannot download json from subreddit /r/" << subreddit << endl;
-                break;
+                const auto& next_after = pages.front().page.next_after;
+
+                if (not next_after.has_value())
+                    all_done = true;
+                else
+                    Utils::save_after_to_file(dest_folder, *next_after);
+
+                pages.pop_front();
             }
+        };
 
-#if 1
-            // save json to disk for debugging purposes 
+        while (true)
+        {
+            // queue the next page as well, the pool never runs dry at page boundaries
+            while (not listing_over and pages.size() < 2)
             {
-                std::ofstream out(dest_folder + "/!#_" + subreddit
-                                  + "_" + when + "_" + after + ".json",
-                                  std::ofstream::trunc |
-                                  std::ofstream::binary);
+                auto page = prefetcher.next();
 
-                if (out.is_open())
+                if (not page.has_value())
                 {
-                    out << *resp;
+                    listing_over = true;
+                    break;
                 }
-            }
-#endif 
 
-            njson json = njson::parse(*resp);
+                auto& in_flight = pages.emplace_back(Page_In_Flight{ .page = std::move(*page) });
 
-            if (not (json.contains("data") and
-                json["data"].contains("children")))
-            {
-                throw std::runtime_error("Unexpected json content... 😳");
+                const auto& posts = in_flight.page.posts;
+
+                in_flight.first_file_id = files_processed + 1;
+                in_flight.outstanding = posts.size();
+
+                // newest posts last, same order as before. Posts the listing
+                // describes go first, the ones an api has to be asked for after them
+                for (bool network : { false, true })
+                {
+                    for (size_t i = posts.size(); i > 0; --i)
+                    {
+                        const auto& post = posts[i - 1];
+                        auto file_id = in_flight.first_file_id + static_cast<long>(posts.size() - i);
+
+                        auto url = parse_url(post.url).value_or(Url_View{});
+
+                        if (needs_network(resolver_for(domain_of(post, url)), post, url) != network)
+                            continue;
+
+                        // same key download_media() dispatches on
+                        string host = host_key_for_domain(post.domain);
+
+                        pool.submit([&engine,
+                                    &index,
+                                    &journal,
+                                    &storage = *storage,
+                                    &pool,
+                                    file_id,
+                                    &post]
+                        {
+                            auto res = download_media(engine, index, journal, storage, file_id, post, pool);
+                            if (res.has_value())
+                                res->file_id = file_id; // download_media() returns {} on exceptions
+                            return res;
+                        }, host);
+                    }
+                }
+
+                files_processed += static_cast<long>(posts.size());
+                in_flight.last_file_id = files_processed;
+
+                commit_completed_pages(); // a page without posts
             }
 
-            vector_cref children = json["data"]["children"].get_ref<vector_cref>();
+            if (pages.empty())
+                break;
+
+            // print thread results as soon as they are completed
+            auto thread_res = pool.wait_result();
 
-            auto files_to_download = children.size();
-            //cout << "[INFO] Downlaoading " << file_to_download << " files" << endl;
+            if (not thread_res.has_value())
+                break;
 
-            while (files_to_download > 0)
+            for (auto& in_flight : pages)
             {
-                std::array<std::future<Thread_Result>, g_num_threads> threads;
+                if (thread_res->file_id >= in_flight.first_file_id and
+                    thread_res->file_id <= in_flight.last_file_id)
+                {
+                    --in_flight.outstanding;
+                    break;
+                }
+            }
+
+            char short_title_buffer[g_PRINT_MAX_LEN * 4];
+            auto short_title_info = Utils::make_file_name(thread_res->title, g_PRINT_MAX_LEN, short_title_buffer);
+            std::string_view short_title(short_title_buffer, short_title_info.size);
 
-                // spawn threads for media downloading
-                for (size_t i = 0;
-                     i < g_num_threads and
-                     files_to_download > 0;
-                     ++i)
+            // one url can have multiple images associated 
+            // for example an url that points to a gallery
+            for (const auto& download_res : thread_res->download_res)
+            {
+                switch (download_res)
                 {
-                    ++files_processed;
-                    auto future = std::async(std::launch::async,
-                                             download_media,
-                                             files_processed,
-                                             std::ref(children[files_to_download - 1]),
-                                             std::ref(dest_folder));
-
-                    threads[i] = std::move(future);
-                    --files_to_download;
+                case Download_Result::DOWNLOADED: ++downloaded; break;
+                case Download_Result::FAILED: ++failed; break;
+                case Download_Result::SKIPPED: ++skipped; break;
+                case Download_Result::UNABLE: ++unable; break;
+                default: break;
                 }
 
-                // print thread results
-                for (auto& thread : threads)
+                if (download_res == Download_Result::DOWNLOADED or
+                    download_res == Download_Result::SKIPPED)
                 {
-                    if (thread.valid())
-                    {
-                        auto thread_res = thread.get(); // blocking, calls wait()
+                    cout << std::format("[{:04}] {:<{}.{}} -> {}",
+                                        thread_res->file_id,
+                                        short_title, g_PRINT_MAX_LEN, g_PRINT_MAX_LEN,
+                                        Utils::to_str(download_res)) << endl;
+                }
+                else
+                {
+                    cout << std::format("[{:04}] {:<{}.{}} -> {} url: '{}'",
+                                        thread_res->file_id,
+                                        short_title, g_PRINT_MAX_LEN, g_PRINT_MAX_LEN,
+                                        Utils::to_str(download_res),
+                                        thread_res->url) << endl;
+                }
+            }
 
-                        string short_title = thread_res.title;
-                        if (Utils::UTF8_len(short_title) > g_PRINT_MAX_LEN)
-                            Utils::resize_string(short_title, g_PRINT_MAX_LEN);
+            commit_completed_pages();
+        }
 
-                        // one url can have multiple images associated 
-                        // for example an url that points to a gallery
-                        for (const auto& download_res : thread_res.download_res)
-                        {
-                            switch (download_res)
-                            {
-                            case Download_Result::DOWNLOADED: ++downloaded; break;
-                            case Download_Result::FAILED: ++failed; break;
-                            case Download_Result::SKIPPED: ++skipped; break;
-                            case Download_Result::UNABLE: ++unable; break;
-                            default: break;
-                            }
-
-                            if (download_res == Download_Result::DOWNLOADED or
-                                download_res == Download_Result::SKIPPED)
-                            {
-                                cout << std::format("[{:04}] {:<{}.{}} -> {}",
-                                                    thread_res.file_id,
-                                                    short_title, g_PRINT_MAX_LEN, g_PRINT_MAX_LEN,
-                                                    Utils::to_str(download_res)) << endl;
-                            }
-                            else
-                            {
-                                cout << std::format("[{:04}] {:<{}.{}} -> {} url: '{}'",
-                                                    thread_res.file_id,
-                                                    short_title, g_PRINT_MAX_LEN, g_PRINT_MAX_LEN,
-                                                    Utils::to_str(download_res),
-                                                    thread_res.url) << endl;
-                            }
-                        }
-                    }
-                }
+        if (all_done)
+        {
+            // nothing left do do, we downloaded everything
+            cout << "All done!" << endl;
+            cout << "Downloaded: " << downloaded << endl;
+            cout << "Skipped: " << skipped<< endl;
+            cout << "Unable: " << unable << endl;
+            cout << "Failed: " << failed << endl;
+
+            auto stats = http_stats();
+            cout << std::format("Requests: {} connection reuse: {:.1f}%",
+                                stats.requests, stats.reuse_ratio() * 100.0) << endl;
+
+            if (pack != nullptr)
+            {
+                cout << std::format("Packed: {} (deduplicated: {})",
+                                    pack->items_packed(),
+                                    pack->items_deduplicated()) << endl;
+            }
+            else if (content_store().is_open())
+            {
+                cout << std::format("Deduplicated: {} ({:.1f} MB saved)",
+                                    content_store().files_deduplicated(),
+                                    content_store().bytes_saved() / (1024.0 * 1024.0)) << endl;
             }
 
-            if (json["data"]["after"].is_null())
+            if (near_duplicate_filter().action() != Near_Duplicate_Action::OFF)
+                cout << "Near duplicates: " << near_duplicate_filter().near_duplicates() << endl;
+
+            auto memory = memory_budget().stats();
+            cout << std::format("Memory: peak {:.1f} MB, budget {}, {} waits, {} spooled to disk",
+                                memory.peak / (1024.0 * 1024.0),
+                                memory.limit > 0 ? std::format("{} MB", memory.limit / (1024 * 1024)) : "none",
+                                memory.waits,
+                                memory.spills) << endl;
+
+            auto resolved = resolver_stats();
+            cout << std::format("Resolved from the listing: {} of {} posts ({:.1f}%)",
+                                resolved.from_listing,
+                                resolved.from_listing + resolved.from_api,
+                                resolved.offline_ratio() * 100.0) << endl;
+
+            if (resolver_cache().hits() + resolver_cache().misses() > 0)
             {
-                // nothing left do do, we downloaded everything
-                cout << "All done!" << endl;
-                cout << "Downloaded: " << downloaded << endl;
-                cout << "Skipped: " << skipped<< endl;
-                cout << "Unable: " << unable << endl;
-                cout << "Failed: " << failed << endl;
-
-                fs::remove(dest_folder + "/after.txt");
-                break;
+                cout << std::format("Api lookups: {} from cache, {} asked",
+                                    resolver_cache().hits(),
+                                    resolver_cache().misses()) << endl;
             }
 
-            after = json["data"]["after"].get<string>();
-            Utils::save_after_to_file(dest_folder, after);
+            fs::remove(dest_folder + "/after.txt");
+            journal.discard();
         }
 
         return 0;
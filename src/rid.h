@@ -2,12 +2,20 @@
 
 auto constexpr g_TITLE_MAX_LEN = 70;
 auto constexpr g_PRINT_MAX_LEN = 50;
-auto constexpr g_upvote_threshold = 1000;
 #ifdef _DEBUG
 auto constexpr g_num_threads{ 1 }; // num threads
 #else
 auto constexpr g_num_threads{ 10 }; // num threads
 #endif
+auto constexpr g_max_transfers{ 256 }; // concurrent transfers inside HTTP_Engine
+auto constexpr g_USER_AGENT = "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/101.0.4951.64 Safari/537.36";
+
+class HTTP_Engine;
+class Download_Index;
+class Download_Journal;
+class Content_Store;
+class Media_Storage;
+class Download_Pool;
 
 struct HTTP_Response
 {
@@ -15,6 +23,7 @@ struct HTTP_Response
     long code = -1;
     string content_type = "???";
     string resp_headers = "???";
+    long num_connects = -1; // new connections opened for this request, 0 means reused
 };
 
 enum class Download_Result : uint8_t
@@ -26,6 +35,77 @@ enum class Download_Result : uint8_t
     UNABLE // don't know how to download url
 };
 
+// the result of a download, called exactly once when it is over
+using Download_Done = std::function<void(Download_Result)>;
+
+struct Media_Type
+{
+    string type; // "image" or "video"
+    string extension; // "jpg", "png", "mp4", ..., one of known_media_extensions()
+};
+
+// how rid() stores what it downloads, see Media_Storage
+enum class Output_Mode : uint8_t
+{
+    FILES, // one file per image in the destination folder
+    PACK // appended to big pack files in "<destination>/pack"
+};
+
+enum class Download_Mode : uint8_t
+{
+    IN_MEMORY, // whole body in HTTP_Response::body, then written to disk
+    STREAM // every chunk goes to "<destination>.part" as it arrives, resumable
+};
+
+// what download_media() needs from a post of the listing, extracted once per
+// page so the json of the page can be released as soon as it is parsed
+struct Post
+{
+    string id;
+    string title;
+    string domain;
+    string url;
+    string subreddit;
+    long ups = 0;
+    bool is_gallery = false;
+    vector<string> gallery_urls; // ordered by media id, like media_metadata
+    vector<string> gallery_types; // media_metadata[].m of each url, "video/mp4" for animated ones
+    string video_url; // secure_media.reddit_video.fallback_url
+    uint64_t video_size = 0; // bitrate_kbps * duration of reddit_video, an estimate, 0 when unknown
+    string post_hint; // "image", "hosted:video", "link", ...
+    string preview_url; // preview.images[0].source.url, reddit's copy of the image
+    string preview_video_url; // preview.reddit_video_preview.fallback_url, gifs as mp4
+
+    bool operator==(const Post&) const = default;
+};
+
+// a media url found by a resolver, and its type when the host told it
+struct Media_Link
+{
+    string url;
+    string content_type; // "image/jpeg", "" when not known
+    uint64_t expected_size = 0; // bytes, from the listing, 0 when not known
+
+    bool operator==(const Media_Link&) const = default;
+};
+
+// what a resolver found behind the url of a post, see resolver.h
+struct Resolution
+{
+    enum class Status : uint8_t
+    {
+        RESOLVED,
+        GONE, // the host answered: deleted, not found, nothing to download
+        FAILED // no answer, throttled, server error: worth another try
+    };
+
+    Status status = Status::FAILED;
+    vector<Media_Link> media;
+    string reason; // why there is nothing, for the journal, not cached
+
+    bool operator==(const Resolution&) const = default;
+};
+
 struct Thread_Result
 {
     long file_id = -1;
@@ -50,29 +130,89 @@ optional<string> download_json_from_reddit(
     unsigned limit = 100);
 
 
-Download_Result download_file_to_disk(
-    string_cref url,
+Download_Result save_response_to_disk(
+    const optional<HTTP_Response>& resp,
     string_cref destination);
 
-std::vector<string> get_url_from_imgur(
-    string_cref subreddit,
-    string_cref url);
+// the body is fetched by the engine and written from its thread
+std::future<Download_Result> download_file_to_disk(
+    HTTP_Engine& engine,
+    string_cref url,
+    string_cref destination,
+    Download_Mode mode = Download_Mode::STREAM);
+
+// missing or mistyped fields are left empty, the post then ends up UNABLE
+Post post_from_json(
+    const njson& child);
+
+// bytes of a reddit_video from its bitrate and duration, 0 when either is not positive
+uint64_t estimated_video_size(
+    long bitrate_kbps,
+    long duration_seconds);
+
+Resolution get_url_from_imgur(
+    const Post& post);
 
-string get_url_from_gfycat(
-    string_cref url);
+Resolution get_url_from_gfycat(
+    const Post& post);
 
 string get_url_from_vreddit(
-    const njson& child);
+    const Post& post);
 
 std::vector<string> get_url_from_reddit_gallery(
-    const njson& child);
+    const Post& post);
+
+// single GET, no HEAD preflight: the type comes from the Content-Type header
+// or, when that is missing or generic, from the magic bytes of the body.
+// Anything that is not an image or a video is aborted after the first chunk.
+// The file is saved as "<destination_stem>.<extension>", through a resumable
+// "<destination_stem>.part" like Download_Mode::STREAM
+// With a store the finished file is deduplicated against every earlier
+// download, see Content_Store
+std::future<Download_Result> download_media_to_disk(
+    HTTP_Engine& engine,
+    string_cref url,
+    string_cref destination_stem,
+    Content_Store* store = nullptr);
+
+// same, `done` is called on a writer thread, or right away when the file
+// is there already
+void download_media_to_disk(
+    HTTP_Engine& engine,
+    string_cref url,
+    string_cref destination_stem,
+    Content_Store* store,
+    Download_Done done);
 
+// posts found in the index are SKIPPED without touching the network,
+// completed ones are added to it. Posts the journal knows as finished are
+// not resolved again, parts it knows as done are not downloaded again
 Thread_Result download_media(
+    HTTP_Engine& engine,
+    Download_Index& index,
+    Download_Journal& journal,
+    Media_Storage& storage,
+    long file_id,
+    const Post& post);
+
+// same, from a task of `pool`. The parts of a gallery or an album become
+// tasks of their own, queued under the host of each part, so a big album
+// keeps the whole pool busy. No task waits for a transfer: it is started,
+// the worker goes on with other posts and the engine resumes the post on
+// the pool once the transfer is over. Nothing is returned then: the task
+// of the last part to finish returns the result of the whole post, parts
+// in the order of the resolution and numbered _p0001, _p0002... like above
+optional<Thread_Result> download_media(
+    HTTP_Engine& engine,
+    Download_Index& index,
+    Download_Journal& journal,
+    Media_Storage& storage,
     long file_id,
-    const njson& child,
-    const string& dest_folder);
+    const Post& post,
+    Download_Pool& pool);
 
 // reddit image downloader
 int rid(const string& subreddit,
         const string& when,
-        const string& dest_folder);
+        const string& dest_folder,
+        Output_Mode output = Output_Mode::FILES);
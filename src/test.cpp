@@ -2,6 +2,23 @@
 
 #include "utils.h"
 #include "rid.h"
+#include "http_engine.h"
+#include "mock_server.h"
+#include "rate_limiter.h"
+#include "download_pool.h"
+#include "listing_parser.h"
+#include "download_index.h"
+#include "download_journal.h"
+#include "media_storage.h"
+#include "pack_storage.h"
+#include "file_writer.h"
+#include "content_store.h"
+#include "perceptual_hash.h"
+#include "url.h"
+#include "config.h"
+#include "resolver_cache.h"
+#include "resolver.h"
+#include "memory_budget.h"
 
 namespace Test
 {
@@ -68,25 +85,409 @@ void run_test()
     }
 
     {
-        string url = "https://v.redd.it/r7gh3btvonx31/DASH_720?source=fallback";
+        // same names as the three functions it replaces, on valid titles
+        std::mt19937 rng(3);
+        const vector<string> pieces = { "a", "Z", " ", "<", "?", "\"", "\\", "ЀЄ", "猫", "シ", "😀", "Ⴥდ", "0123456789abcdef", "é", "|:*/" };
 
-        auto response = perform_http_request(url);
+        for (int round = 0; round < 2000; ++round)
+        {
+            string title;
+            for (size_t n = rng() % 40; n > 0; --n)
+                title += pieces[rng() % pieces.size()];
 
-        if (not response.has_value())
-            return;
+            for (size_t max : { 0, 1, 15, 16, 17, 50, 70, 1000 })
+            {
+                string expected = Utils::remove_invalid_charaters(title);
+                if (Utils::UTF8_len(expected) > max)
+                    Utils::resize_string(expected, max);
 
-        if (response->content_type == "video/mp4")
+                assert(Utils::make_file_name(title, max) == expected);
+            }
+        }
+
+        // the output buffer is full: cut before a code point that does not fit
+        char buffer[6];
+        auto info = Utils::make_file_name("ab😀cd", 70, buffer);
+        assert(info.size == 6 and info.code_points == 3 and info.truncated);
+
+        info = Utils::make_file_name("abc😀", 70, buffer);
+        assert(info.size == 3 and info.code_points == 3 and info.truncated);
+
+        // control characters and malformed UTF-8 become '_' instead of throwing
+        assert(Utils::make_file_name("tab\there\nnew", 70) == "tab_here_new");
+        assert(Utils::make_file_name("bad \xFF\xC3 \xE2\x82 end\xF0", 70) == "bad __ __ end_");
+        assert(Utils::make_file_name("\xC0\xAF overlong, \xED\xA0\x80 surrogate", 70) == "__ overlong, ___ surrogate");
+        assert(Utils::make_file_name(string(40, 'x') + "\xFF" + string(40, 'y'), 70).size() == 70);
+
+        info = Utils::make_file_name("\xFFok", 70, buffer);
+        assert(info.repaired and not info.truncated and info.code_points == 3);
+    }
+
+    {
+        assert(Utils::sniff_media_type("\xFF\xD8\xFF\xE0\x00\x10JFIF")->extension == "jpg");
+        assert(Utils::sniff_media_type("\x89PNG\r\n\x1A\n\x00\x00\x00\x0DIHDR")->extension == "png");
+        assert(Utils::sniff_media_type("GIF89a\x01\x00")->extension == "gif");
+        assert(Utils::sniff_media_type(string("RIFF\x24\x00\x00\x00" "WEBPVP8 ", 16))->extension == "webp");
+        assert(Utils::sniff_media_type(string("\x00\x00\x00\x20" "ftypisom", 12))->type == "video");
+        assert(not Utils::sniff_media_type("<!DOCTYPE html>").has_value());
+        assert(not Utils::sniff_media_type("").has_value());
+
+        assert(Utils::media_type_from_content_type("image/jpeg")->extension == "jpg");
+        assert(Utils::media_type_from_content_type("video/mp4; charset=binary")->extension == "mp4");
+        assert(not Utils::media_type_from_content_type("text/html; charset=utf-8").has_value());
+        assert(not Utils::media_type_from_content_type("application/octet-stream").has_value());
+        assert(not Utils::media_type_from_content_type("").has_value());
+
+        // one fixed extension per type, anything else is not saved at all
+        assert(Utils::media_type_from_content_type("IMAGE/PJPEG")->extension == "jpg");
+        assert(Utils::media_type_from_content_type("video/quicktime")->extension == "mov");
+        assert(not Utils::media_type_from_content_type("image/svg+xml").has_value());
+        assert(not Utils::media_type_from_content_type("video/x-matroska").has_value());
+        assert(not Utils::media_type_from_content_type("image/avif").has_value());
+        assert(not Utils::sniff_media_type(string("\x00\x00\x00\x1C" "ftypavif", 12)).has_value());
+
+        const auto& known = Utils::known_media_extensions();
+        for (const char* type : { "image/jpeg", "image/png", "image/gif", "image/webp", "image/bmp", "video/mp4", "video/webm", "video/quicktime" })
+            assert(std::find(known.begin(), known.end(), Utils::media_type_from_content_type(type)->extension) != known.end());
+    }
+
+    {
+        auto headers = Utils::parse_http_headers(
+            "HTTP/1.1 301 Moved Permanently\r\nLocation: /b\r\n\r\n"
+            "HTTP/1.1 200 OK\r\nContent-Length: 42\r\nETag:  \"abc\"\r\n\r\n");
+
+        assert(headers.size() == 2);
+        assert(headers["content-length"] == "42");
+        assert(headers["etag"] == "\"abc\"");
+        assert(not headers.contains("location"));
+    }
+
+    {
+        // gallery parts come out in media id order, whatever the json order
+        auto child = njson::parse(R"({"kind": "t3", "data": {
+            "id": "abc", "title": "Gallery", "domain": "reddit.com",
+            "url": "https://www.reddit.com/gallery/abc", "subreddit": "pics",
+            "ups": 1500, "is_gallery": true,
+            "media_metadata": {
+                "zz": {"status": "valid", "s": {"u": "https://i.redd.it/zz.jpg"}},
+                "aa": {"status": "valid", "s": {"u": "https://i.redd.it/aa.jpg"}},
+                "mm": {"status": "failed"}
+            }}})");
+
+        Post post = post_from_json(child);
+        assert(post.id == "abc");
+        assert(post.ups == 1500);
+        assert(post.is_gallery);
+        assert((post.gallery_urls == vector<string>{
+            "https://i.redd.it/aa.jpg", "https://i.redd.it/zz.jpg" }));
+        assert(post.video_url == "");
+
+        // missing and mistyped fields stay empty instead of throwing
+        auto video = njson::parse(R"({"data": {
+            "title": null, "domain": "v.redd.it", "ups": "many",
+            "secure_media": {"reddit_video": {"fallback_url": "https://v.redd.it/x/DASH_720"}}}})");
+
+        post = post_from_json(video);
+        assert(post.title == "");
+        assert(post.url == "");
+        assert(post.ups == 0);
+        assert(get_url_from_vreddit(post) == "https://v.redd.it/x/DASH_720");
+    }
+
+    {
+        // the streaming parser must see exactly what the DOM sees, decoys included:
+        // "url" and "data" keys nested where they don't belong
+        string json = R"({"kind": "Listing", "data": {"after": "t3_next", "dist": 3,
+            "children": [
+                {"kind": "t3", "data": {"id": "a1", "title": "Caf\u00e9 \"quoted\"",
+                    "preview": {"images": [{"source": {"url": "https://preview/x.jpg"}, "id": "p"},
+                                           {"source": {"url": "https://preview/second.jpg"}}],
+                                "reddit_video_preview": {"fallback_url": "https://v.redd.it/p/DASH_480"}},
+                    "url": "https://i.redd.it/a1.png", "domain": "i.redd.it", "post_hint": "image",
+                    "all_awardings": [], "ups": 1234, "subreddit": "pics", "data": {"url": "decoy"}}},
+                {"kind": "t3", "data": {"id": "g1", "domain": "reddit.com", "ups": 1.5e3, "title": null,
+                    "media_metadata": {"zz": {"s": {"u": "https://i.redd.it/zz.jpg", "x": 1}, "m": "image/jpg"},
+                                       "aa": {"m": "image/png", "s": {"y": 2, "u": "https://i.redd.it/aa.png"}},
+                                       "gg": {"m": "image/gif", "s": {"gif": "https://i.redd.it/gg.gif", "mp4": "https://i.redd.it/gg.mp4"}},
+                                       "mm": {"status": "failed"}, "nn": "weird"},
+                    "is_gallery": true}},
+                {"kind": "t3", "data": {"id": "v1", "domain": "v.redd.it", "ti\u0074le": "\ud83d\ude00 \\o/",
+                    "secure_media": {"reddit_video": {"bitrate_kbps": 2400, "fallback_url": "https://v.redd.it/v1/DASH_720",
+                                                      "duration": 10, "is_gif": false}}}},
+                42
+            ]}, "url": "decoy"})";
+
+        auto fast = parse_listing(json);
+        auto dom = parse_listing_dom(json);
+
+        assert(fast.has_value() and dom.has_value());
+        assert(fast->after == dom->after);
+        assert(fast->posts == dom->posts);
+
+        assert(fast->after == "t3_next");
+        assert(fast->posts.size() == 4);
+        assert(fast->posts[0].title == "Caf\xc3\xa9 \"quoted\"");
+        assert(fast->posts[0].url == "https://i.redd.it/a1.png");
+        assert(fast->posts[0].post_hint == "image");
+        assert(fast->posts[0].preview_url == "https://preview/x.jpg");
+        assert(fast->posts[0].preview_video_url == "https://v.redd.it/p/DASH_480");
+        assert(fast->posts[1].ups == 1500);
+        assert((fast->posts[1].gallery_urls == vector<string>{
+            "https://i.redd.it/aa.png", "https://i.redd.it/gg.mp4", "https://i.redd.it/zz.jpg" }));
+        assert((fast->posts[1].gallery_types == vector<string>{ "image/png", "video/mp4", "image/jpg" }));
+        assert(fast->posts[2].title == "\xf0\x9f\x98\x80 \\o/");
+        assert(fast->posts[2].video_url == "https://v.redd.it/v1/DASH_720");
+        assert(fast->posts[2].video_size == 3'000'000);
+
+        auto last = parse_listing(R"({"data": {"after": null, "children": []}})");
+        assert(last.has_value() and not last->after.has_value() and last->posts.empty());
+
+        assert(not parse_listing(R"({"data": {"after": null}})").has_value());
+        assert(not parse_listing(R"([{"data": {"children": []}}])").has_value());
+
+        // broken json is reported the way njson::parse() reports it
+        for (const char* broken : {
+            R"({"data": {"children": [)",
+            R"({"data": {"children": [], "x": [1}}})",
+            R"({"data": {"children": [{"data": {"title": "no end}}]}})",
+            R"({"data": {"children": []}} trailing)",
+            "" })
         {
-            std::ofstream ofs("test.mp4",
-                              std::ofstream::binary |
-                              std::ofstream::trunc);
-            const char* data = response->body.data();
-            std::streamsize size = 
-                static_cast<std::streamsize>(response->body.size());
-            ofs.write(data, size);
+            bool threw = false;
+            try { parse_listing(broken); }
+            catch (const njson::parse_error&) { threw = true; }
+            assert(threw);
         }
     }
 
+    {
+        // reference values from the XXH64 and SHA-256 specs
+        auto hash = [](std::string_view data, Hash_Mode mode)
+        {
+            Content_Hasher hasher(mode);
+            hasher.update(data);
+            return hasher.digest();
+        };
+
+        assert(hash("", Hash_Mode::FAST) == "xxh64-ef46db3751d8e999");
+        assert(hash("abc", Hash_Mode::FAST) == "xxh64-44bc2cf5ad770999");
+        assert(hash("Nobody inspects the spammish repetition", Hash_Mode::FAST) == "xxh64-fbcea83c8a378bf1");
+        assert(hash("", Hash_Mode::SHA256) == "sha256-e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+        assert(hash("abc", Hash_Mode::SHA256) == "sha256-ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+        // chunk boundaries don't matter
+        string data(1000, 'x');
+        for (auto mode : { Hash_Mode::FAST, Hash_Mode::SHA256 })
+        {
+            Content_Hasher hasher(mode);
+            for (size_t i = 0; i < data.size(); i += 7)
+                hasher.update(std::string_view(data).substr(i, 7));
+
+            assert(hasher.digest() == hash(data, mode));
+        }
+        assert(hash(data, Hash_Mode::SHA256) == "sha256-44f8354494a5ba03ba1792a8d3e9c534c47a9181980fde7a3f44b06ef2ae7c7f");
+    }
+
+    fs::remove("test_index.bin");
+
+    {
+        assert(resolver_for("v.redd.it").name == "v.redd.it");
+        assert(resolver_for("imgur.com").name == "imgur");
+        assert(resolver_for("i.imgur.com").name == "imgur");
+        assert(resolver_for("gfycat.com").from_api != nullptr);
+        assert(resolver_for("reddit.com").from_api == nullptr);
+
+        // not registered, a prefix or a suffix of a registered one
+        assert(resolver_for("i.redd.it").name == "direct link");
+        assert(resolver_for("imgur.co").name == "direct link");
+        assert(resolver_for("").name == "direct link");
+
+        auto resolve_post = [](const Post& post)
+        {
+            auto url = parse_url(post.url).value_or(Url_View{});
+            return resolve(resolver_for(domain_of(post, url)), post, url);
+        };
+
+        auto offline = [](const Post& post)
+        {
+            auto url = parse_url(post.url).value_or(Url_View{});
+            return not needs_network(resolver_for(domain_of(post, url)), post, url);
+        };
+
+        Post image{ .domain = "i.redd.it", .url = "https://i.redd.it/nqa4sfb8ns191.png" };
+        assert((resolve_post(image).media == vector<Media_Link>{ { .url = image.url, .content_type = "image/png" } }));
+
+        // no domain in the post, the host of the url picks the resolver
+        Post video{ .url = "https://v.redd.it/r7gh3btvonx31",
+                    .video_url = "https://v.redd.it/r7gh3btvonx31/DASH_720", .video_size = 3'000'000 };
+        assert((resolve_post(video).media == vector<Media_Link>{
+            { .url = video.video_url, .content_type = "video/mp4", .expected_size = 3'000'000 } }));
+
+        Post gallery{ .domain = "reddit.com", .url = "https://www.reddit.com/gallery/abc", .is_gallery = true,
+                      .gallery_urls = { "https://i.redd.it/1.jpg", "https://i.redd.it/2.mp4" },
+                      .gallery_types = { "image/jpg", "video/mp4" } };
+        assert(resolve_post(gallery).media.size() == 2);
+        assert(resolve_post(gallery).media[1].content_type == "video/mp4");
+
+        Post page{ .domain = "example.com", .url = "https://example.com/page" };
+        assert(resolve_post(page).status == Resolution::Status::GONE);
+        assert(resolve_post(page).reason == "unknown domain example.com and no file extension");
+
+        // a page reddit took a picture of, its copy instead
+        page.post_hint = "image";
+        page.preview_url = "https://preview.redd.it/page.jpg";
+        assert(resolve_post(page).media == vector<Media_Link>{ { .url = page.preview_url } });
+
+        // imgur and gfycat without their api whenever the listing is enough
+        Post gifv{ .domain = "i.imgur.com", .url = "https://i.imgur.com/AbC12.gifv?x=1" };
+        assert(offline(gifv));
+        assert((resolve_post(gifv).media == vector<Media_Link>{
+            { .url = "https://i.imgur.com/AbC12.mp4?x=1", .content_type = "video/mp4" } }));
+
+        Post single{ .domain = "imgur.com", .url = "https://imgur.com/AbC12", .post_hint = "image" };
+        assert(offline(single));
+        assert((resolve_post(single).media == vector<Media_Link>{
+            { .url = "https://i.imgur.com/AbC12.jpg", .content_type = "image/jpeg" } }));
+
+        Post clip{ .domain = "gfycat.com", .url = "https://gfycat.com/JampackedUnrulyArcherfish",
+                   .preview_video_url = "https://v.redd.it/gfy/DASH_480" };
+        assert(offline(clip));
+        assert(resolve_post(clip).media[0].url == clip.preview_video_url);
+
+        // albums are listed by the api only
+        assert((not offline({ .domain = "imgur.com", .url = "https://imgur.com/a/AbC12", .post_hint = "image" })));
+        assert((not offline({ .domain = "imgur.com", .url = "https://imgur.com/AbC12" })));
+        assert((not offline({ .domain = "gfycat.com", .url = "https://gfycat.com/JampackedUnrulyArcherfish" })));
+    }
+
+    {
+        string s = "https://user@i.imgur.com:443/a/gBj52nI.jpg?x=1&width=640#top";
+        auto url = parse_url(s);
+
+        assert(url.has_value());
+        assert(url->scheme == "https");
+        assert(url->userinfo == "user");
+        assert(url->host == "i.imgur.com");
+        assert(url->port == "443");
+        assert(url->path == "/a/gBj52nI.jpg");
+        assert(url->query == "x=1&width=640");
+        assert(url->fragment == "top");
+        assert(url->file_name() == "gBj52nI.jpg");
+        assert(url->last_segment() == "gBj52nI.jpg");
+        assert(url->extension() == "jpg");
+        assert(url->query_param("width") == "640");
+        assert(not url->query_param("height").has_value());
+
+        vector<std::string_view> segments(url->segments().begin(), url->segments().end());
+        assert((segments == vector<std::string_view>{ "a", "gBj52nI.jpg" }));
+
+        // views into the string, nothing copied
+        assert(url->host.data() == s.data() + 13);
+
+        url = parse_url("https://www.reddit.com/gallery/abc/");
+        assert(url->file_name() == "" and url->last_segment() == "abc" and url->extension() == "");
+
+        // the extension of the path, a query after it does not hide it
+        assert(parse_url("https://preview.redd.it/x1.jpg?width=640&format=pjpg")->extension() == "jpg");
+        assert(parse_url("https://gfycat.com")->extension() == "");
+        assert(parse_url("https://example.com/a.b-c")->extension() == "");
+
+        url = parse_url("http://[::1]:8080/x");
+        assert(url->host == "[::1]" and url->port == "8080" and url->path == "/x");
+
+        // relative references, self posts link to their comments
+        url = parse_url("/r/pics/comments/abc/title/");
+        assert(url->scheme == "" and url->host == "" and url->last_segment() == "title");
+        assert(parse_url("a/b:c")->path == "a/b:c");
+
+        assert(not parse_url("https://example.com/a b").has_value());
+        assert(not parse_url("https://example.com:80x/").has_value());
+        assert(not parse_url("http://[::1/").has_value());
+
+        assert(Utils::extract_image_id_from_url("https://imgur.com/a/gBj52nI/") == "gBj52nI");
+        assert(Utils::extract_image_id_from_url("https://i.imgur.com/gBj52nI.jpg?1") == "gBj52nI");
+    }
+
+    {
+        // fuzz: urls put together from random pieces parse back into them
+        std::mt19937 rng(19);
+
+        auto random_string = [&](std::string_view alphabet, size_t max_len)
+        {
+            string res(std::uniform_int_distribution<size_t>(0, max_len)(rng), ' ');
+            for (auto& c : res)
+                c = alphabet[std::uniform_int_distribution<size_t>(0, alphabet.size() - 1)(rng)];
+            return res;
+        };
+
+        const std::string_view pchar = "abcXYZ019-._~!$&'()*+,;=:@%";
+
+        for (int i = 0; i < 20'000; ++i)
+        {
+            string scheme = "h" + random_string("abz09+-.", 5);
+            string userinfo = random_string("abc:%", 4);
+            string host = random_string("abc.-09", 12);
+            string port = random_string("0123456789", 5);
+            string path = random_string(pchar, 3) + "/" + random_string(string(pchar) + "/", 30);
+            string query = random_string(string(pchar) + "/?", 20);
+            string fragment = random_string(string(pchar) + "/?#", 10);
+
+            string s = std::format("{}://{}{}{}{}{}{}?{}#{}",
+                                   scheme,
+                                   userinfo, userinfo != "" ? "@" : "",
+                                   host,
+                                   port != "" ? ":" : "", port,
+                                   "/" + path,
+                                   query,
+                                   fragment);
+
+            auto url = parse_url(s);
+
+            assert(url.has_value());
+            assert(url->scheme == scheme);
+            assert(url->userinfo == userinfo);
+            assert(url->host == host);
+            assert(url->port == port);
+            assert(url->path == "/" + path);
+            assert(url->query == query);
+            assert(url->fragment == fragment);
+        }
+
+        // and garbage never makes it read outside of the string
+        for (int i = 0; i < 20'000; ++i)
+        {
+            string s = random_string(":/?#@[]. %a1\x01", 24);
+            auto url = parse_url(s);
+
+            if (not url.has_value())
+                continue;
+
+            for (auto part : { url->scheme, url->userinfo, url->host, url->port,
+                               url->path, url->query, url->fragment,
+                               url->file_name(), url->last_segment(), url->extension() })
+            {
+                assert(part.empty() or
+                       (part.data() >= s.data() and part.data() + part.size() <= s.data() + s.size()));
+            }
+
+            for (auto segment : url->segments())
+                assert(segment.find('/') == std::string_view::npos);
+        }
+
+        // Split_View gives the tokens of split_string()
+        for (int i = 0; i < 5'000; ++i)
+        {
+            string s = random_string("ab/&=", 16);
+            string delimiter = random_string("/&", 2);
+            if (delimiter == "")
+                delimiter = "/";
+
+            auto expected = Utils::split_string(s, delimiter);
+            Utils::Split_View view(s, delimiter);
+
+            assert((vector<string>(view.begin(), view.end()) == expected));
+        }
+    }
 
     {
         string s = "ciao/come/stai//";
@@ -133,4 +534,1035 @@ void run_test()
     }
 }
 
+void run_integration_test()
+{
+    {
+        Mock_Server server([](const Mock_Request& req)
+        {
+            if (req.path == "/octet")
+                return Mock_Response{ .content_type = "application/octet-stream",
+                                      .body = "\x89PNG\r\n\x1A\n" + string(4096, 'p') };
+            if (req.path == "/tiny")
+                return Mock_Response{ .content_type = "image/gif", .body = "GIF89a" };
+            if (req.path == "/late")
+            {
+                // somebody else saves the same file while the body is on its way
+                std::ofstream("test_sniff.png", std::ofstream::binary) << "mine";
+                return Mock_Response{ .content_type = "image/png", .body = "\x89PNG\r\n\x1A\n" + string(4096, 'p') };
+            }
+
+            return Mock_Response{ .content_type = "text/html", .body = string(4096, 'h') };
+        });
+
+        HTTP_Engine engine;
+
+        auto res = download_media_to_disk(engine, server.url("/octet"), "test_sniff").get();
+        assert(res == Download_Result::DOWNLOADED);
+        assert(fs::file_size("test_sniff.png") == 4096 + 8);
+
+        res = download_media_to_disk(engine, server.url("/octet"), "test_sniff").get();
+        assert(res == Download_Result::SKIPPED);
+        fs::remove("test_sniff.png");
+
+        res = download_media_to_disk(engine, server.url("/tiny"), "test_sniff").get();
+        assert(res == Download_Result::DOWNLOADED);
+        assert(fs::file_size("test_sniff.gif") == 6);
+        fs::remove("test_sniff.gif");
+
+        res = download_media_to_disk(engine, server.url("/page.html"), "test_sniff").get();
+        assert(res == Download_Result::UNABLE);
+        assert(server.requests_served() == 3); // one GET each, the SKIP never hits the network
+
+        res = download_media_to_disk(engine, server.url("/late"), "test_sniff").get();
+        assert(res == Download_Result::SKIPPED);
+        assert(fs::file_size("test_sniff.png") == 4);
+        assert(not fs::exists("test_sniff.part"));
+        fs::remove("test_sniff.png");
+    }
+
+    {
+        Mock_Server server([](const Mock_Request& req)
+        {
+            return Mock_Response{ .content_type = "image/png", .body = req.path };
+        });
+
+        HTTP_Engine engine(8);
+
+        vector<std::future<optional<HTTP_Response>>> futures;
+        for (int i = 0; i < 32; ++i)
+            futures.push_back(engine.submit(HTTP_Request{ .url = server.url(std::format("/{}", i)) }));
+
+        for (int i = 0; i < 32; ++i)
+        {
+            auto resp = futures[i].get();
+            assert(resp.has_value());
+            assert(resp->code == 200);
+            assert(resp->content_type == "image/png");
+            assert(resp->body == std::format("/{}", i));
+        }
+
+        auto head = engine.submit(HTTP_Request{ .url = server.url("/head"), .headers_only = true }).get();
+        assert(head.has_value());
+        assert(head->body == "");
+    }
+
+    {
+        Mock_Server server([](const Mock_Request&)
+        {
+            return Mock_Response{ .content_type = "image/jpeg", .body = "jpeg" };
+        });
+
+        // HEAD + GET pair on the same thread must go over one connection
+        auto head = request_headers_only(server.url("/a.jpg"));
+        auto body = perform_http_request(server.url("/a.jpg"));
+
+        assert(head.has_value() and body.has_value());
+        assert(body->num_connects == 0);
+        assert(server.connections_accepted() == 1);
+    }
+
+    {
+        Mock_Server server([](const Mock_Request& req)
+        {
+            if (req.path == "/missing.mp4")
+                return Mock_Response{ .code = 404, .body = "nope" };
+
+            return Mock_Response{ .content_type = "video/mp4", .body = string(300 * 1024, 'v') };
+        });
+
+        HTTP_Engine engine;
+
+        fs::remove("test_stream.mp4");
+        auto res = download_file_to_disk(engine, server.url("/big.mp4"), "test_stream.mp4").get();
+        assert(res == Download_Result::DOWNLOADED);
+        assert(fs::file_size("test_stream.mp4") == 300 * 1024);
+
+        res = download_file_to_disk(engine, server.url("/big.mp4"), "test_stream.mp4").get();
+        assert(res == Download_Result::SKIPPED);
+        fs::remove("test_stream.mp4");
+
+        res = download_file_to_disk(engine, server.url("/missing.mp4"), "test_missing.mp4").get();
+        assert(res == Download_Result::FAILED);
+        assert(not fs::exists("test_missing.mp4"));
+    }
+
+    {
+        // serves a 100000 bytes file with ETag "v1" and understands Range + If-Range
+        const string content = [] {
+            string c(100000, 0);
+            for (size_t i = 0; i < c.size(); ++i)
+                c[i] = static_cast<char>(i * 7);
+            c.replace(0, 8, "\x89PNG\r\n\x1A\n");
+            return c;
+        }();
+
+        std::atomic<int> ranges_served = 0;
+
+        Mock_Server server([&content, &ranges_served](const Mock_Request& req)
+        {
+            size_t from = 0;
+            bool if_range_ok = false;
+
+            for (const auto& header : req.headers)
+            {
+                if (header.starts_with("Range: bytes="))
+                    from = std::stoul(header.substr(13));
+                if (header == "If-Range: \"v1\"")
+                    if_range_ok = true;
+            }
+
+            if (from > 0 and if_range_ok)
+            {
+                ++ranges_served;
+                return Mock_Response{
+                    .code = 206,
+                    .content_type = "application/octet-stream",
+                    .headers = { "ETag: \"v1\"",
+                                 std::format("Content-Range: bytes {}-{}/{}", from, content.size() - 1, content.size()) },
+                    .body = content.substr(from)
+                };
+            }
+
+            return Mock_Response{
+                .content_type = "application/octet-stream",
+                .headers = { "ETag: \"v1\"" },
+                .body = content
+            };
+        });
+
+        auto read_file = [](const string& path)
+        {
+            std::ifstream ifs(path, std::ifstream::binary);
+            return string(std::istreambuf_iterator<char>(ifs), {});
+        };
+
+        auto fake_previous_run = [&content](const string& part, size_t len, string_cref meta)
+        {
+            std::ofstream(part, std::ofstream::binary).write(content.data(), static_cast<std::streamsize>(len));
+            std::ofstream(part + ".meta") << meta;
+        };
+
+        HTTP_Engine engine;
+
+        // resume a plain file
+        fake_previous_run("test_resume.bin.part", 40000, "length=100000\nvalidator=\"v1\"\n");
+        auto res = download_file_to_disk(engine, server.url("/file"), "test_resume.bin").get();
+        assert(res == Download_Result::DOWNLOADED);
+        assert(ranges_served == 1);
+        assert(read_file("test_resume.bin") == content);
+        assert(not fs::exists("test_resume.bin.part"));
+        assert(not fs::exists("test_resume.bin.part.meta"));
+        fs::remove("test_resume.bin");
+
+        // resume a sniffed media file, the extension comes from the .meta
+        fake_previous_run("test_resume.part", 70000, "length=100000\nvalidator=\"v1\"\nextension=png\n");
+        res = download_media_to_disk(engine, server.url("/media"), "test_resume").get();
+        assert(res == Download_Result::DOWNLOADED);
+        assert(ranges_served == 2);
+        assert(read_file("test_resume.png") == content);
+        fs::remove("test_resume.png");
+
+        // file changed on the server, If-Range fails and we start over
+        fake_previous_run("test_resume.part", 70000, "length=100000\nvalidator=\"v0\"\nextension=png\n");
+        res = download_media_to_disk(engine, server.url("/media"), "test_resume").get();
+        assert(res == Download_Result::DOWNLOADED);
+        assert(ranges_served == 2);
+        assert(read_file("test_resume.png") == content);
+        assert(not fs::exists("test_resume.part"));
+        fs::remove("test_resume.png");
+    }
+
+    {
+        // stand-in for reddit: a window of 3 requests resetting in 10 s
+        std::atomic<int> used = 0;
+
+        Mock_Server server([&used](const Mock_Request&)
+        {
+            int n = ++used;
+            return Mock_Response{
+                .content_type = "application/json",
+                .headers = { std::format("X-Ratelimit-Remaining: {}.0", 3 - n),
+                             std::format("X-Ratelimit-Used: {}", n),
+                             "X-Ratelimit-Reset: 10" },
+                .body = "{}"
+            };
+        });
+
+        using namespace std::chrono_literals;
+
+        Rate_Limiter limiter;
+        auto now = Rate_Limiter::Clock::now();
+
+        auto request = [&]
+        {
+            auto wait = limiter.reserve("mock", now);
+            auto resp = perform_http_request(server.url("/top.json"));
+            assert(resp.has_value());
+            limiter.update("mock", resp->code, Utils::parse_http_headers(resp->resp_headers), now);
+            return wait;
+        };
+
+        auto rl = parse_ratelimit_headers(Utils::parse_http_headers(
+            "HTTP/1.1 200 OK\r\nx-ratelimit-remaining: 598.0\r\nx-ratelimit-used: 2\r\nx-ratelimit-reset: 412\r\n\r\n"));
+        assert(rl.remaining == 598.0 and rl.used == 2.0 and rl.reset == 412.0);
+        assert(not rl.retry_after.has_value());
+
+        // unknown host, no headers seen yet: no limit
+        assert(request() == 0s);
+        // 2 left, then 1 left: still free
+        assert(request() == 0s);
+        assert(request() == 0s);
+        // budget spent: wait exactly until the window resets
+        assert(limiter.reserve("mock", now) == 10s);
+        assert(limiter.reserve("mock", now + 10s) == 0s);
+
+        // 429 with Retry-After blocks the host
+        limiter.update("mock", 429, { { "retry-after", "30" } }, now);
+        assert(limiter.reserve("mock", now) == 30s);
+
+        // even on a host that never sent the X-Ratelimit headers
+        assert(limiter.reserve("bare", now) == 0s);
+        limiter.update("bare", 429, { { "retry-after", "5" } }, now);
+        assert(limiter.reserve("bare", now) == 5s);
+        limiter.update("bare", 200, {}, now);
+        assert(limiter.reserve("bare", now + 5s) == 0s);
+    }
+
+    {
+        // a slow host limited to 2 must not take the other workers
+        std::atomic<int> slow_running = 0;
+        std::atomic<int> slow_max = 0;
+        std::atomic<int> fast_done = 0;
+
+        Download_Pool pool(6, [](string_cref host) { return host == "slow" ? 2u : 0u; });
+
+        for (int i = 0; i < 8; ++i)
+        {
+            pool.submit([&]
+            {
+                int now = ++slow_running;
+                slow_max = std::max(slow_max.load(), now);
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+                --slow_running;
+                return Thread_Result{ .download_res = { Download_Result::DOWNLOADED } };
+            }, "slow");
+        }
+
+        for (int i = 0; i < 40; ++i)
+        {
+            pool.submit([&]
+            {
+                ++fast_done;
+                return Thread_Result{ .download_res = { Download_Result::DOWNLOADED } };
+            }, "fast");
+        }
+
+        size_t results = 0;
+        while (pool.wait_result())
+            ++results;
+
+        assert(results == 48);
+        assert(fast_done == 40);
+        assert(slow_max <= 2);
+
+        assert(host_key_for_domain("m.imgur.com") == "imgur.com");
+        assert(default_host_limit("imgur.com") == 4);
+
+        // album parts are not held back by the imgur API limit
+        assert(host_key_for_domain("i.imgur.com") == "i.imgur.com");
+        assert(default_host_limit("i.imgur.com") == 16);
+        assert(default_host_limit("some-blog.example") == 2);
+    }
+
+    {
+        // the same picture at two sizes, and a different one
+        auto picture = [](int width, int height, double frequency)
+        {
+            vector<uint8_t> grey(static_cast<size_t>(width) * height);
+            for (int y = 0; y < height; ++y)
+                for (int x = 0; x < width; ++x)
+                    grey[static_cast<size_t>(y) * width + x] = static_cast<uint8_t>(
+                        128 + 100 * std::sin(frequency * x / width) * std::cos(5.0 * y / height));
+            return grey;
+        };
+
+        auto big = picture(900, 800, 7.0);
+        auto small = picture(300, 267, 7.0);
+        auto other = picture(900, 800, 19.0);
+
+        uint64_t big_hash = dhash(big.data(), 900, 800);
+        assert(std::popcount(big_hash ^ dhash(small.data(), 300, 267)) <= 4);
+        assert(std::popcount(big_hash ^ dhash(other.data(), 900, 800)) > 16);
+
+        // left brighter than right everywhere: every bit set
+        vector<uint8_t> fading(90 * 8);
+        for (int i = 0; i < 90 * 8; ++i)
+            fading[i] = static_cast<uint8_t>(255 - (i % 90) * 2);
+        assert(dhash(fading.data(), 90, 8) == ~0ull);
+
+        // from a file: 24 bit BMP, which any decoder reads
+        {
+            const int w = 90, h = 80;
+            const int stride = (w * 3 + 3) & ~3;
+            auto grey = picture(w, h, 7.0);
+
+            string bmp = "BM";
+            auto u32 = [&bmp](uint32_t v) { for (int i = 0; i < 4; ++i) bmp += static_cast<char>(v >> (8 * i)); };
+            auto u16 = [&bmp](uint16_t v) { bmp += static_cast<char>(v); bmp += static_cast<char>(v >> 8); };
+            u32(54 + stride * h); u32(0); u32(54);
+            u32(40); u32(w); u32(h); u16(1); u16(24); u32(0); u32(stride * h); u32(2835); u32(2835); u32(0); u32(0);
+            for (int y = h - 1; y >= 0; --y)
+            {
+                for (int x = 0; x < w; ++x)
+                    bmp.append(3, static_cast<char>(grey[static_cast<size_t>(y) * w + x]));
+                bmp.append(stride - w * 3, '\0');
+            }
+
+            std::ofstream("test_dhash.bmp", std::ofstream::binary) << bmp;
+
+            auto from_file = dhash_file("test_dhash.bmp");
+            assert(from_file.has_value());
+            assert(std::popcount(*from_file ^ dhash(grey.data(), w, h)) <= 2);
+            fs::remove("test_dhash.bmp");
+        }
+
+        // SIMD and scalar must pick the same entry
+        std::mt19937_64 rng(7);
+        vector<uint64_t> hashes(10003);
+        for (auto& hash : hashes)
+            hash = rng();
+
+        hashes[5000] = 0x0123456789abcdefull ^ 0b101;
+        hashes[9000] = 0x0123456789abcdefull ^ 0b1; // closer, found later
+        hashes[10002] = 0x0123456789abcdefull ^ 0b11;
+
+        auto scalar = nearest_within_scalar(hashes, 0x0123456789abcdefull, 6);
+        assert(scalar.has_value() and scalar->position == 9000 and scalar->distance == 1);
+        assert(not nearest_within_scalar(hashes, ~0x0123456789abcdefull, 6).has_value());
+
+        if (cpu_has_avx2())
+        {
+            for (int i = 0; i < 200; ++i)
+            {
+                uint64_t query = i < 100 ? hashes[rng() % hashes.size()] ^ (1ull << (i % 64)) : rng();
+                auto a = nearest_within_scalar(hashes, query, 12);
+                auto b = nearest_within_avx2(hashes, query, 12);
+
+                assert(a.has_value() == b.has_value());
+                assert(not a.has_value() or (a->position == b->position and a->distance == b->distance));
+            }
+        }
+    }
+
+    {
+        fs::remove("test_index.bin");
+
+        {
+            Download_Index index("test_index.bin");
+            assert(index.is_open());
+
+            // enough posts to grow the table a few times
+            for (int i = 0; i < 10000; ++i)
+                index.add({ .id = std::format("id{}", i), .url = std::format("https://i.redd.it/{}.jpg", i) });
+
+            assert(index.size() == 20000);
+
+            assert(index.claim_name("Same title", "id1"));
+            assert(index.claim_name("Same title", "id1"));
+            assert(not index.claim_name("same TITLE", "id2"));
+        }
+
+        // everything is still there after reopening
+        Download_Index index("test_index.bin");
+        assert(index.size() == 20001);
+        assert(index.contains({ .id = "id9999" }));
+        assert(index.contains({ .id = "crosspost", .url = "https://i.redd.it/42.jpg" }));
+        assert(not index.contains({ .id = "id10000", .url = "https://i.redd.it/10000.jpg" }));
+        assert(not index.claim_name("Same title", "id2"));
+    }
+
+    {
+        // garbage in the file: start over instead of trusting it
+        {
+            std::ofstream out("test_index.bin", std::ofstream::trunc | std::ofstream::binary);
+            out << "definitely not an index";
+        }
+
+        Download_Index index("test_index.bin");
+        assert(index.is_open());
+        assert(index.size() == 0);
+    }
+
+    {
+        // two posts sharing a title are two files, a post in the index costs no request
+        Mock_Server server([](const Mock_Request&)
+        {
+            return Mock_Response{ .content_type = "image/png", .body = string("\x89PNG\r\n\x1A\n", 8) + "data" };
+        });
+        assert(server.is_running());
+
+        const string folder = "test_index_dir";
+        fs::create_directories(folder);
+        fs::remove(folder + "/download_index.bin");
+
+        HTTP_Engine engine;
+        Download_Index index(folder + "/download_index.bin");
+        Download_Journal journal(folder + "/journal.txt");
+        Content_Store store(folder + "/store");
+        File_Storage storage(folder, &store);
+
+        Post first{ .id = "aaa", .title = "Same title", .domain = "i.redd.it", .url = server.url("/aaa.png") };
+        Post second{ .id = "bbb", .title = "Same title", .domain = "i.redd.it", .url = server.url("/bbb.png") };
+
+        auto res = download_media(engine, index, journal, storage, 1, first);
+        assert(res.download_res == vector{ Download_Result::DOWNLOADED });
+
+        res = download_media(engine, index, journal, storage, 2, second);
+        assert(res.download_res == vector{ Download_Result::DOWNLOADED });
+
+        string first_file = std::format("{}\\Same title.png", folder);
+        string second_file = std::format("{}\\Same title_bbb.png", folder);
+        assert(fs::exists(first_file));
+        assert(fs::exists(second_file));
+
+        // same bytes: one file on disk, two names
+        assert(fs::equivalent(first_file, second_file));
+        assert(store.files_deduplicated() == 1);
+        assert(store.bytes_saved() == 12);
+
+        auto served = server.requests_served();
+        res = download_media(engine, index, journal, storage, 3, first);
+        assert(res.download_res == vector{ Download_Result::SKIPPED });
+        assert(server.requests_served() == served);
+
+        fs::remove(first_file);
+        fs::remove(second_file);
+        journal.discard();
+        fs::remove_all(folder);
+    }
+
+    {
+        // replay: torn last line dropped, FAILED posts are not finished
+        fs::remove("test_journal.txt");
+
+        {
+            Download_Journal journal("test_journal.txt");
+            assert(journal.is_open());
+
+            journal.record_part("g1", 1, Download_Result::DOWNLOADED);
+            journal.record_part("g1", 2, Download_Result::FAILED, "https://i.redd.it/2.jpg");
+            journal.record_post("g1", Download_Result::FAILED, "1 of 2\tparts\nfailed");
+            journal.record_post("u1", Download_Result::UNABLE, "no media url");
+            journal.record_post("d1", Download_Result::DOWNLOADED);
+            journal.sync();
+        }
+
+        std::ofstream("test_journal.txt", std::ofstream::app | std::ofstream::binary) << "x1\t*\tDOWNLO";
+
+        {
+            Download_Journal journal("test_journal.txt");
+            assert(journal.replayed() == 3);
+            assert(not journal.finished("g1").has_value());
+            assert(journal.part_done("g1", 1));
+            assert(not journal.part_done("g1", 2));
+            assert(journal.finished("u1") == Download_Result::UNABLE);
+            assert(journal.finished("d1") == Download_Result::DOWNLOADED);
+            assert(not journal.finished("x1").has_value());
+
+            journal.record_post("g1", Download_Result::DOWNLOADED);
+        }
+
+        Download_Journal journal("test_journal.txt");
+        assert(journal.finished("g1") == Download_Result::DOWNLOADED);
+
+        journal.discard();
+        assert(not fs::exists("test_journal.txt"));
+    }
+
+    {
+        // after a crash only the failed part of a gallery is downloaded again,
+        // finished posts cost no request at all
+        std::atomic<bool> broken = true;
+
+        Mock_Server server([&broken](const Mock_Request& req)
+        {
+            if (req.path == "/p2.png" and broken)
+                return Mock_Response{ .code = 404 };
+
+            return Mock_Response{ .content_type = "image/png", .body = string("\x89PNG\r\n\x1A\n", 8) + req.path };
+        });
+        assert(server.is_running());
+
+        const string folder = "test_journal_dir";
+        fs::remove_all(folder);
+        fs::create_directories(folder);
+
+        HTTP_Engine engine;
+        File_Storage storage(folder);
+
+        Post gallery{ .id = "gal", .title = "Gallery", .domain = "reddit.com", .url = "https://www.reddit.com/gallery/gal",
+                      .is_gallery = true, .gallery_urls = { server.url("/p1.png"), server.url("/p2.png"), server.url("/p3.png") } };
+        Post nothing{ .id = "nop", .title = "Nothing", .domain = "example.com", .url = "https://example.com/page" };
+
+        {
+            Download_Index index(folder + "/download_index.bin");
+            Download_Journal journal(folder + "/journal.txt");
+
+            // the parts as tasks of their own, the post reported once, in part order
+            Download_Pool pool(4);
+            pool.submit([&] { return download_media(engine, index, journal, storage, 1, gallery, pool); });
+
+            auto res = pool.wait_result();
+            assert(res.has_value() and res->file_id == 1);
+            assert((res->download_res == vector{ Download_Result::DOWNLOADED, Download_Result::FAILED, Download_Result::DOWNLOADED }));
+            assert(not pool.wait_result().has_value());
+
+            res = download_media(engine, index, journal, storage, 2, nothing);
+            assert(res->download_res == vector{ Download_Result::UNABLE });
+        }
+
+        broken = false;
+
+        {
+            Download_Index index(folder + "/download_index.bin");
+            Download_Journal journal(folder + "/journal.txt");
+
+            auto served = server.requests_served();
+            auto res = download_media(engine, index, journal, storage, 1, gallery);
+            assert((res.download_res == vector{ Download_Result::SKIPPED, Download_Result::DOWNLOADED, Download_Result::SKIPPED }));
+            assert(server.requests_served() == served + 1);
+        }
+
+        // the index is gone, the journal alone is enough
+        fs::remove(folder + "/download_index.bin");
+
+        {
+            Download_Index index(folder + "/download_index.bin");
+            Download_Journal journal(folder + "/journal.txt");
+
+            auto served = server.requests_served();
+            auto res = download_media(engine, index, journal, storage, 1, gallery);
+            assert(res.download_res == vector{ Download_Result::SKIPPED });
+
+            res = download_media(engine, index, journal, storage, 2, nothing);
+            assert(res.download_res == vector{ Download_Result::UNABLE });
+            assert(server.requests_served() == served);
+        }
+
+        for (int i = 1; i <= 3; ++i)
+            fs::remove(std::format("{}\\Gallery_p{:04}.png", folder, i));
+        fs::remove_all(folder);
+    }
+
+    {
+        // the workers only start the transfers: 2 of them keep every post in flight
+        std::atomic<int> running = 0;
+        std::atomic<int> running_max = 0;
+
+        Mock_Server server([&](const Mock_Request& req)
+        {
+            int now = ++running;
+            running_max = std::max(running_max.load(), now);
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            --running;
+
+            return Mock_Response{ .content_type = "image/png", .body = string("\x89PNG\r\n\x1A\n", 8) + req.path };
+        });
+        assert(server.is_running());
+
+        const string folder = "test_async_dir";
+        fs::remove_all(folder);
+        fs::create_directories(folder);
+
+        vector<Post> posts;
+        for (int i = 0; i < 12; ++i)
+        {
+            posts.push_back({ .id = std::format("as{}", i), .title = std::format("Async {}", i),
+                              .domain = "i.redd.it", .url = server.url(std::format("/{}.png", i)) });
+        }
+
+        {
+            HTTP_Engine engine;
+            File_Storage storage(folder);
+            Download_Index index(folder + "/download_index.bin");
+            Download_Journal journal(folder + "/journal.txt");
+
+            Download_Pool pool(2);
+
+            for (size_t i = 0; i < posts.size(); ++i)
+            {
+                pool.submit([&, i]
+                {
+                    return download_media(engine, index, journal, storage, static_cast<long>(i), posts[i], pool);
+                });
+            }
+
+            size_t downloaded = 0;
+            while (auto res = pool.wait_result())
+                downloaded += res->download_res == vector{ Download_Result::DOWNLOADED } ? 1 : 0;
+
+            assert(downloaded == posts.size());
+            assert(pool.pending() == 0);
+        }
+
+        assert(running_max == static_cast<int>(posts.size()));
+
+        for (const auto& post : posts)
+            fs::remove(std::format("{}\\{}.png", folder, post.title));
+        fs::remove_all(folder);
+    }
+
+    {
+        // leaving rid() on an exception with transfers in flight: the pool
+        // waits for them before the storage and the engine go
+        Mock_Server server([](const Mock_Request& req)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            return Mock_Response{ .content_type = "image/png", .body = string("\x89PNG\r\n\x1A\n", 8) + req.path };
+        });
+        assert(server.is_running());
+
+        const string folder = "test_unwind_dir";
+        fs::remove_all(folder);
+        fs::create_directories(folder);
+
+        vector<Post> posts;
+        for (int i = 0; i < 8; ++i)
+        {
+            posts.push_back({ .id = std::format("uw{}", i), .title = std::format("Unwind {}", i),
+                              .domain = "i.redd.it", .url = server.url(std::format("/{}.png", i)) });
+        }
+
+        bool thrown = false;
+
+        try
+        {
+            // declared in the order of rid()
+            HTTP_Engine engine;
+            Download_Index index(folder + "/download_index.bin");
+            Download_Journal journal(folder + "/journal.txt");
+            Pack_Storage pack(folder + "/pack");
+            Download_Pool pool(2);
+
+            for (size_t i = 0; i < posts.size(); ++i)
+            {
+                pool.submit([&, i]
+                {
+                    return download_media(engine, index, journal, pack, static_cast<long>(i), posts[i], pool);
+                });
+            }
+
+            assert(pool.wait_result().has_value());
+            throw std::runtime_error("listing page broken");
+        }
+        catch (const std::runtime_error&)
+        {
+            thrown = true;
+        }
+
+        assert(thrown);
+
+        // every transfer that was started finished into the pack
+        Pack_Storage pack(folder + "/pack", Hash_Mode::FAST, g_PACK_SEGMENT_SIZE, true);
+        assert(pack.entries().size() == server.requests_served());
+        assert(pack.entries().size() > 1);
+
+        fs::remove_all(folder);
+    }
+
+    {
+        // pack output: segments roll over, equal bodies are stored once,
+        // what was written after the last index line is recovered
+        Mock_Server server([](const Mock_Request& req)
+        {
+            if (req.path == "/page.html")
+                return Mock_Response{ .content_type = "text/html", .body = "<html>" + string(100, ' ') + "</html>" };
+
+            string body = req.path == "/copy.png" ? "/one.png" : req.path;
+            return Mock_Response{ .content_type = "image/png", .body = string("\x89PNG\r\n\x1A\n", 8) + body + string(200, 'x') };
+        });
+        assert(server.is_running());
+
+        const string folder = "test_pack";
+        fs::remove_all(folder);
+
+        HTTP_Engine engine;
+
+        {
+            Pack_Storage pack(folder, Hash_Mode::FAST, 600);
+            assert(pack.is_open());
+
+            Media_Item one{ .post_id = "one", .name = "One" };
+            Media_Item two{ .post_id = "two", .part = 1, .name = "Two_p0001" };
+            Media_Item three{ .post_id = "two", .part = 2, .name = "Two_p0002" };
+            Media_Item copy{ .post_id = "copy", .name = "Copy" };
+            Media_Item page{ .post_id = "page", .name = "Page" };
+
+            // without a budget bodies stay in memory: a spool path that
+            // cannot be opened as a file is never tried
+            fs::create_directory(folder + "/one_0.spool");
+
+            assert(pack.download(engine, server.url("/one.png"), one).get() == Download_Result::DOWNLOADED);
+            assert(fs::is_directory(folder + "/one_0.spool"));
+            assert(pack.download(engine, server.url("/two.png"), two).get() == Download_Result::DOWNLOADED);
+            assert(pack.download(engine, server.url("/three.png"), three).get() == Download_Result::DOWNLOADED);
+            assert(pack.download(engine, server.url("/copy.png"), copy).get() == Download_Result::DOWNLOADED);
+            assert(pack.download(engine, server.url("/page.html"), page).get() == Download_Result::UNABLE);
+            assert(pack.download(engine, server.url("/other.png"), Media_Item{ .post_id = "x" }).get() == Download_Result::DOWNLOADED);
+
+            auto served = server.requests_served();
+            assert(pack.download(engine, server.url("/one.png"), one).get() == Download_Result::SKIPPED);
+            assert(server.requests_served() == served);
+            assert(not pack.file(one).has_value());
+
+            assert(pack.items_packed() == 4);
+            assert(pack.items_deduplicated() == 1);
+        }
+
+        // 2 records of ~240 bytes per 600 byte segment
+        assert(fs::exists(folder + "/segment_00000.rpk"));
+        assert(fs::exists(folder + "/segment_00001.rpk"));
+        assert(not fs::exists(folder + "/segment_00002.rpk"));
+
+        // the last index line is lost and the last record cut in half
+        {
+            std::ifstream ifs(folder + "/index.txt", std::ifstream::binary);
+            std::stringstream ss;
+            ss << ifs.rdbuf();
+            string index = ss.str();
+            index.resize(index.rfind('\n', index.size() - 2) + 1);
+
+            std::ofstream(folder + "/index.txt", std::ofstream::binary | std::ofstream::trunc) << index;
+            std::ofstream(folder + "/segment_00001.rpk", std::ofstream::binary | std::ofstream::app) << "RIDR half a record";
+        }
+
+        {
+            Pack_Storage pack(folder, Hash_Mode::FAST, 600);
+            assert(pack.is_open());
+
+            auto entries = pack.entries();
+            assert(entries.size() == 5);
+            assert(pack.contains({ .post_id = "x" }));
+            assert(pack.contains({ .post_id = "two", .part = 2 }));
+
+            for (const auto& entry : entries)
+            {
+                assert(pack.extract(entry, "test_pack_item"));
+
+                std::ifstream ifs("test_pack_item", std::ifstream::binary);
+                std::stringstream ss;
+                ss << ifs.rdbuf();
+
+                string path = entry.post_id == "x" ? "/other.png" : entry.post_id == "copy" ? "/one.png" : "";
+                if (path == "")
+                    path = entry.part == 2 ? "/three.png" : std::format("/{}.png", entry.post_id);
+
+                assert(ss.str() == string("\x89PNG\r\n\x1A\n", 8) + path + string(200, 'x'));
+            }
+
+            fs::remove("test_pack_item");
+
+            // appends after the recovered record, not after the garbage
+            Media_Item four{ .post_id = "four", .name = "Four" };
+            assert(pack.download(engine, server.url("/four.png"), four).get() == Download_Result::DOWNLOADED);
+        }
+
+        Pack_Storage pack(folder, Hash_Mode::FAST, 600, true);
+        assert(pack.entries().size() == 6);
+        assert(pack.entries().back().post_id == "four");
+
+        fs::remove_all(folder);
+    }
+
+    {
+        Memory_Budget budget(1000);
+
+        auto lease = budget.acquire(600);
+        assert(not lease.try_grow(500));
+        assert(lease.try_grow(400) and budget.stats().in_use == 1000);
+
+        // the budget is spent, the next one waits for the lease to go
+        std::atomic<bool> acquired = false;
+        std::thread waiter([&] { auto other = budget.acquire(100); acquired = true; });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(not acquired);
+
+        lease.release();
+        waiter.join();
+        assert(acquired and budget.stats().waits == 1 and budget.stats().in_use == 0);
+
+        // more than the whole budget still runs, alone
+        assert(budget.acquire(5000).bytes() == 5000);
+        assert(budget.stats().in_use == 0 and budget.stats().peak == 5000);
+
+        // a body bigger than the budget goes through a spool file, packed all the same
+        const string big = string("\x89PNG\r\n\x1A\n", 8) + string(64 * 1024, 'b');
+        const string small = string("\x89PNG\r\n\x1A\n", 8) + string(200, 's');
+
+        Mock_Server server([&](const Mock_Request& req)
+        {
+            return Mock_Response{ .content_type = "image/png", .body = req.path == "/big.png" ? big : small };
+        });
+        assert(server.is_running());
+
+        const string folder = "test_pack_budget";
+        fs::remove_all(folder);
+
+        HTTP_Engine engine;
+
+        {
+            Pack_Storage pack(folder, Hash_Mode::FAST, g_PACK_SEGMENT_SIZE, false, &budget);
+
+            assert(pack.download(engine, server.url("/big.png"), { .post_id = "big" }).get() == Download_Result::DOWNLOADED);
+            assert(pack.download(engine, server.url("/small.png"), { .post_id = "small" }).get() == Download_Result::DOWNLOADED);
+            assert(budget.stats().spills == 1 and budget.stats().in_use == 0);
+            assert(not fs::exists(folder + "/big_0.spool"));
+
+            for (const auto& entry : pack.entries())
+            {
+                assert(pack.extract(entry, "test_pack_item"));
+
+                std::ifstream ifs("test_pack_item", std::ifstream::binary);
+                std::stringstream ss;
+                ss << ifs.rdbuf();
+                assert(ss.str() == (entry.post_id == "big" ? big : small));
+            }
+
+            fs::remove("test_pack_item");
+        }
+
+        fs::remove_all(folder);
+    }
+
+    {
+        // writes land in order, merged or not, with and without threads
+        for (unsigned threads : { 0u, 3u })
+        {
+            File_Writer writer(threads);
+            string expected;
+            string seen;
+
+            auto file = writer.open("test_writer.bin", false, 1024 * 1024,
+                                    [&seen](std::string_view data) { seen.append(data); });
+
+            for (int i = 0; i < 5000; ++i)
+            {
+                string chunk = std::format("{};", i);
+                expected += chunk;
+                writer.write(file, chunk);
+            }
+
+            std::promise<bool> closed;
+            writer.close(file, [&closed](bool ok) { closed.set_value(ok); });
+            assert(closed.get_future().get());
+
+            std::ifstream ifs("test_writer.bin", std::ifstream::binary);
+            std::stringstream ss;
+            ss << ifs.rdbuf();
+
+            // preallocated space is not part of the file
+            assert(ss.str() == expected);
+            assert(seen == expected);
+            assert(writer.pending_bytes() == 0);
+
+            // appended after what is there
+            file = writer.open("test_writer.bin", true);
+            writer.write(file, "end");
+
+            std::promise<bool> appended;
+            writer.close(file, [&appended](bool ok) { appended.set_value(ok); });
+            assert(appended.get_future().get());
+            assert(fs::file_size("test_writer.bin") == expected.size() + 3);
+
+            std::promise<bool> failed;
+            file = writer.open("test_no_such_folder/file.bin", false);
+            writer.write(file, "lost");
+            writer.close(file, [&failed](bool ok) { failed.set_value(ok); });
+            assert(not failed.get_future().get());
+
+            fs::remove("test_writer.bin");
+        }
+    }
+
+    {
+        const fs::path env_file = "test_config.env";
+        {
+            std::ofstream ofs(env_file, std::ios::binary);
+            ofs << "GIPY_CLIENT_ID=not ours\r\n"
+                << "IMGUR_CLIENT_ID=abc123\r\n"
+                << "WORKERS=16\n"
+                << "HOST_LIMITS=imgur.com=2,i.redd.it=64\n"
+                << "NEAR_DUPLICATES=skip\n"
+                << "TITLE_MAX_LEN=1000\n" // over g_TITLE_MAX_LEN_LIMIT, ignored
+                << "MIN_UPVOTES=\n"
+                << "CONTENT_HASH=md5\n";
+        }
+
+        auto settings = load_config(env_file, { { "WORKERS", "3" },
+                                                { "OUTPUT", "pack" },
+                                                { "STALL_TIMEOUT", "30" },
+                                                { "MEMORY_BUDGET", "384" } });
+
+        assert(settings.imgur_client_id == "abc123");
+        assert(settings.workers == 3); // the command line wins over .env
+        assert(settings.output == Output_Mode::PACK);
+        assert(settings.stall_timeout == std::chrono::seconds(30));
+        assert(settings.memory_budget == 384ull * 1024 * 1024);
+        assert(settings.near_duplicates == Near_Duplicate_Action::SKIP);
+        assert(settings.title_max_len == g_TITLE_MAX_LEN);
+        assert(settings.min_upvotes == 0);
+        assert(settings.content_hash == Hash_Mode::FAST);
+        assert(settings.host_limit("imgur.com") == 2);
+        assert(settings.host_limit("i.redd.it") == 64);
+        assert(settings.host_limit("v.redd.it") == default_host_limit("v.redd.it"));
+
+        // no file, the defaults
+        auto defaults = load_config("test_config_missing.env");
+        assert(defaults.workers == g_num_threads and defaults.output == Output_Mode::FILES);
+
+        fs::remove(env_file);
+    }
+
+    {
+        const fs::path file = "test_resolver_cache.txt";
+        fs::remove(file);
+
+        const Resolution album{
+            .status = Resolution::Status::RESOLVED,
+            .media = { { .url = "https://i.imgur.com/a.jpg", .content_type = "image/jpeg" },
+                       { .url = "https://i.imgur.com/b.mp4", .content_type = "" } }
+        };
+
+        {
+            Resolver_Cache cache(file, std::chrono::hours(1), std::chrono::hours(1));
+
+            size_t calls = 0;
+            auto resolve = [&](string_cref url, const Resolution& answer)
+            {
+                return cache.resolve(url, [&] { ++calls; return answer; });
+            };
+
+            assert(resolve("https://imgur.com/a/album", album) == album);
+            assert(resolve("https://imgur.com/a/album", {}) == album);
+            assert(calls == 1);
+
+            // negative caching, a deleted post is not asked again
+            resolve("https://imgur.com/gone", { .status = Resolution::Status::GONE });
+            assert(resolve("https://imgur.com/gone", album).status == Resolution::Status::GONE);
+            assert(calls == 2);
+
+            // failures are asked again
+            resolve("https://gfycat.com/Down", {});
+            resolve("https://gfycat.com/Down", {});
+            assert(calls == 4);
+
+            assert(cache.hits() == 2 and cache.misses() == 4);
+        }
+
+        {
+            // a line from long ago and a torn one
+            std::ofstream ofs(file, std::ios::binary | std::ios::app);
+            ofs << "1000\thttps://imgur.com/old\tR\thttps://i.imgur.com/old.jpg\timage/jpeg\n";
+            ofs << "99999999999\thttps://imgur.com/torn\tR\thttps://i.imgur";
+        }
+
+        {
+            // another run: the answers are still there, the expired one is not
+            Resolver_Cache cache(file, std::chrono::hours(1), std::chrono::seconds(0));
+
+            assert(cache.find("https://imgur.com/a/album") == album);
+            assert(cache.find("https://imgur.com/gone")->status == Resolution::Status::GONE);
+            assert(not cache.find("https://imgur.com/old").has_value());
+            assert(not cache.find("https://imgur.com/torn").has_value());
+
+            // a negative ttl of 0 keeps no failure at all
+            cache.store("https://imgur.com/gone2", { .status = Resolution::Status::GONE });
+            assert(not cache.find("https://imgur.com/gone2").has_value());
+        }
+
+        fs::remove(file);
+    }
+
+    {
+        string url = "https://v.redd.it/r7gh3btvonx31/DASH_720?source=fallback";
+
+        auto response = perform_http_request(url);
+
+        if (not response.has_value())
+            return;
+
+        if (response->content_type == "video/mp4")
+        {
+            std::ofstream ofs("test.mp4",
+                              std::ofstream::binary |
+                              std::ofstream::trunc);
+            const char* data = response->body.data();
+            std::streamsize size = 
+                static_cast<std::streamsize>(response->body.size());
+            ofs.write(data, size);
+        }
+    }
+}
+
 }
\ No newline at end of file
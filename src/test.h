@@ -3,6 +3,10 @@
 namespace Test
 {
 
+// quick checks of the pure functions, run at every start
 void run_test();
 
+// mock servers, downloads and test_* files in the current folder, "rid --test"
+void run_integration_test();
+
 }
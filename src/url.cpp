@@ -0,0 +1,170 @@
+#include "pch.h"
+
+#include "url.h"
+
+namespace
+{
+
+bool is_alpha(char c)
+{
+    return (c >= 'a' and c <= 'z') or (c >= 'A' and c <= 'Z');
+}
+
+bool is_digit(char c)
+{
+    return c >= '0' and c <= '9';
+}
+
+// ALPHA *( ALPHA / DIGIT / "+" / "-" / "." )
+bool is_scheme(std::string_view scheme)
+{
+    if (scheme.empty() or not is_alpha(scheme.front()))
+        return false;
+
+    return std::all_of(scheme.begin(), scheme.end(), [](char c)
+    {
+        return is_alpha(c) or is_digit(c) or c == '+' or c == '-' or c == '.';
+    });
+}
+
+}
+
+Utils::Split_View Url_View::segments() const
+{
+    std::string_view segments = path;
+
+    if (segments.starts_with('/'))
+        segments.remove_prefix(1);
+
+    return Utils::Split_View(segments, "/");
+}
+
+std::string_view Url_View::file_name() const
+{
+    auto slash = path.rfind('/');
+
+    return slash == std::string_view::npos ? path : path.substr(slash + 1);
+}
+
+std::string_view Url_View::last_segment() const
+{
+    auto end = path.find_last_not_of('/');
+
+    if (end == std::string_view::npos)
+        return {};
+
+    std::string_view trimmed = path.substr(0, end + 1);
+    auto slash = trimmed.rfind('/');
+
+    return slash == std::string_view::npos ? trimmed : trimmed.substr(slash + 1);
+}
+
+std::string_view Url_View::extension() const
+{
+    std::string_view name = file_name();
+    auto dot = name.rfind('.');
+
+    if (dot == std::string_view::npos)
+        return {};
+
+    std::string_view extension = name.substr(dot + 1);
+
+    bool alnum = std::all_of(extension.begin(), extension.end(), [](char c)
+    {
+        return is_alpha(c) or is_digit(c);
+    });
+
+    return alnum ? extension : std::string_view{};
+}
+
+optional<std::string_view> Url_View::query_param(std::string_view name) const
+{
+    if (query.empty())
+        return {};
+
+    for (std::string_view param : Utils::Split_View(query, "&"))
+    {
+        auto equal = param.find('=');
+
+        if (param.substr(0, equal) != name)
+            continue;
+
+        return equal == std::string_view::npos ? std::string_view{} : param.substr(equal + 1);
+    }
+
+    return {};
+}
+
+optional<Url_View> parse_url(std::string_view input)
+{
+    for (char c : input)
+    {
+        if (static_cast<unsigned char>(c) <= 0x20 or c == 0x7f)
+            return {};
+    }
+
+    Url_View url;
+    std::string_view rest = input;
+
+    // fragment and query first, a '/' or ':' in them means nothing
+    if (auto hash = rest.find('#'); hash != std::string_view::npos)
+    {
+        url.fragment = rest.substr(hash + 1);
+        rest = rest.substr(0, hash);
+    }
+
+    if (auto question = rest.find('?'); question != std::string_view::npos)
+    {
+        url.query = rest.substr(question + 1);
+        rest = rest.substr(0, question);
+    }
+
+    // "a/b:c" is a relative path, the scheme can not have a '/'
+    if (auto colon = rest.find(':');
+        colon != std::string_view::npos and is_scheme(rest.substr(0, colon)))
+    {
+        url.scheme = rest.substr(0, colon);
+        rest.remove_prefix(colon + 1);
+    }
+
+    if (rest.starts_with("//"))
+    {
+        rest.remove_prefix(2);
+
+        auto authority_end = rest.find('/');
+        std::string_view authority = rest.substr(0, authority_end);
+        rest = authority_end == std::string_view::npos ? std::string_view{} : rest.substr(authority_end);
+
+        if (auto at = authority.rfind('@'); at != std::string_view::npos)
+        {
+            url.userinfo = authority.substr(0, at);
+            authority.remove_prefix(at + 1);
+        }
+
+        // "[::1]:8080", the colons inside the brackets are not the port's
+        size_t host_end = 0;
+
+        if (authority.starts_with('['))
+        {
+            host_end = authority.find(']');
+
+            if (host_end == std::string_view::npos)
+                return {};
+        }
+
+        if (auto colon = authority.find(':', host_end); colon != std::string_view::npos)
+        {
+            url.port = authority.substr(colon + 1);
+            authority = authority.substr(0, colon);
+
+            if (not std::all_of(url.port.begin(), url.port.end(), is_digit))
+                return {};
+        }
+
+        url.host = authority;
+    }
+
+    url.path = rest;
+
+    return url;
+}
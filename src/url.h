@@ -0,0 +1,47 @@
+#pragma once
+
+#include "rid.h"
+#include "utils.h"
+
+// The pieces of a URL (RFC 3986, absolute or relative reference) as views
+// into the string it was parsed from, nothing is copied or decoded: the
+// string has to outlive the Url_View.
+// "https://user@i.imgur.com:443/a/gBj52nI.jpg?x=1#top"
+//  scheme    "https"
+//  userinfo  "user"
+//  host      "i.imgur.com"
+//  port      "443"
+//  path      "/a/gBj52nI.jpg"
+//  query     "x=1"
+//  fragment  "top"
+struct Url_View
+{
+    std::string_view scheme; // "" for a relative reference
+    std::string_view userinfo;
+    std::string_view host; // "" when there is no "//authority"
+    std::string_view port;
+    std::string_view path;
+    std::string_view query; // without the '?'
+    std::string_view fragment; // without the '#'
+
+    // the segments of the path without the leading '/':
+    // "/a/b/" -> "a", "b", ""
+    Utils::Split_View segments() const;
+
+    // after the last '/' of the path, "" when the path ends with one
+    std::string_view file_name() const;
+
+    // last segment that is not empty: "/gallery/abc/" -> "abc"
+    std::string_view last_segment() const;
+
+    // "jpg" for ".../gBj52nI.jpg", only letters and digits after the last
+    // '.' of file_name(), "" for anything else
+    std::string_view extension() const;
+
+    // value of the first "name=value" of the query, not decoded
+    optional<std::string_view> query_param(std::string_view name) const;
+};
+
+// nothing when `url` has spaces or control characters, or a port that is
+// not a number
+optional<Url_View> parse_url(std::string_view url);
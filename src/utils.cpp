@@ -1,6 +1,15 @@
 #include "pch.h"
 
 #include "rid.h"
+#include "utils.h"
+#include "url.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RID_SSE2 1
+#include <emmintrin.h>
+#else
+#define RID_SSE2 0
+#endif
 
 namespace Utils
 {
@@ -106,51 +115,9 @@ std::string remove_invalid_charaters(std::string from)
 
 std::string extract_file_extension_from_url(const std::string& from)
 {
-    std::stringstream buff;
-
-    bool found = false;
-
-    for (auto it = from.rbegin();
-         it != from.rend();
-         ++it)
-    {
-        char c = *it;
-
-        if (c != '.')
-        {
-            if (c == '/' and
-                !found)
-            {
-                break; // no extension found
-            }
-            else
-            {
-                if (std::isalnum(c))
-                {
-                    buff << c;
-                }
-                else
-                {
-                    break; // extension with non alpha chars... ?
-                }
-            }
-        }
-        else
-        {
-            found = true;
-            break;
-        }
-    }
-
-    if (!found)
-    {
-        return "";
-    }
-
-    std::string ext = buff.str();
-    std::reverse(ext.begin(), ext.end());
+    auto url = parse_url(from);
 
-    return ext;
+    return url.has_value() ? string(url->extension()) : "";
 }
 
 size_t UTF8_len(const std::string& input)
@@ -231,45 +198,223 @@ bool is_domain_known(const string& domain)
     return res;
 }
 
+std::map<string, string> read_env_file(const fs::path& file)
+{
+    std::map<string, string> res;
+
+    std::ifstream ifs(file);
+
+    for (string line;
+         std::getline(ifs, line);
+         )
+    {
+        if (line.ends_with('\r'))
+            line.pop_back();
+
+        auto pos = line.find('=');
+
+        if (pos == string::npos)
+            continue;
+
+        res.emplace(line.substr(0, pos), line.substr(pos + 1));
+    }
+
+    return res;
+}
+
 string env(string_cref name)
 {
-    auto split_line = [](string_cref line)
-        -> std::pair<string, string>
+    auto values = read_env_file(".env");
+    auto it = values.find(name);
+
+    return it != values.end() ? it->second : "";
+}
+
+string environment_variable(string_cref name)
+{
+#ifdef _WIN32
+    char* value = nullptr;
+    size_t len = 0;
+
+    if (_dupenv_s(&value, &len, name.c_str()) != 0 or value == nullptr)
+        return {};
+
+    string res = value;
+    free(value);
+    return res;
+#else
+    const char* value = std::getenv(name.c_str());
+    return value ? value : "";
+#endif
+}
+
+optional<fs::path> app_data_folder()
+{
+#ifdef _WIN32
+    fs::path base = environment_variable("LOCALAPPDATA");
+#else
+    fs::path base = environment_variable("HOME");
+    if (not base.empty())
+        base /= ".cache";
+#endif
+
+    if (base.empty())
+        return {};
+
+    return base / "rid";
+}
+
+namespace
+{
+
+bool is_invalid_in_file_name(uint8_t c)
+{
+    return c < 0x20 or
+        c == '<' or c == '>' or c == ':' or c == '/' or c == '\\' or
+        c == '|' or c == '?' or c == '*' or c == '"';
+}
+
+bool is_continuation(uint8_t c)
+{
+    return (c & 0xC0) == 0x80;
+}
+
+// length of the well formed UTF-8 sequence at `p`, 0 when it is not one:
+// overlong forms, surrogates and code points past U+10FFFF are refused
+size_t utf8_sequence_len(const uint8_t* p, size_t left)
+{
+    uint8_t c = p[0];
+
+    if (c < 0x80)
+        return 1;
+
+    if (c >= 0xC2 and c <= 0xDF)
+        return left >= 2 and is_continuation(p[1]) ? 2 : 0;
+
+    if (c >= 0xE0 and c <= 0xEF)
     {
-        const string delimiter = "=";
-        auto pos = line.find(delimiter);
+        if (left < 3 or not is_continuation(p[1]) or not is_continuation(p[2]))
+            return 0;
 
-        if (pos == std::string::npos)
-            return {};
+        if ((c == 0xE0 and p[1] < 0xA0) or // overlong
+            (c == 0xED and p[1] > 0x9F)) // surrogate
+            return 0;
 
-        std::pair<string, string> res;
+        return 3;
+    }
 
-        res.first = line.substr(0, pos);
-        res.second = line.substr(pos + 1);
+    if (c >= 0xF0 and c <= 0xF4)
+    {
+        if (left < 4 or not is_continuation(p[1]) or not is_continuation(p[2]) or not is_continuation(p[3]))
+            return 0;
 
-        return res;
-    };
+        if ((c == 0xF0 and p[1] < 0x90) or // overlong
+            (c == 0xF4 and p[1] > 0x8F)) // past U+10FFFF
+            return 0;
+
+        return 4;
+    }
 
-    std::ifstream ifs(".env");
+    return 0;
+}
 
-    string res{};
+#if RID_SSE2
 
-    if (ifs.is_open())
+// 16 ASCII bytes with the invalid ones replaced, lanes of `invalid` set
+// where a byte was replaced
+__m128i sanitize_ascii_16(__m128i v)
+{
+    __m128i invalid = _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+
+    for (char c : { '<', '>', ':', '/', '\\', '|', '?', '*', '"' })
+        invalid = _mm_or_si128(invalid, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+
+    return _mm_or_si128(_mm_andnot_si128(invalid, v),
+                        _mm_and_si128(invalid, _mm_set1_epi8('_')));
+}
+
+#endif
+
+}
+
+File_Name_Info make_file_name(std::string_view title,
+                              size_t max_code_points,
+                              std::span<char> out)
+{
+    const auto* in = reinterpret_cast<const uint8_t*>(title.data());
+    const size_t size = title.size();
+    const size_t capacity = out.size();
+
+    File_Name_Info info;
+    size_t i = 0;
+
+#if RID_SSE2
+    size_t scalar_until = 0; // bytes known to contain non ASCII, not worth a vector load
+#endif
+
+    while (i < size and info.code_points < max_code_points)
     {
-        for (string line;
-             std::getline(ifs, line);
-             )
+#if RID_SSE2
+        if (i >= scalar_until and
+            size - i >= 16 and
+            max_code_points - info.code_points >= 16 and
+            capacity - info.size >= 16)
         {
-            auto [key, value] = split_line(line);
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            int non_ascii = _mm_movemask_epi8(v);
 
-            if (key == name)
+            if (non_ascii == 0)
             {
-                res = value;
-                break;
+                // the common case for latin titles: 16 code points at once
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out.data() + info.size), sanitize_ascii_16(v));
+
+                info.size += 16;
+                info.code_points += 16;
+                i += 16;
+                continue;
             }
+
+            // up to and including the first non ASCII byte, one at a time
+            scalar_until = i + static_cast<size_t>(std::countr_zero(static_cast<unsigned>(non_ascii))) + 1;
         }
+#endif
+
+        size_t len = utf8_sequence_len(in + i, size - i);
+        size_t out_len = len == 0 ? 1 : len;
+
+        if (capacity - info.size < out_len)
+            break;
+
+        if (len == 0)
+        {
+            // one byte of garbage, one replacement, the rest is still read
+            out[info.size] = '_';
+            info.repaired = true;
+            len = 1;
+        }
+        else if (len == 1)
+        {
+            out[info.size] = is_invalid_in_file_name(in[i]) ? '_' : static_cast<char>(in[i]);
+        }
+        else
+        {
+            std::memcpy(out.data() + info.size, in + i, len);
+        }
+
+        info.size += out_len;
+        info.code_points += 1;
+        i += len;
     }
 
+    info.truncated = i < size;
+
+    return info;
+}
+
+string make_file_name(std::string_view title, size_t max_code_points)
+{
+    string res(std::min<size_t>(title.size(), max_code_points * 4), '\0');
+    res.resize(make_file_name(title, max_code_points, res).size);
     return res;
 }
 
@@ -342,46 +487,15 @@ void save_after_to_file(const string& where,
 
 string extract_image_id_from_url(const string& url)
 {
-    std::stringstream buff;
-
-    bool found = false;
-
-    auto it = url.rbegin();
-
-    // check if url end with '/'
-    if (url.back() == '/')
-        ++it; // skip last character
-
-    for (;
-         it != url.rend();
-         ++it)
-    {
-        if (*it != '/')
-        {
-            buff << *it;
-        }
-        else
-        {
-            found = true;
-            break;
-        }
-    }
+    auto parsed = parse_url(url);
 
-    if (!found)
-    {
+    if (not parsed.has_value())
         return {};
-    }
-
-    std::string image_id = buff.str();
-    std::reverse(image_id.begin(), image_id.end());
 
-    if (auto pos = image_id.find('.');
-        pos != string::npos)
-    {
-        image_id = image_id.substr(0, pos);
-    }
+    // "https://imgur.com/a/gBj52nI/" and ".../gBj52nI.jpg" -> "gBj52nI"
+    std::string_view image_id = parsed->last_segment();
 
-    return image_id;
+    return string(image_id.substr(0, image_id.find('.')));
 }
 
 std::ostream& operator<<(std::ostream& os, const Download_Result& dr)
@@ -410,22 +524,234 @@ vector<string> split_string(string_cref str,
     vector<string> res;
     res.reserve(10);
 
-    size_t from = 0;
-    size_t to = str.find(delimiter, from);
+    for (std::string_view token : Split_View(str, delimiter))
+        res.emplace_back(token);
+
+    return res;
+}
+
+Split_View::Iterator::Iterator(std::string_view str, std::string_view delimiter) :
+    m_rest(str),
+    m_delimiter(delimiter),
+    m_end(false)
+{
+    ++*this;
+}
 
-    while (to != std::string::npos)
+Split_View::Iterator& Split_View::Iterator::operator++()
+{
+    if (m_last)
     {
-        string tmp = str.substr(from, to - from);
-        res.push_back(std::move(tmp));
-        
-        from = to + delimiter.length();
-        to = str.find(delimiter, from);
+        m_end = true;
+        m_token = {};
+        return *this;
     }
 
-    string tmp = str.substr(from);
-    res.push_back(std::move(tmp));
+    // an empty delimiter would match forever at the same place
+    auto pos = m_delimiter.empty() ? std::string_view::npos : m_rest.find(m_delimiter);
+
+    if (pos == std::string_view::npos)
+    {
+        m_token = m_rest;
+        m_rest = {};
+        m_last = true;
+    }
+    else
+    {
+        m_token = m_rest.substr(0, pos);
+        m_rest.remove_prefix(pos + m_delimiter.size());
+    }
+
+    return *this;
+}
+
+Split_View::Iterator Split_View::Iterator::operator++(int)
+{
+    auto copy = *this;
+    ++*this;
+    return copy;
+}
+
+bool Split_View::Iterator::operator==(const Iterator& other) const
+{
+    if (m_end or other.m_end)
+        return m_end == other.m_end;
+
+    return m_token.data() == other.m_token.data() and
+        m_token.size() == other.m_token.size() and
+        m_last == other.m_last;
+}
+
+Split_View::Split_View(std::string_view str, std::string_view delimiter) :
+    m_str(str),
+    m_delimiter(delimiter)
+{
+}
+
+Split_View::Iterator Split_View::begin() const
+{
+    return Iterator(m_str, m_delimiter);
+}
+
+Split_View::Iterator Split_View::end() const
+{
+    return {};
+}
+
+std::map<string, string> parse_http_headers(string_cref raw_headers)
+{
+    std::map<string, string> res;
+
+    for (std::string_view line : Split_View(raw_headers, "\r\n"))
+    {
+        // status line, a new response starts here
+        if (line.starts_with("HTTP/"))
+        {
+            res.clear();
+            continue;
+        }
+
+        auto pos = line.find(':');
+        if (pos == string::npos)
+            continue;
+
+        string name(line.substr(0, pos));
+        std::transform(name.begin(), name.end(), name.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+        auto value_start = line.find_first_not_of(" \t", pos + 1);
+        std::string_view value = value_start == string::npos ? "" : line.substr(value_start);
+
+        res[name] = value;
+    }
 
     return res;
 }
 
+namespace
+{
+
+struct Media_Extension
+{
+    std::string_view content_type;
+    std::string_view extension;
+};
+
+// every media type we save, and the one extension each is saved with
+constexpr Media_Extension g_MEDIA_EXTENSIONS[] = {
+    { "image/jpeg", "jpg" },
+    { "image/jpg", "jpg" },
+    { "image/pjpeg", "jpg" },
+    { "image/png", "png" },
+    { "image/gif", "gif" },
+    { "image/webp", "webp" },
+    { "image/bmp", "bmp" },
+    { "image/x-ms-bmp", "bmp" },
+    { "video/mp4", "mp4" },
+    { "video/webm", "webm" },
+    { "video/quicktime", "mov" },
+};
+
+Media_Type media_type_of(const Media_Extension& media)
+{
+    auto slash = media.content_type.find('/');
+
+    return { .type = string(media.content_type.substr(0, slash)), .extension = string(media.extension) };
+}
+
+const Media_Extension& media_extension_of(std::string_view content_type)
+{
+    for (const auto& media : g_MEDIA_EXTENSIONS)
+    {
+        if (media.content_type == content_type)
+            return media;
+    }
+
+    throw std::logic_error(std::format("{} is not in g_MEDIA_EXTENSIONS", content_type));
+}
+
+}
+
+optional<Media_Type> media_type_from_content_type(std::string_view content_type)
+{
+    // strip parameters like "; charset=binary"
+    content_type = content_type.substr(0, content_type.find_first_of("; "));
+
+    string lower(content_type);
+    std::transform(lower.begin(), lower.end(), lower.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+
+    for (const auto& media : g_MEDIA_EXTENSIONS)
+    {
+        if (media.content_type == lower)
+            return media_type_of(media);
+    }
+
+    return {};
+}
+
+optional<Media_Type> sniff_media_type(std::string_view bytes)
+{
+    auto starts_with = [&bytes](size_t offset, std::string_view magic)
+    {
+        return bytes.size() >= offset + magic.size() and
+            bytes.substr(offset, magic.size()) == magic;
+    };
+
+    if (starts_with(0, "\xFF\xD8\xFF"))
+        return media_type_of(media_extension_of("image/jpeg"));
+
+    if (starts_with(0, "\x89PNG\r\n\x1A\n"))
+        return media_type_of(media_extension_of("image/png"));
+
+    if (starts_with(0, "GIF87a") or
+        starts_with(0, "GIF89a"))
+        return media_type_of(media_extension_of("image/gif"));
+
+    if (starts_with(0, "RIFF") and
+        starts_with(8, "WEBP"))
+        return media_type_of(media_extension_of("image/webp"));
+
+    // ISO base media file: box size then "ftyp", then the brand. AVIF and
+    // HEIF images are ISO files too, they are not saved
+    if (starts_with(4, "ftyp") and
+        not (starts_with(8, "avif") or starts_with(8, "avis") or
+             starts_with(8, "heic") or starts_with(8, "mif1")))
+        return media_type_of(media_extension_of("video/mp4"));
+
+    return {};
+}
+
+const vector<string>& known_media_extensions()
+{
+    static const vector<string> extensions = []
+    {
+        // "jpeg" too, earlier runs saved their jpegs with it
+        vector<string> res{ "jpeg" };
+
+        for (const auto& media : g_MEDIA_EXTENSIONS)
+        {
+            if (std::find(res.begin(), res.end(), media.extension) == res.end())
+                res.emplace_back(media.extension);
+        }
+
+        return res;
+    }();
+
+    return extensions;
+}
+
+optional<string> find_media_file(string_cref destination_stem)
+{
+    for (const auto& ext : known_media_extensions())
+    {
+        auto path = std::format("{}.{}", destination_stem, ext);
+
+        if (fs::exists(path))
+            return path;
+    }
+
+    return {};
+}
+
 }
@@ -31,10 +31,44 @@ bool is_extension_allowed(const string& ext);
 
 bool is_domain_known(const string& domain);
 
+// "KEY=value" lines of a .env file, the first one of a key wins,
+// empty when the file does not exist
+std::map<string, string> read_env_file(const fs::path& file);
+
+// one value of ".env", the file is read again on every call: settings
+// of a run come from config()
 string env(string_cref name);
 
+// process environment, "" when not set
+string environment_variable(string_cref name);
+
+// state shared by every run and every dest-folder: "%LOCALAPPDATA%\\rid",
+// "~/.cache/rid" elsewhere, nothing when neither is known
+optional<fs::path> app_data_folder();
+
 void resize_string(string& str, size_t new_len);
 
+struct File_Name_Info
+{
+    size_t size = 0; // bytes written
+    size_t code_points = 0;
+    bool truncated = false; // max_code_points reached, or `out` full
+    bool repaired = false; // malformed UTF-8 replaced
+};
+
+// remove_invalid_charaters(), UTF8_len() and resize_string() in a single
+// pass with no allocation: the title is copied into `out` with the
+// characters Windows refuses in a file name (and control characters)
+// replaced by '_', cut after `max_code_points` code points or when `out`
+// is full, never in the middle of a code point. Malformed UTF-8 bytes
+// become '_' as well instead of throwing.
+// ASCII runs go 16 bytes at a time with SSE2
+File_Name_Info make_file_name(std::string_view title,
+                              size_t max_code_points,
+                              std::span<char> out);
+
+string make_file_name(std::string_view title, size_t max_code_points);
+
 string get_after_from_file(const string& from);
 
 void save_after_to_file(const string& where,
@@ -49,4 +83,69 @@ string to_str(const Download_Result& dr);
 vector<string> split_string(string_cref line,
                           string_cref delimiter);
 
+// split_string() without the copies: the tokens are views into `str`, which
+// has to outlive the range. Same tokens, empty ones included:
+// "a//b" -> "a", "", "b"
+class Split_View
+{
+public:
+    class Iterator
+    {
+    public:
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator() = default; // end
+        Iterator(std::string_view str, std::string_view delimiter);
+
+        std::string_view operator*() const { return m_token; }
+
+        Iterator& operator++();
+        Iterator operator++(int);
+
+        bool operator==(const Iterator& other) const;
+
+    private:
+        std::string_view m_rest;
+        std::string_view m_delimiter;
+        std::string_view m_token;
+        bool m_last = false; // m_token is the last one
+        bool m_end = true;
+    };
+
+    Split_View(std::string_view str, std::string_view delimiter);
+
+    // a temporary std::string would be destroyed before the range is walked,
+    // name it first
+    template <typename Str, typename Delimiter>
+        requires (std::is_same_v<Str, string> or std::is_same_v<Delimiter, string>)
+    Split_View(Str&&, Delimiter&&) = delete;
+
+    Iterator begin() const;
+    Iterator end() const;
+
+private:
+    std::string_view m_str;
+    std::string_view m_delimiter;
+};
+
+// header block captured by curl -> { lowercase name, value }, only the last
+// response is kept, redirects and "100 Continue" come before it
+std::map<string, string> parse_http_headers(string_cref raw_headers);
+
+// "image/jpeg; charset=..." -> { "image", "jpg" }, nothing for anything
+// that is not one of the images or videos we save: every type we save has
+// one extension of its own
+optional<Media_Type> media_type_from_content_type(std::string_view content_type);
+
+// looks at the magic bytes: JPEG, PNG, GIF, WebP and MP4 (ISO BMFF)
+optional<Media_Type> sniff_media_type(std::string_view first_bytes);
+
+// every extension media_type_from_content_type() and sniff_media_type()
+// can give, the only ones download_media_to_disk() saves with
+const vector<string>& known_media_extensions();
+
+// "<stem>.<ext>" already on disk for one of the extensions we save
+optional<string> find_media_file(string_cref destination_stem);
+
 }